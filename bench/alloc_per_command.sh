@@ -0,0 +1,30 @@
+#!/bin/bash
+# Heap allocations per command, from the [alloc] lines of [shell] alloc_stats = true.
+# The first run of a line parses it, the repeated runs show the steady state of the cached command.
+# The shell has to be built with -DSIMPLESHELL_ALLOC_STATS=ON, otherwise the allocations are not counted.
+# usage: bench/alloc_per_command.sh <path to simpleshell> [repeats]
+set -e
+
+SHELL_BIN=${1:?usage: $0 <path to simpleshell> [repeats]}
+REPEATS=${2:-20}
+
+HOME_DIR=$(mktemp -d)
+printf '[shell]\nalloc_stats = true\n' >"$HOME_DIR/.pshell"
+trap 'rm -rf "$HOME_DIR"' EXIT
+
+if ! HOME="$HOME_DIR" "$SHELL_BIN" -c 'true; echo end >/dev/null' 2>&1 >/dev/null | grep -q ' allocations, '; then
+    echo "$SHELL_BIN does not count the allocations, build it with -DSIMPLESHELL_ALLOC_STATS=ON" >&2
+    exit 1
+fi
+
+for command in '/bin/true' '/bin/true a b c' 'ls -d / >/dev/null' 'echo hello' 'echo /*' 'echo a | cat >/dev/null'; do
+    script=""
+    for ((i = 0; i < REPEATS; i++)); do
+        script+="$command"$'\n'
+    done
+    # the last line would be exec'd, a trailing builtin keeps it in the shell
+    script+="echo end >/dev/null"
+    HOME="$HOME_DIR" "$SHELL_BIN" -c "$script" 2>&1 >/dev/null | awk -v cmd="$command" '
+        /^\[alloc\]/ && index($0, ": " cmd) { n++; if (n == 1) { first = $2 } else { sum += $2; if ($2 > max) max = $2 } }
+        END { printf "%-28s first %6d  then avg %6.1f  max %6d\n", cmd, first, (n > 1 ? sum / (n - 1) : 0), max }'
+done
@@ -0,0 +1,38 @@
+#!/bin/bash
+# Recursive glob over a generated tree: simpleshell's parallel ** walk against the globstar of bash.
+# usage: bench/glob_tree.sh <path to simpleshell> [files] [directory]
+# The tree (10 x 10 x N/100000 directories of 1000 files) is kept in the directory for the next runs.
+set -e
+
+SHELL_BIN=${1:?usage: $0 <path to simpleshell> [files] [directory]}
+FILES=${2:-1000000}
+TREE=${3:-/tmp/simpleshell_glob_tree_$FILES}
+
+if [ ! -d "$TREE" ]; then
+    echo "creating $FILES files in $TREE"
+    dirs=$(((FILES + 999) / 1000))
+    for ((d = 0; d < dirs; d++)); do
+        dir="$TREE/a$((d % 10))/b$((d / 10 % 10))/c$((d / 100))"
+        mkdir -p "$dir"
+        (cd "$dir" && seq -f "file_%g.dat" 1000 | xargs touch)
+    done
+fi
+
+measure() {
+    local name=$1 start end
+    shift
+    # the first run warms the dentry cache
+    (cd "$TREE" && "$@" >/dev/null)
+    start=$(date +%s%N)
+    (cd "$TREE" && "$@" >/dev/null)
+    end=$(date +%s%N)
+    printf '%-12s %8.1f ms\n' "$name" "$(((end - start) / 100000))e-1"
+}
+
+# an empty configuration, the aliases of the user do not matter
+HOME_DIR=$(mktemp -d)
+touch "$HOME_DIR/.pshell"
+trap 'rm -rf "$HOME_DIR"' EXIT
+
+measure simpleshell env HOME="$HOME_DIR" "$SHELL_BIN" -c 'echo **/*.dat'
+measure bash bash -c 'shopt -s globstar; echo **/*.dat'
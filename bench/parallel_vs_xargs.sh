@@ -0,0 +1,24 @@
+#!/bin/bash
+# Throughput of thousands of short jobs: simpleshell's parallel builtin, xargs -P and GNU parallel (if installed).
+# usage: bench/parallel_vs_xargs.sh <path to simpleshell> [tasks] [jobs]
+set -e
+
+SHELL_BIN=${1:?usage: $0 <path to simpleshell> [tasks] [jobs]}
+TASKS=${2:-5000}
+JOBS=${3:-$(nproc)}
+
+measure() {
+    local name=$1 start end
+    shift
+    start=$(date +%s%N)
+    seq "$TASKS" | "$@" >/dev/null
+    end=$(date +%s%N)
+    printf '%-16s %8.1f ms %8.1f tasks/s\n' "$name" "$(((end - start) / 100000))e-1" \
+        "$((TASKS * 1000000000 / (end - start)))"
+}
+
+measure simpleshell "$SHELL_BIN" -c "parallel -j $JOBS true"
+measure xargs xargs -P "$JOBS" -n 1 true
+if command -v parallel >/dev/null && parallel --version 2>/dev/null | grep -q GNU; then
+    measure "GNU parallel" parallel -j "$JOBS" true
+fi
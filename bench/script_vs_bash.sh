@@ -0,0 +1,32 @@
+#!/bin/bash
+# Runs the same generated script with simpleshell and bash and prints the wall clock time of both.
+# usage: bench/script_vs_bash.sh <path to simpleshell> [lines]
+set -e
+
+SHELL_BIN=${1:?usage: $0 <path to simpleshell> [lines]}
+LINES=${2:-10000}
+SCRIPT=$(mktemp /tmp/simpleshell-bench.XXXXXX)
+trap 'rm -f "$SCRIPT"' EXIT
+
+{
+    echo "# generated benchmark script, $LINES lines"
+    for ((i = 0; i < LINES; ++i)); do
+        case $((i % 4)) in
+            0) echo "echo line $i > /dev/null" ;;
+            1) echo "echo \"quoted | $i\" > /dev/null && echo ok > /dev/null" ;;
+            2) echo "# comment $i" ;;
+            3) echo "echo a $i >/dev/null; echo b $i >/dev/null" ;;
+        esac
+    done
+} >"$SCRIPT"
+
+measure() {
+    local start end
+    start=$(date +%s%N)
+    "$@" "$SCRIPT" >/dev/null
+    end=$(date +%s%N)
+    printf '%-12s %8.1f ms\n' "$(basename "$1")" "$(((end - start) / 1000))e-3"
+}
+
+measure "$SHELL_BIN"
+measure bash
@@ -0,0 +1,98 @@
+// Launch latency of fork()+execv() against posix_spawn() while the resident memory of the launching
+// process grows, the same situation as the shell once the Lua state and the binary index are loaded.
+//
+// Usage: spawn_latency [max RSS in MiB] [iterations]
+
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern char ** environ;
+
+static const char * TRUE_BIN = "/bin/true";
+
+static long current_rss_kb() {
+    FILE * fp = fopen("/proc/self/statm", "r");
+    if (!fp) {
+        return -1;
+    }
+    long pages = 0;
+    long rss   = 0;
+    if (fscanf(fp, "%ld %ld", &pages, &rss) != 2) {
+        rss = -1;
+    }
+    fclose(fp);
+    return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double launch_fork(int iterations) {
+    char * argv[] = { const_cast<char *>(TRUE_BIN), nullptr };
+    auto   start  = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            execv(TRUE_BIN, argv);
+            _exit(127);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::micro>(elapsed).count() / iterations;
+}
+
+static double launch_spawn(int iterations) {
+    char *            argv[] = { const_cast<char *>(TRUE_BIN), nullptr };
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        pid_t pid;
+        if (posix_spawn(&pid, TRUE_BIN, nullptr, &attr, argv, environ) != 0) {
+            continue;
+        }
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    posix_spawnattr_destroy(&attr);
+    return std::chrono::duration<double, std::micro>(elapsed).count() / iterations;
+}
+
+int main(int argc, char * argv[]) {
+    const size_t max_mb     = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1024;
+    const int    iterations = argc > 2 ? std::atoi(argv[2]) : 200;
+
+    std::vector<std::unique_ptr<char[]>> ballast;
+    size_t                               allocated_mb = 0;
+
+    std::cout << std::setw(10) << "RSS MiB" << std::setw(16) << "fork+exec us" << std::setw(16) << "posix_spawn us"
+              << '\n';
+
+    for (size_t target_mb = 0; target_mb <= max_mb; target_mb = target_mb == 0 ? 64 : target_mb * 2) {
+        while (allocated_mb < target_mb) {
+            // touch every page, untouched pages would not be mapped and cost nothing to copy
+            auto block = std::make_unique<char[]>(1024 * 1024);
+            std::memset(block.get(), 1, 1024 * 1024);
+            ballast.push_back(std::move(block));
+            ++allocated_mb;
+        }
+        const double fork_us  = launch_fork(iterations);
+        const double spawn_us = launch_spawn(iterations);
+        std::cout << std::setw(10) << current_rss_kb() / 1024 << std::setw(16) << std::fixed << std::setprecision(1)
+                  << fork_us << std::setw(16) << spawn_us << '\n';
+    }
+    return 0;
+}
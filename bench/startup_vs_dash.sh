@@ -0,0 +1,20 @@
+#!/bin/bash
+# Startup-to-exec latency of a trivial -c command, simpleshell compared with dash.
+# usage: bench/startup_vs_dash.sh <path to simpleshell> [runs]
+set -e
+
+SHELL_BIN=${1:?usage: $0 <path to simpleshell> [runs]}
+RUNS=${2:-1000}
+
+measure() {
+    local start end
+    start=$(date +%s%N)
+    for ((i = 0; i < RUNS; ++i)); do
+        "$1" -c 'true' </dev/null >/dev/null
+    done
+    end=$(date +%s%N)
+    printf '%-12s %8.1f us/run\n' "$(basename "$1")" "$(((end - start) / RUNS))e-3"
+}
+
+measure "$SHELL_BIN"
+measure "$(command -v dash)"
@@ -0,0 +1,76 @@
+#ifndef ALIAS_TABLE_HPP
+#define ALIAS_TABLE_HPP
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "utils.h"
+
+/**
+ * The [aliases] section compiled into name -> argument list. The values are split once, when the configuration
+ * is read or an alias is added, with the same quote handling as the command line ("grep --color='auto'" keeps
+ * its quoted argument). The table is only touched when the section changes.
+ */
+class AliasTable {
+  public:
+    void set(const std::string & name, const std::string & value) {
+        std::vector<std::string> tokens;
+        utils::parse_arguments(value, tokens);
+        if (tokens.empty()) {
+            aliases_.erase(name);
+            return;
+        }
+        aliases_[name] = std::move(tokens);
+    }
+
+    bool erase(const std::string & name) { return aliases_.erase(name) > 0; }
+
+    void clear() { aliases_.clear(); }
+
+    size_t size() const { return aliases_.size(); }
+
+    std::vector<std::string> names() const {
+        std::vector<std::string> names;
+        for (const auto & alias : aliases_) {
+            names.push_back(alias.first);
+        }
+        return names;
+    }
+
+    /**
+     * Replace the first word with its alias, again and again while the result starts with another alias.
+     * Like in bash a name is not expanded twice in one chain, so "ls = ls -F" and "a = b", "b = a" stop
+     * instead of looping. Returns true when anything was replaced.
+     */
+    bool expand(std::vector<std::string> & args) const {
+        if (args.empty() || aliases_.empty()) {
+            return false;
+        }
+        std::vector<const std::string *> expanded;
+        while (true) {
+            const auto it = aliases_.find(args[0]);
+            if (it == aliases_.end()) {
+                break;
+            }
+            bool seen = false;
+            for (const auto * name : expanded) {
+                seen = seen || *name == it->first;
+            }
+            if (seen) {
+                break;
+            }
+            expanded.push_back(&it->first);
+
+            std::vector<std::string> result = it->second;
+            result.insert(result.end(), std::make_move_iterator(args.begin() + 1), std::make_move_iterator(args.end()));
+            args = std::move(result);
+        }
+        return !expanded.empty();
+    }
+
+  private:
+    std::unordered_map<std::string, std::vector<std::string>> aliases_;
+};
+
+#endif  // ALIAS_TABLE_HPP
@@ -0,0 +1,84 @@
+#include "Arena.hpp"
+
+#ifdef SIMPLESHELL_ALLOC_STATS
+#    include <cstdlib>
+#    include <new>
+
+// the replaced global allocation functions, they only count; the aligned and nothrow forms end up here too.
+// Built with -DSIMPLESHELL_ALLOC_STATS=ON only, otherwise every allocation of the shell would pay the increment.
+namespace {
+std::atomic<std::uint64_t> allocation_count{ 0 };
+
+void * allocate(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    void * p = std::malloc(size == 0 ? 1 : size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void * allocate_aligned(size_t size, std::align_val_t alignment) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    const size_t align = static_cast<size_t>(alignment);
+    void *       p     = std::aligned_alloc(align, (size + align - 1) / align * align);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+}  // namespace
+
+std::uint64_t arena::allocations() {
+    return allocation_count.load(std::memory_order_relaxed);
+}
+
+void * operator new(size_t size) {
+    return allocate(size);
+}
+
+void * operator new[](size_t size) {
+    return allocate(size);
+}
+
+void * operator new(size_t size, std::align_val_t alignment) {
+    return allocate_aligned(size, alignment);
+}
+
+void * operator new[](size_t size, std::align_val_t alignment) {
+    return allocate_aligned(size, alignment);
+}
+
+void operator delete(void * p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void * p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void * p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void * p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void * p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void * p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void * p, size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void * p, size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+#endif  // SIMPLESHELL_ALLOC_STATS
@@ -0,0 +1,142 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+/**
+ * Memory of a single command. The short lived buffers of a command (the argv of the exec, scratch vectors) are
+ * taken from a monotonic arena which starts in a fixed block and is reset when the outermost command returns,
+ * so a simple command does not reach malloc for them. With [shell] alloc_stats = true the arena bytes of each
+ * command are printed to stderr; built with -DSIMPLESHELL_ALLOC_STATS=ON the replaced operator new in Arena.cpp
+ * counts every heap allocation of the process and the count of the command is printed too.
+ */
+namespace arena {
+
+#ifdef SIMPLESHELL_ALLOC_STATS
+// heap allocations since the start, counted by the operator new of Arena.cpp
+std::uint64_t allocations();
+#endif
+
+class CommandArena : public std::pmr::memory_resource {
+  public:
+    // every thread has its own, the builtins of a pipeline run on threads of their own
+    static CommandArena & instance() {
+        thread_local CommandArena arena;
+        return arena;
+    }
+
+    CommandArena(const CommandArena &)             = delete;
+    CommandArena & operator=(const CommandArena &) = delete;
+
+    // drops everything allocated since the last reset, the fixed block is used again
+    void reset() {
+        resource_.release();
+        used_ = 0;
+    }
+
+    size_t used() const { return used_; }
+
+  private:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    alignas(std::max_align_t) std::byte block_[BLOCK_SIZE];
+    std::pmr::monotonic_buffer_resource resource_{ block_, BLOCK_SIZE, std::pmr::new_delete_resource() };
+    size_t                              used_ = 0;
+
+    CommandArena() = default;
+
+    void * do_allocate(size_t bytes, size_t alignment) override {
+        used_ += bytes;
+        return resource_.allocate(bytes, alignment);
+    }
+
+    // monotonic: the memory comes back with the reset
+    void do_deallocate(void * /*p*/, size_t /*bytes*/, size_t /*alignment*/) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override { return this == &other; }
+};
+
+/**
+ * One command of the shell, the arena of the thread is reset when the outermost scope ends: a builtin like
+ * source runs commands inside a command, their memory must outlive the inner ones.
+ */
+class Scope {
+  public:
+    // set from [shell] alloc_stats
+    inline static bool report = false;
+
+    explicit Scope(const std::string & command) : command_(report ? command : std::string()) {
+#ifdef SIMPLESHELL_ALLOC_STATS
+        if (depth_ == 0) {
+            start_ = arena::allocations();
+        }
+#endif
+        ++depth_;
+    }
+
+    Scope(const Scope &)             = delete;
+    Scope & operator=(const Scope &) = delete;
+
+    ~Scope() {
+        if (--depth_ != 0) {
+            return;
+        }
+        if (report) {
+            std::cerr << "[alloc] ";
+#ifdef SIMPLESHELL_ALLOC_STATS
+            std::cerr << arena::allocations() - start_ << " allocations, ";
+#endif
+            std::cerr << CommandArena::instance().used() << " arena bytes: " << command_ << '\n';
+        }
+        CommandArena::instance().reset();
+    }
+
+  private:
+    inline static thread_local size_t depth_ = 0;
+#ifdef SIMPLESHELL_ALLOC_STATS
+    inline static thread_local std::uint64_t start_ = 0;
+#endif
+    std::string command_;
+};
+
+/**
+ * The argv of an exec in one contiguous block of the arena: the pointer array first, the strings right after
+ * it, back to back. The block is ready for execve/posix_spawn, no vector<char *> is built on the heap.
+ */
+class Argv {
+  public:
+    explicit Argv(const std::vector<std::string> & args,
+                  std::pmr::memory_resource *      resource = &CommandArena::instance()) {
+        size_t size = (args.size() + 1) * sizeof(char *);
+        for (const auto & arg : args) {
+            size += arg.size() + 1;
+        }
+        argv_        = static_cast<char **>(resource->allocate(size, alignof(char *)));
+        char * chars = reinterpret_cast<char *>(argv_ + args.size() + 1);
+        for (size_t i = 0; i < args.size(); ++i) {
+            argv_[i] = chars;
+            std::memcpy(chars, args[i].c_str(), args[i].size() + 1);
+            chars += args[i].size() + 1;
+        }
+        argv_[args.size()] = nullptr;
+    }
+
+    char * const * data() const { return argv_; }
+
+    const char * operator[](size_t index) const { return argv_[index]; }
+
+  private:
+    // owned by the arena, released with its reset
+    char ** argv_ = nullptr;
+};
+
+}  // namespace arena
+
+#endif  // ARENA_HPP
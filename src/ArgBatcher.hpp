@@ -0,0 +1,96 @@
+#ifndef ARG_BATCHER_HPP
+#define ARG_BATCHER_HPP
+
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+extern char ** environ;
+
+/**
+ * Splits an argument list into the fewest command lines which fit the exec limit, like xargs does.
+ * The kernel counts every argument and environment string with its terminating NUL and its pointer, the limit
+ * is sysconf(_SC_ARG_MAX) minus the current environment and some headroom for the variables the shell adds.
+ */
+class ArgBatcher {
+  public:
+    // room left for the arguments of a single exec
+    static size_t limit() {
+        long arg_max = sysconf(_SC_ARG_MAX);
+        if (arg_max <= 0) {
+            arg_max = 128 * 1024;
+        }
+        size_t used = HEADROOM;
+        for (char ** env = environ; env != nullptr && *env != nullptr; ++env) {
+            used += strlen(*env) + 1 + sizeof(char *);
+        }
+        return static_cast<size_t>(arg_max) > used ? arg_max - used : 0;
+    }
+
+    static size_t cost(const std::string & arg) { return arg.size() + 1 + sizeof(char *); }
+
+    static bool fits(const std::vector<std::string> & args, size_t limit) {
+        size_t total = 0;
+        for (const auto & arg : args) {
+            total += ArgBatcher::cost(arg);
+            if (total > limit) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Every batch starts with the fixed arguments, the rest is packed greedily.
+     * max_args limits the number of packed arguments per batch (0: no limit). An argument which does not fit
+     * even alone gets a batch of its own, the exec reports the error for it.
+     */
+    static std::vector<std::vector<std::string>> split(const std::vector<std::string> & fixed,
+                                                       const std::vector<std::string> & args, size_t limit,
+                                                       size_t max_args = 0) {
+        size_t fixed_cost = 0;
+        for (const auto & arg : fixed) {
+            fixed_cost += ArgBatcher::cost(arg);
+        }
+
+        std::vector<std::vector<std::string>> batches;
+        std::vector<std::string>              current = fixed;
+        size_t                                size    = fixed_cost;
+        for (const auto & arg : args) {
+            const size_t packed = current.size() - fixed.size();
+            if (packed > 0 && (size + ArgBatcher::cost(arg) > limit || (max_args > 0 && packed >= max_args))) {
+                batches.push_back(std::move(current));
+                current = fixed;
+                size    = fixed_cost;
+            }
+            current.push_back(arg);
+            size += ArgBatcher::cost(arg);
+        }
+        if (current.size() > fixed.size()) {
+            batches.push_back(std::move(current));
+        }
+        return batches;
+    }
+
+    /**
+     * For the automatic mode of plain commands: the command and its leading options are repeated in every
+     * batch, like "rm -f" in "rm -f *.o". Arguments after the list ("cp *.txt dir/") can not be told apart.
+     */
+    static size_t fixed_count(const std::vector<std::string> & args) {
+        size_t count = 1;
+        while (count < args.size() && args[count].size() > 1 && args[count][0] == '-') {
+            if (args[count++] == "--") {
+                break;
+            }
+        }
+        return count;
+    }
+
+  private:
+    // xargs keeps 2048 bytes, the variables exported right before the launch get the same
+    static constexpr size_t HEADROOM = 2048;
+};
+
+#endif  // ARG_BATCHER_HPP
@@ -0,0 +1,194 @@
+#ifndef BUILTIN_REGISTRY_HPP
+#define BUILTIN_REGISTRY_HPP
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Redirection.hpp"
+
+/**
+ * Builtins are declared in a constexpr table, the lookup is a perfect hash computed by the compiler: one FNV-1a
+ * of the command name, one slot and one string compare. Every builtin carries the spec of its arguments, the help
+ * text, the completion and the validation before the call are all derived from it.
+ */
+namespace builtins {
+
+using Handler = void (*)(const std::vector<std::string> &, BuiltinIO &);
+
+enum class ArgKind : std::uint8_t {
+    AK_WORD,
+    AK_NUMBER,
+    AK_FILE,
+    AK_DIRECTORY,
+    // the pid of a job or %N, its job id
+    AK_JOB,
+    AK_ALIAS,
+    AK_PLUGIN,
+    AK_COMMAND,
+    // one of the words of the name, separated with '|'
+    AK_KEYWORD,
+};
+
+struct ArgSpec {
+    std::string_view name;
+    ArgKind          kind     = ArgKind::AK_WORD;
+    bool             optional = false;
+    // the rest of the arguments belong to it
+    bool             variadic = false;
+    std::string_view description;
+};
+
+struct Spec {
+    std::string_view        name;
+    std::string_view        description;
+    std::span<const ArgSpec> args;
+    Handler                 handler = nullptr;
+    // the options are parsed by the builtin itself, only the positional rules are skipped
+    bool                    free_form = false;
+
+    constexpr size_t min_args() const {
+        size_t count = 0;
+        for (const auto & arg : args) {
+            count += arg.optional ? 0 : 1;
+        }
+        return count;
+    }
+
+    constexpr size_t max_args() const {
+        return !args.empty() && args.back().variadic ? SIZE_MAX : args.size();
+    }
+
+    std::string usage() const {
+        std::string text(name);
+        for (const auto & arg : args) {
+            text += arg.optional ? " [" : " <";
+            text += arg.name;
+            text += arg.variadic ? "..." : "";
+            text += arg.optional ? "]" : ">";
+        }
+        return text;
+    }
+
+    std::string help() const {
+        std::string text = "Command: " + std::string(name) + "\nDescription: " + std::string(description) +
+                           "\nUsage: " + this->usage() + "\n";
+        if (!args.empty()) {
+            text += "Params: \n";
+            for (const auto & arg : args) {
+                text += "\t  - " + std::string(arg.name) + "\t\t  " + std::string(arg.description) + "\n";
+            }
+        }
+        return text;
+    }
+
+    static bool is_keyword(std::string_view keywords, std::string_view word) {
+        while (!keywords.empty()) {
+            const size_t end = keywords.find('|');
+            if (keywords.substr(0, end) == word) {
+                return true;
+            }
+            if (end == std::string_view::npos) {
+                break;
+            }
+            keywords.remove_prefix(end + 1);
+        }
+        return false;
+    }
+
+    // args[0] is the name of the command
+    bool validate(const std::vector<std::string> & argv, std::string & error) const {
+        if (free_form) {
+            return true;
+        }
+        const size_t count = argv.size() - 1;
+        if (count < this->min_args() || count > this->max_args()) {
+            error = "usage: " + this->usage();
+            return false;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            const ArgSpec &     spec  = args[std::min(i, args.size() - 1)];
+            const std::string & value = argv[i + 1];
+            bool                valid = true;
+            if (spec.kind == ArgKind::AK_NUMBER || spec.kind == ArgKind::AK_JOB) {
+                // a job is a pid or %N, its job id
+                const size_t first = spec.kind == ArgKind::AK_JOB && value.size() > 1 && value[0] == '%' ? 1 : 0;
+                valid = value.size() > first && value.find_first_not_of("0123456789", first) == std::string::npos;
+            } else if (spec.kind == ArgKind::AK_KEYWORD) {
+                valid = Spec::is_keyword(spec.name, value);
+            }
+            if (!valid) {
+                error = "invalid " + std::string(spec.name) + ": '" + value + "', usage: " + this->usage();
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+template <size_t N> class PerfectHash {
+  public:
+    consteval explicit PerfectHash(const std::array<Spec, N> & specs) {
+        for (seed_ = 1;; ++seed_) {
+            slots_.fill(EMPTY);
+            bool collision = false;
+            for (size_t i = 0; i < N && !collision; ++i) {
+                auto & slot = slots_[PerfectHash::hash(specs[i].name, seed_) & (SIZE - 1)];
+                collision   = slot != EMPTY;
+                slot        = static_cast<std::uint8_t>(i);
+            }
+            if (!collision) {
+                return;
+            }
+        }
+    }
+
+    // index in the table, or -1; the caller compares the name, the slot of an unknown name may be taken
+    constexpr int slot(std::string_view name) const {
+        const std::uint8_t index = slots_[PerfectHash::hash(name, seed_) & (SIZE - 1)];
+        return index == EMPTY ? -1 : index;
+    }
+
+  private:
+    static constexpr size_t       SIZE  = std::bit_ceil(N * 2);
+    static constexpr std::uint8_t EMPTY = 0xff;
+    static_assert(N < EMPTY, "the slots are stored in a byte");
+
+    std::uint32_t                   seed_ = 0;
+    std::array<std::uint8_t, SIZE>  slots_{};
+
+    static constexpr std::uint32_t hash(std::string_view name, std::uint32_t seed) {
+        std::uint32_t value = 2166136261u ^ seed;
+        for (const char c : name) {
+            value ^= static_cast<unsigned char>(c);
+            value *= 16777619u;
+        }
+        return value ^ (value >> 15);
+    }
+};
+
+// the table and its hash, find() returns nullptr for a name which is not in the table
+template <size_t N> class Registry {
+  public:
+    consteval explicit Registry(const std::array<Spec, N> & specs) : specs_(specs), index_(specs) {}
+
+    constexpr const Spec * find(std::string_view name) const {
+        const int index = index_.slot(name);
+        return index >= 0 && specs_[index].name == name ? &specs_[index] : nullptr;
+    }
+
+    constexpr const std::array<Spec, N> & all() const { return specs_; }
+
+  private:
+    std::array<Spec, N> specs_;
+    PerfectHash<N>      index_;
+};
+
+}  // namespace builtins
+
+#endif  // BUILTIN_REGISTRY_HPP
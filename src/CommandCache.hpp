@@ -0,0 +1,179 @@
+#ifndef COMMAND_CACHE_HPP
+#define COMMAND_CACHE_HPP
+
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "Redirection.hpp"
+
+// bounded map, the least recently used entry is evicted first
+template <typename Key, typename Value> class LruCache {
+  public:
+    explicit LruCache(size_t capacity) : capacity_(capacity) {}
+
+    Value * get(const Key & key) {
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            return nullptr;
+        }
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return &it->second->second;
+    }
+
+    Value & put(const Key & key, Value value) {
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            it->second->second = std::move(value);
+            entries_.splice(entries_.begin(), entries_, it->second);
+            return it->second->second;
+        }
+        entries_.emplace_front(key, std::move(value));
+        index_[key] = entries_.begin();
+        this->evict();
+        return entries_.front().second;
+    }
+
+    bool erase(const Key & key) {
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            return false;
+        }
+        entries_.erase(it->second);
+        index_.erase(it);
+        return true;
+    }
+
+    void clear() {
+        entries_.clear();
+        index_.clear();
+    }
+
+    size_t size() const { return entries_.size(); }
+
+    size_t capacity() const { return capacity_; }
+
+    // the entry evicted by the next put of a new key, nullptr when there is room
+    const std::pair<Key, Value> * next_victim() const {
+        return entries_.size() >= capacity_ && !entries_.empty() ? &entries_.back() : nullptr;
+    }
+
+    void set_capacity(size_t capacity) {
+        capacity_ = capacity;
+        this->evict();
+    }
+
+  private:
+    using entry_list = std::list<std::pair<Key, Value>>;
+
+    size_t                                                capacity_;
+    entry_list                                            entries_;
+    std::unordered_map<Key, typename entry_list::iterator> index_;
+
+    void evict() {
+        while (entries_.size() > capacity_ && !entries_.empty()) {
+            index_.erase(entries_.back().first);
+            entries_.pop_back();
+        }
+    }
+};
+
+/**
+ * Raw command line -> split, alias resolved and variable expanded command.
+ * Every entry remembers the epoch it was built in, the epoch is bumped when a variable used by a cached
+ * line, an alias, the cwd or PATH changes, so stale entries are rebuilt on the next lookup.
+ * Globs depend on the directory contents, they are expanded again on every run.
+ */
+class CommandCache {
+  public:
+    struct Stage {
+        std::vector<std::string> args;
+        std::vector<Redirection> redirections;
+        // one flag per argument, a quoted word is not expanded
+        std::vector<bool>        quoted;
+        bool                     has_glob = false;
+    };
+
+    struct Entry {
+        std::vector<Stage> stages;
+        bool               run_in_background = false;
+        std::uint64_t      epoch             = 0;
+    };
+
+    explicit CommandCache(size_t capacity = 128) : entries_(capacity) {}
+
+    static std::uint64_t epoch() { return epoch_.load(std::memory_order_acquire); }
+
+    static void bump_epoch() { epoch_.fetch_add(1, std::memory_order_acq_rel); }
+
+    // only variables which are referenced by a cached line (and the ones used for path resolution) invalidate
+    static void variable_changed(const std::string & name) {
+        if (name == "PATH" || name == "PWD" || name == "HOME") {
+            CommandCache::bump_epoch();
+            return;
+        }
+        std::lock_guard<std::mutex> lock(referenced_mutex_);
+        if (referenced_variables_.contains(name)) {
+            CommandCache::bump_epoch();
+        }
+    }
+
+    // the entry is shared, a builtin may run other commands (and evict it) while it is executed
+    std::shared_ptr<const Entry> find(const std::string & line) {
+        auto * entry = entries_.get(line);
+        if (entry == nullptr) {
+            return nullptr;
+        }
+        if ((*entry)->epoch != CommandCache::epoch()) {
+            entries_.erase(line);
+            return nullptr;
+        }
+        return *entry;
+    }
+
+    std::shared_ptr<const Entry> store(const std::string & line, Entry entry) {
+        CommandCache::remember_variables(line);
+        entry.epoch = CommandCache::epoch();
+        return entries_.put(line, std::make_shared<const Entry>(std::move(entry)));
+    }
+
+    void clear() { entries_.clear(); }
+
+    size_t size() const { return entries_.size(); }
+
+    void set_capacity(size_t capacity) { entries_.set_capacity(capacity); }
+
+  private:
+    LruCache<std::string, std::shared_ptr<const Entry>> entries_;
+
+    inline static std::atomic<std::uint64_t>       epoch_ = 1;
+    inline static std::mutex                       referenced_mutex_;
+    inline static std::unordered_set<std::string> referenced_variables_;
+
+    // collects the ${NAME} references of the line
+    static void remember_variables(const std::string & line) {
+        std::lock_guard<std::mutex> lock(referenced_mutex_);
+        size_t                      pos = 0;
+        while ((pos = line.find("${", pos)) != std::string::npos) {
+            pos += 2;
+            size_t end = pos;
+            while (end < line.size() && (std::isalnum(static_cast<unsigned char>(line[end])) || line[end] == '_')) {
+                ++end;
+            }
+            if (end > pos) {
+                referenced_variables_.insert(line.substr(pos, end - pos));
+            }
+            pos = end;
+        }
+    }
+};
+
+#endif  // COMMAND_CACHE_HPP
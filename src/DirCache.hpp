@@ -0,0 +1,300 @@
+#ifndef DIR_CACHE_HPP
+#define DIR_CACHE_HPP
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "CommandCache.hpp"
+
+/**
+ * The entries of the recently used directories, shared by the globs, the filename completion and cd.
+ * A listing is checked at most once per generation: the shell starts a new one for every command and for every
+ * completion, so the globs of one command or the candidates of one TAB cost no syscall after the first read.
+ * A listing is valid while the inode and the mtime of its directory are the same (one stat). With inotify the
+ * stat is not needed either: a change in a watched directory drops its listing, checking all of them is one
+ * read() of the inotify fd. The number of listings is bounded, the least recently used one is dropped.
+ */
+class DirCache {
+  public:
+    struct Entry {
+        std::string   name;
+        unsigned char type      = DT_UNKNOWN;
+        // symlinks are followed
+        bool          directory = false;
+    };
+
+    struct Listing {
+        // sorted by name
+        std::vector<Entry> entries;
+        dev_t              dev   = 0;
+        ino_t              ino   = 0;
+        timespec           mtime = {};
+
+        const Entry * find(std::string_view name) const {
+            const auto it = std::lower_bound(entries.begin(), entries.end(), name,
+                                             [](const Entry & entry, std::string_view key) { return entry.name < key; });
+            return it != entries.end() && it->name == name ? &*it : nullptr;
+        }
+    };
+
+    static DirCache & instance() {
+        static DirCache instance;
+        return instance;
+    }
+
+    DirCache(const DirCache &)             = delete;
+    DirCache & operator=(const DirCache &) = delete;
+
+    // 0 disables the cache, every listing is read again
+    void set_capacity(size_t capacity) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (listings_.size() > capacity && listings_.next_victim() != nullptr) {
+            this->drop(std::string(listings_.next_victim()->first));
+        }
+        listings_.set_capacity(capacity);
+    }
+
+    void set_inotify(bool enabled) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (enabled && inotify_fd_ == -1) {
+            inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        } else if (!enabled && inotify_fd_ != -1) {
+            this->drop_all();
+            close(inotify_fd_);
+            inotify_fd_ = -1;
+        }
+    }
+
+    // -1 when inotify is off; the event loop drops the changed listings while the shell waits at the prompt
+    int inotify_fd() const { return inotify_fd_; }
+
+    void read_pending_events() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        this->read_events();
+    }
+
+    // the listings are checked again on their next use
+    void next_generation() { ++generation_; }
+
+    // the entries of the directory, nullptr when it can not be read; relative paths are relative to $PWD
+    std::shared_ptr<const Listing> list(const std::string & path) {
+        const std::string           key = DirCache::absolute(path);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (listings_.capacity() == 0) {
+            return DirCache::read_listing(key);
+        }
+        this->read_events();
+
+        Slot * slot = listings_.get(key);
+        if (slot != nullptr && slot->checked != generation_) {
+            struct stat st {};
+
+            const bool valid = slot->watch != -1 ||
+                               (stat(key.c_str(), &st) == 0 && st.st_ino == slot->listing->ino &&
+                                st.st_dev == slot->listing->dev && st.st_mtim.tv_sec == slot->listing->mtime.tv_sec &&
+                                st.st_mtim.tv_nsec == slot->listing->mtime.tv_nsec);
+            if (valid) {
+                slot->checked = generation_;
+            } else {
+                this->drop(key);
+                slot = nullptr;
+            }
+        }
+        if (slot != nullptr) {
+            return slot->listing;
+        }
+
+        const auto * victim = listings_.next_victim();
+        if (victim != nullptr) {
+            this->drop(std::string(victim->first));
+        }
+        // the watch comes first, a change during the read is not lost
+        int watch = -1;
+        if (inotify_fd_ != -1) {
+            watch = inotify_add_watch(inotify_fd_, key.c_str(),
+                                      IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |
+                                          IN_MOVE_SELF | IN_ONLYDIR);
+        }
+        auto listing = DirCache::read_listing(key);
+        if (listing == nullptr) {
+            if (watch != -1 && !watches_.contains(watch)) {
+                inotify_rm_watch(inotify_fd_, watch);
+            }
+            return nullptr;
+        }
+        // the same directory under another path (a symlink) has the same watch, this path compares the mtime
+        if (watch != -1 && !watches_.try_emplace(watch, key).second) {
+            watch = -1;
+        }
+        listings_.put(key, Slot{ listing, generation_, watch });
+        return listing;
+    }
+
+    // the entry of the path in the listing of its parent, false when it does not exist
+    bool lookup(const std::string & path, Entry & entry) {
+        const std::string key = DirCache::absolute(path);
+        if (key == "/") {
+            entry = Entry{ "/", DT_DIR, true };
+            return true;
+        }
+        const size_t slash   = key.rfind('/');
+        const auto   listing = this->list(slash == 0 ? "/" : key.substr(0, slash));
+        const auto * found   = listing != nullptr ? listing->find(std::string_view(key).substr(slash + 1)) : nullptr;
+        if (found == nullptr) {
+            return false;
+        }
+        entry = *found;
+        return true;
+    }
+
+    // "", "." and relative paths are resolved against $PWD, the trailing slashes are dropped
+    static std::string absolute(const std::string & path) {
+        std::string result;
+        if (path.empty() || path[0] != '/') {
+            const char * pwd = getenv("PWD");
+            result           = pwd != nullptr ? pwd : ".";
+            if (!path.empty() && path != "." && path != "./") {
+                result += "/" + path;
+            }
+        } else {
+            result = path;
+        }
+        while (result.size() > 1 && result.back() == '/') {
+            result.pop_back();
+        }
+        return result;
+    }
+
+  private:
+    struct Slot {
+        std::shared_ptr<const Listing> listing;
+        // the generation of the last check
+        std::uint64_t                  checked = 0;
+        // the inotify watch, -1 when the mtime is compared
+        int                            watch   = -1;
+    };
+
+    struct linux_dirent64 {
+        std::uint64_t  d_ino;
+        std::int64_t   d_off;
+        unsigned short d_reclen;
+        unsigned char  d_type;
+        char           d_name[];
+    };
+
+    std::mutex                           mutex_;
+    LruCache<std::string, Slot>          listings_{ 256 };
+    std::unordered_map<int, std::string> watches_;
+    int                                  inotify_fd_ = -1;
+    std::atomic<std::uint64_t>           generation_{ 1 };
+
+    DirCache() = default;
+
+    ~DirCache() {
+        if (inotify_fd_ != -1) {
+            close(inotify_fd_);
+        }
+    }
+
+    void drop(const std::string & key) {
+        const Slot * slot = listings_.get(key);
+        if (slot != nullptr && slot->watch != -1) {
+            inotify_rm_watch(inotify_fd_, slot->watch);
+            watches_.erase(slot->watch);
+        }
+        listings_.erase(key);
+    }
+
+    void drop_all() {
+        for (const auto & watch : watches_) {
+            inotify_rm_watch(inotify_fd_, watch.first);
+        }
+        watches_.clear();
+        listings_.clear();
+    }
+
+    // every event drops the listing of its directory, the next list() reads it again
+    void read_events() {
+        if (inotify_fd_ == -1) {
+            return;
+        }
+        alignas(inotify_event) char buffer[4096];
+        while (true) {
+            const ssize_t size = read(inotify_fd_, buffer, sizeof(buffer));
+            if (size <= 0) {
+                return;
+            }
+            for (ssize_t offset = 0; offset < size;) {
+                const auto * event = reinterpret_cast<const inotify_event *>(buffer + offset);
+                offset += sizeof(inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    this->drop_all();
+                    continue;
+                }
+                const auto it = watches_.find(event->wd);
+                if (it != watches_.end()) {
+                    this->drop(std::string(it->second));
+                }
+            }
+        }
+    }
+
+    static std::shared_ptr<const Listing> read_listing(const std::string & path) {
+        const int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            return nullptr;
+        }
+        auto        listing = std::make_shared<Listing>();
+        struct stat st {};
+
+        fstat(fd, &st);
+        listing->dev   = st.st_dev;
+        listing->ino   = st.st_ino;
+        listing->mtime = st.st_mtim;
+
+        alignas(linux_dirent64) char buffer[32768];
+        while (true) {
+            const long size = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+            if (size <= 0) {
+                break;
+            }
+            for (long offset = 0; offset < size;) {
+                const auto *           entry = reinterpret_cast<const linux_dirent64 *>(buffer + offset);
+                const std::string_view name(entry->d_name);
+                offset += entry->d_reclen;
+                if (name == "." || name == "..") {
+                    continue;
+                }
+                bool directory = entry->d_type == DT_DIR;
+                // the stat d_type would have spared: unknown types and the targets of the symlinks
+                if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+                    struct stat target {};
+
+                    directory = fstatat(fd, entry->d_name, &target, 0) == 0 && S_ISDIR(target.st_mode);
+                }
+                listing->entries.push_back(Entry{ std::string(name), entry->d_type, directory });
+            }
+        }
+        close(fd);
+        std::sort(listing->entries.begin(), listing->entries.end(),
+                  [](const Entry & a, const Entry & b) { return a.name < b.name; });
+        return listing;
+    }
+};
+
+#endif  // DIR_CACHE_HPP
@@ -0,0 +1,152 @@
+#ifndef EVENT_LOOP_HPP
+#define EVENT_LOOP_HPP
+
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <unordered_map>
+
+/**
+ * The one place where the interactive shell waits. readline is fed from the terminal fd by the epoll, the
+ * signals of the shell come through a signalfd in the same epoll: reaping the children, clearing the line on
+ * ^C and redrawing on a resize run in the loop like any other event, no code runs inside a signal handler.
+ * The signals are blocked by open(), before any thread is started, so every thread of the shell inherits the
+ * mask and none of them gets them delivered. Watchers (the inotify fd of DirCache, the pidfds of the jobs) are
+ * added the same way.
+ */
+class EventLoop {
+  public:
+    using Handler       = std::function<void(std::uint32_t events)>;
+    using SignalHandler = std::function<void(const signalfd_siginfo & info)>;
+
+    static EventLoop & instance() {
+        static EventLoop instance;
+        return instance;
+    }
+
+    EventLoop(const EventLoop &)             = delete;
+    EventLoop & operator=(const EventLoop &) = delete;
+
+    // blocks the signals and creates the epoll and the signalfd, call it before the first thread starts
+    bool open(std::initializer_list<int> signals) {
+        sigemptyset(&signals_);
+        for (const int sig : signals) {
+            sigaddset(&signals_, sig);
+        }
+        sigprocmask(SIG_BLOCK, &signals_, nullptr);
+
+        epoll_fd_  = epoll_create1(EPOLL_CLOEXEC);
+        signal_fd_ = signalfd(-1, &signals_, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (epoll_fd_ == -1 || signal_fd_ == -1) {
+            perror("event loop");
+            this->close_fds();
+            sigprocmask(SIG_UNBLOCK, &signals_, nullptr);
+            return false;
+        }
+        epoll_event event{};
+        event.events  = EPOLLIN;
+        event.data.fd = signal_fd_;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, signal_fd_, &event);
+        return true;
+    }
+
+    bool is_open() const { return epoll_fd_ != -1; }
+
+    // the handler is called from run_once() while the fd has one of the events
+    bool add(int fd, std::uint32_t events, Handler handler) {
+        epoll_event event{};
+        event.events  = events;
+        event.data.fd = fd;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) == -1) {
+            perror("epoll_ctl");
+            return false;
+        }
+        handlers_[fd] = std::move(handler);
+        return true;
+    }
+
+    void remove(int fd) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        handlers_.erase(fd);
+    }
+
+    // the signal has to be one of the signals given to open()
+    void on_signal(int sig, SignalHandler handler) { signal_handlers_[sig] = std::move(handler); }
+
+    // waits at most timeout_ms (-1: until an event) and runs the handlers of the events, false on an error
+    bool run_once(int timeout_ms) {
+        epoll_event events[MAX_EVENTS];
+        const int   count = epoll_wait(epoll_fd_, events, MAX_EVENTS, timeout_ms);
+        if (count == -1) {
+            return errno == EINTR;
+        }
+        for (int i = 0; i < count; ++i) {
+            const int fd = events[i].data.fd;
+            if (fd == signal_fd_) {
+                this->read_signals();
+                continue;
+            }
+            // a handler may remove itself or an fd which is still in this batch
+            Handler handler;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                const auto                  it = handlers_.find(fd);
+                if (it == handlers_.end()) {
+                    continue;
+                }
+                handler = it->second;
+            }
+            handler(events[i].events);
+        }
+        return true;
+    }
+
+  private:
+    static constexpr int MAX_EVENTS = 16;
+
+    int                                    epoll_fd_  = -1;
+    int                                    signal_fd_ = -1;
+    sigset_t                               signals_{};
+    std::unordered_map<int, Handler>       handlers_;
+    std::unordered_map<int, SignalHandler> signal_handlers_;
+    // the fds of the jobs are added by the thread which starts them, a builtin of a pipeline may do it too
+    std::mutex                             mutex_;
+
+    EventLoop() = default;
+
+    ~EventLoop() { this->close_fds(); }
+
+    void close_fds() {
+        if (signal_fd_ != -1) {
+            close(signal_fd_);
+            signal_fd_ = -1;
+        }
+        if (epoll_fd_ != -1) {
+            close(epoll_fd_);
+            epoll_fd_ = -1;
+        }
+    }
+
+    // the same signal is merged while it is pending, one SIGCHLD may stand for many children
+    void read_signals() {
+        signalfd_siginfo info{};
+        while (read(signal_fd_, &info, sizeof(info)) == static_cast<ssize_t>(sizeof(info))) {
+            const auto it = signal_handlers_.find(static_cast<int>(info.ssi_signo));
+            if (it != signal_handlers_.end()) {
+                it->second(info);
+            }
+        }
+    }
+};
+
+#endif  // EVENT_LOOP_HPP
@@ -0,0 +1,387 @@
+#ifndef FORK_SERVER_HPP
+#define FORK_SERVER_HPP
+
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ini.h"
+#include "Redirection.hpp"
+
+/**
+ * Tiny launcher process forked at the very start of main(), before the Lua state and the indexes exist.
+ * The shell sends argv, envp, cwd, the redirections and the stdio fds (SCM_RIGHTS) over a unix socket, the
+ * helper clones the command with CLONE_PARENT so the shell stays the parent and can wait for it like for any
+ * other child.
+ * The launch cost stays the same no matter how much memory the shell uses.
+ */
+class ForkServer {
+  public:
+    static ForkServer & instance() {
+        static ForkServer instance;
+        return instance;
+    }
+
+    ForkServer(const ForkServer &)             = delete;
+    ForkServer & operator=(const ForkServer &) = delete;
+
+    ~ForkServer() { this->stop(); }
+
+    // reads the "fork_server" key from the [shell] section of the configuration file
+    static bool enabled_in_config(const std::string & config_file) {
+        bool enabled = false;
+        ini_parse(config_file.c_str(), ForkServer::config_handler, &enabled);
+        return enabled;
+    }
+
+    bool start() {
+        if (this->available()) {
+            return true;
+        }
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+            perror("fork server: socketpair");
+            return false;
+        }
+        const pid_t shell_pid = getpid();
+        const pid_t pid       = fork();
+        if (pid == -1) {
+            perror("fork server: fork");
+            close(fds[0]);
+            close(fds[1]);
+            return false;
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            if (getppid() != shell_pid) {
+                _exit(EXIT_SUCCESS);
+            }
+            ForkServer::serve(fds[1]);
+            _exit(EXIT_SUCCESS);
+        }
+        close(fds[1]);
+        this->socket_fd_  = fds[0];
+        this->helper_pid_ = pid;
+        return true;
+    }
+
+    void stop() {
+        if (this->socket_fd_ != -1) {
+            close(this->socket_fd_);
+            this->socket_fd_ = -1;
+        }
+        this->helper_pid_ = -1;
+    }
+
+    bool available() const { return this->socket_fd_ != -1; }
+
+    pid_t helper_pid() const { return this->helper_pid_; }
+
+    /**
+     * Launch a command through the helper. Returns the pid with error 0, or error is the errno of the step which
+     * failed: the pid is then the one of the child which exited with 127 (the shell is its parent and reaps it)
+     * or -1 when there is no child. When the helper itself is gone the server is stopped and error is EPIPE,
+     * the caller falls back to its own launcher.
+     */
+    pid_t spawn(const std::vector<std::string> & args, int in_fd, int out_fd, int err_fd, pid_t pgid,
+                const std::vector<Redirection> & redirections, int & error) {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        error = EPIPE;
+        if (!this->available() || args.empty()) {
+            return -1;
+        }
+
+        std::string payload;
+        ForkServer::put_strings(payload, args);
+        std::vector<std::string> env;
+        for (char ** e = environ; *e != nullptr; ++e) {
+            env.emplace_back(*e);
+        }
+        ForkServer::put_strings(payload, env);
+        char * cwd = getcwd(nullptr, 0);
+        ForkServer::put_strings(payload, { cwd != nullptr ? cwd : "" });
+        free(cwd);
+        std::vector<std::string> redirection_lines;
+        for (const auto & redirection : redirections) {
+            redirection_lines.push_back(redirection.serialize());
+        }
+        ForkServer::put_strings(payload, redirection_lines);
+
+        request_header header{ static_cast<std::uint32_t>(payload.size()), pgid };
+        const int      stdio[3] = { in_fd, out_fd, err_fd };
+
+        if (!ForkServer::send_with_fds(this->socket_fd_, &header, sizeof(header), stdio, 3) ||
+            !ForkServer::write_all(this->socket_fd_, payload.data(), payload.size())) {
+            this->stop();
+            return -1;
+        }
+
+        reply_header reply{};
+        if (!ForkServer::read_all(this->socket_fd_, &reply, sizeof(reply))) {
+            this->stop();
+            return -1;
+        }
+        error = reply.error;
+        return reply.pid;
+    }
+
+  private:
+    ForkServer() = default;
+
+    struct request_header {
+        std::uint32_t payload_size;
+        pid_t         pgid;
+    };
+
+    struct reply_header {
+        pid_t pid;
+        int   error;
+    };
+
+    int        socket_fd_  = -1;
+    pid_t      helper_pid_ = -1;
+    std::mutex mutex_;
+
+    static int config_handler(void * user, const char * section, const char * name, const char * value) {
+        if (std::strcmp(section, "shell") == 0 && std::strcmp(name, "fork_server") == 0) {
+            std::string v = value;
+            std::erase(v, '"');
+            *static_cast<bool *>(user) = v == "true" || v == "1";
+        }
+        return 1;
+    }
+
+    static void put_strings(std::string & out, const std::vector<std::string> & strings) {
+        const auto count = static_cast<std::uint32_t>(strings.size());
+        out.append(reinterpret_cast<const char *>(&count), sizeof(count));
+        for (const auto & s : strings) {
+            out.append(s);
+            out.push_back('\0');
+        }
+    }
+
+    static bool get_strings(const std::string & in, size_t & pos, std::vector<std::string> & strings) {
+        std::uint32_t count = 0;
+        if (pos + sizeof(count) > in.size()) {
+            return false;
+        }
+        std::memcpy(&count, in.data() + pos, sizeof(count));
+        pos += sizeof(count);
+        for (std::uint32_t i = 0; i < count; ++i) {
+            const auto end = in.find('\0', pos);
+            if (end == std::string::npos) {
+                return false;
+            }
+            strings.emplace_back(in, pos, end - pos);
+            pos = end + 1;
+        }
+        return true;
+    }
+
+    static bool write_all(int fd, const void * data, size_t size) {
+        const auto * p = static_cast<const char *>(data);
+        while (size > 0) {
+            const ssize_t n = write(fd, p, size);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static bool read_all(int fd, void * data, size_t size) {
+        auto * p = static_cast<char *>(data);
+        while (size > 0) {
+            const ssize_t n = read(fd, p, size);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static bool send_with_fds(int socket, const void * data, size_t size, const int * fds, size_t nfds) {
+        iovec iov{ const_cast<void *>(data), size };
+        char  control[CMSG_SPACE(sizeof(int) * 3)]{};
+
+        msghdr msg{};
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+        cmsghdr * cmsg   = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * nfds);
+        std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+        ssize_t n;
+        do {
+            n = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        } while (n == -1 && errno == EINTR);
+        if (n <= 0) {
+            return false;
+        }
+        // the fds travel with the first byte, the rest of a short write is plain data
+        return static_cast<size_t>(n) == size ||
+               ForkServer::write_all(socket, static_cast<const char *>(data) + n, size - n);
+    }
+
+    static bool receive_with_fds(int socket, void * data, size_t size, std::vector<int> & fds) {
+        iovec  iov{ data, size };
+        char   control[CMSG_SPACE(sizeof(int) * 3)]{};
+        msghdr msg{};
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t n;
+        do {
+            n = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+        } while (n == -1 && errno == EINTR);
+        if (n <= 0) {
+            return false;
+        }
+        for (cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const auto * data  = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+                fds.insert(fds.end(), data, data + count);
+            }
+        }
+        return static_cast<size_t>(n) == size ||
+               ForkServer::read_all(socket, static_cast<char *>(data) + n, size - n);
+    }
+
+    // the helper's main loop, never returns to the shell code
+    [[noreturn]] static void serve(int socket) {
+        for (const int sig : { SIGINT, SIGTSTP, SIGQUIT, SIGTTOU, SIGTTIN, SIGWINCH }) {
+            signal(sig, SIG_IGN);
+        }
+        signal(SIGPIPE, SIG_IGN);
+
+        while (true) {
+            request_header   header{};
+            std::vector<int> fds;
+            if (!ForkServer::receive_with_fds(socket, &header, sizeof(header), fds)) {
+                _exit(EXIT_SUCCESS);
+            }
+            std::string payload(header.payload_size, '\0');
+            if (!ForkServer::read_all(socket, payload.data(), payload.size())) {
+                _exit(EXIT_SUCCESS);
+            }
+
+            reply_header reply{ -1, 0 };
+            reply.error = ForkServer::launch(payload, header.pgid, fds, reply.pid);
+
+            for (const int fd : fds) {
+                close(fd);
+            }
+            if (!ForkServer::write_all(socket, &reply, sizeof(reply))) {
+                _exit(EXIT_SUCCESS);
+            }
+        }
+    }
+
+    // returns 0 or the errno of the failed step, the child is reparented to the shell by CLONE_PARENT
+    static int launch(const std::string & payload, pid_t pgid, const std::vector<int> & fds, pid_t & pid) {
+        std::vector<std::string> args;
+        std::vector<std::string> env;
+        std::vector<std::string> cwd;
+        std::vector<std::string> redirection_lines;
+        size_t                   pos = 0;
+        if (fds.size() != 3 || !ForkServer::get_strings(payload, pos, args) ||
+            !ForkServer::get_strings(payload, pos, env) || !ForkServer::get_strings(payload, pos, cwd) ||
+            !ForkServer::get_strings(payload, pos, redirection_lines) || args.empty()) {
+            return EINVAL;
+        }
+        std::vector<Redirection> redirections;
+        for (const auto & line : redirection_lines) {
+            redirections.push_back(Redirection::deserialize(line));
+        }
+
+        std::vector<char *> c_args;
+        std::vector<char *> c_env;
+        for (auto & arg : args) {
+            c_args.push_back(arg.data());
+        }
+        c_args.push_back(nullptr);
+        for (auto & var : env) {
+            c_env.push_back(var.data());
+        }
+        c_env.push_back(nullptr);
+
+        // exec errors are reported through a close-on-exec pipe, EOF means the exec succeeded
+        int err_pipe[2];
+        if (pipe2(err_pipe, O_CLOEXEC) == -1) {
+            return errno;
+        }
+
+        pid = static_cast<pid_t>(syscall(SYS_clone, CLONE_PARENT | SIGCHLD, nullptr, nullptr, nullptr, nullptr));
+        if (pid == -1) {
+            const int err = errno;
+            close(err_pipe[0]);
+            close(err_pipe[1]);
+            return err;
+        }
+
+        if (pid == 0) {
+            close(err_pipe[0]);
+            setpgid(0, pgid);
+            for (const int sig : { SIGINT, SIGTSTP, SIGQUIT, SIGTTOU, SIGTTIN, SIGWINCH, SIGPIPE, SIGCHLD }) {
+                signal(sig, SIG_DFL);
+            }
+            sigset_t empty_mask;
+            sigemptyset(&empty_mask);
+            sigprocmask(SIG_SETMASK, &empty_mask, nullptr);
+
+            for (int i = 0; i < 3; ++i) {
+                dup2(fds[i], i);
+            }
+            int err = 0;
+            if (!cwd.empty() && !cwd[0].empty() && chdir(cwd[0].c_str()) == -1) {
+                err = errno;
+            } else if ((err = Redirections::apply(redirections)) == 0) {
+                execvpe(c_args[0], c_args.data(), c_env.data());
+                err = errno;
+            }
+            ForkServer::write_all(err_pipe[1], &err, sizeof(err));
+            _exit(127);
+        }
+
+        close(err_pipe[1]);
+        int err = 0;
+        if (!ForkServer::read_all(err_pipe[0], &err, sizeof(err))) {
+            err = 0;
+        }
+        close(err_pipe[0]);
+        return err;
+    }
+};
+
+#endif  // FORK_SERVER_HPP
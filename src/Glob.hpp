@@ -0,0 +1,396 @@
+#ifndef GLOB_HPP
+#define GLOB_HPP
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "DirCache.hpp"
+#include "TreeWalker.hpp"
+
+/**
+ * Brace and pathname expansion straight into the argument vector: {a,b}, {1..10}, {a..e}, then *, ?, [...]
+ * ([!...], [^...], ranges) and \ escapes in every component of the path, ** for any number of directories
+ * (the walk runs on the threads of TreeWalker). The other components are matched against the listings of
+ * DirCache, which tell the directories apart without a stat. Like bash, * and ? do not match a leading dot and
+ * the matches are sorted.
+ */
+class Glob {
+  public:
+    struct Options {
+        // a pattern without matches is removed instead of kept
+        bool nullglob = false;
+        // a pattern without matches is an error
+        bool failglob = false;
+        // * and ? match a leading dot
+        bool dotglob  = false;
+    };
+
+    // true when the word has an unescaped *, ? or a closed [...]
+    static bool has_magic(std::string_view word) {
+        for (size_t i = 0; i < word.size(); ++i) {
+            const char c = word[i];
+            if (c == '\\') {
+                ++i;
+            } else if (c == '*' || c == '?') {
+                return true;
+            } else if (c == '[' && Glob::bracket_end(word, i) != std::string_view::npos) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // true when the word has a {...} which may expand, the exact rules are checked by expand_braces()
+    static bool has_braces(std::string_view word) {
+        const size_t open = word.find('{');
+        return open != std::string_view::npos && word.find('}', open) != std::string_view::npos &&
+               (word.find(',', open) != std::string_view::npos || word.find("..", open) != std::string_view::npos);
+    }
+
+    static bool needs_expansion(std::string_view word) { return Glob::has_braces(word) || Glob::has_magic(word); }
+
+    /**
+     * Appends the expansion of the word to out: the braces first, then the globs of every resulting word. A word
+     * without magic is appended unchanged, so is a pattern without matches unless nullglob or failglob is set.
+     * Returns false only for failglob without matches.
+     */
+    static bool expand(const std::string & word, std::vector<std::string> & out, const Options & options) {
+        if (!Glob::has_braces(word)) {
+            return Glob::expand_pattern(word, out, options);
+        }
+        std::vector<std::string> words;
+        Glob::expand_braces(word, words);
+        for (const auto & expanded : words) {
+            if (!Glob::expand_pattern(expanded, out, options)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * {a,b,c} with nesting, {1..10}, {10..1..3}, {01..10} (zero padded) and {a..e}. The first brace which
+     * expands is replaced with each of its items and the results are expanded again, so the items come in
+     * order: a{b,c}{1,2} is ab1 ab2 ac1 ac2. Braces which do not expand ({}, {x}, ${VAR}) are kept.
+     */
+    static void expand_braces(const std::string & word, std::vector<std::string> & out) {
+        for (size_t open = 0; open < word.size(); ++open) {
+            if (word[open] == '\\') {
+                ++open;
+                continue;
+            }
+            if (word[open] != '{' || (open > 0 && word[open - 1] == '$')) {
+                continue;
+            }
+            std::vector<size_t> commas;
+            const size_t        close = Glob::brace_close(word, open, commas);
+            if (close == std::string::npos) {
+                continue;
+            }
+            std::vector<std::string> items;
+            if (!commas.empty()) {
+                size_t from = open + 1;
+                for (const size_t comma : commas) {
+                    items.push_back(word.substr(from, comma - from));
+                    from = comma + 1;
+                }
+                items.push_back(word.substr(from, close - from));
+            } else if (!Glob::sequence(std::string_view(word).substr(open + 1, close - open - 1), items)) {
+                continue;
+            }
+            const std::string prefix = word.substr(0, open);
+            const std::string suffix = word.substr(close + 1);
+            for (const auto & item : items) {
+                Glob::expand_braces(prefix + item + suffix, out);
+            }
+            return;
+        }
+        out.push_back(word);
+    }
+
+    // globs of one word, after the brace expansion
+    static bool expand_pattern(const std::string & word, std::vector<std::string> & out, const Options & options) {
+        if (!Glob::has_magic(word)) {
+            out.push_back(word);
+            return true;
+        }
+
+        std::string pattern = word;
+        if (pattern.size() > 1 && pattern[0] == '~' && pattern[1] == '/') {
+            const char * home = getenv("HOME");
+            if (home != nullptr) {
+                pattern.replace(0, 1, home);
+            }
+        }
+
+        // the paths matched so far, as they appear in the output ("" is the current directory)
+        std::vector<std::string> paths{ pattern[0] == '/' ? "/" : "" };
+        size_t                   start = pattern[0] == '/' ? 1 : 0;
+        while (start <= pattern.size() && !paths.empty()) {
+            size_t end = pattern.find('/', start);
+            if (end == std::string::npos) {
+                end = pattern.size();
+            }
+            const std::string_view   component(pattern.data() + start, end - start);
+            const bool               last = end == pattern.size();
+            std::vector<std::string> next;
+            if (component == "**") {
+                // ** before the last component (**/*.cpp): one walk matches the last component in every directory
+                const std::string_view rest(pattern.data() + end + 1, last ? 0 : pattern.size() - end - 1);
+                if (!last && !rest.empty() && rest != "**" && rest.find('/') == std::string_view::npos) {
+                    next = TreeWalker(TreeWalker::WALK_FILTER, options.dotglob, &Glob::match, rest).walk(paths);
+                    end  = pattern.size();
+                } else {
+                    next = TreeWalker(last ? TreeWalker::WALK_ALL : TreeWalker::WALK_DIRECTORIES, options.dotglob)
+                               .walk(paths);
+                }
+            } else if (Glob::has_magic(component)) {
+                for (const auto & path : paths) {
+                    Glob::match_directory(path, component, last, options, next);
+                }
+            } else {
+                const std::string literal = Glob::unescape(component);
+                for (const auto & path : paths) {
+                    std::string     candidate = path + literal;
+                    DirCache::Entry entry;
+
+                    // a literal after a pattern, like */Makefile, has to exist
+                    if (!last || literal.empty() || literal == "." || literal == ".." ||
+                        DirCache::instance().lookup(candidate, entry)) {
+                        next.push_back(last ? std::move(candidate) : candidate + "/");
+                    }
+                }
+            }
+            paths = std::move(next);
+            start = end + 1;
+        }
+
+        if (paths.empty()) {
+            if (options.failglob) {
+                return false;
+            }
+            if (!options.nullglob) {
+                out.push_back(word);
+            }
+            return true;
+        }
+        std::sort(paths.begin(), paths.end());
+        out.insert(out.end(), std::make_move_iterator(paths.begin()), std::make_move_iterator(paths.end()));
+        return true;
+    }
+
+    // fnmatch() of one path component, without FNM_PATHNAME: the caller splits at '/'
+    static bool match(std::string_view pattern, std::string_view name, bool dotglob = false) {
+        if (!dotglob && !name.empty() && name[0] == '.' && (pattern.empty() || pattern[0] != '.')) {
+            return false;
+        }
+        size_t p = 0;
+        size_t n = 0;
+        // where to resume after the last *: the pattern after it and the next name position
+        size_t star_p = std::string_view::npos;
+        size_t star_n = 0;
+        while (n < name.size()) {
+            if (p < pattern.size()) {
+                const char c = pattern[p];
+                if (c == '*') {
+                    star_p = ++p;
+                    star_n = n;
+                    continue;
+                }
+                if (c == '?') {
+                    ++p;
+                    ++n;
+                    continue;
+                }
+                if (c == '[') {
+                    const size_t end = Glob::bracket_end(pattern, p);
+                    if (end != std::string_view::npos) {
+                        if (Glob::bracket_match(pattern.substr(p + 1, end - p - 1), name[n])) {
+                            p = end + 1;
+                            ++n;
+                            continue;
+                        }
+                    } else if (name[n] == '[') {
+                        ++p;
+                        ++n;
+                        continue;
+                    }
+                } else {
+                    const char literal = c == '\\' && p + 1 < pattern.size() ? pattern[p + 1] : c;
+                    if (literal == name[n]) {
+                        p += c == '\\' && p + 1 < pattern.size() ? 2 : 1;
+                        ++n;
+                        continue;
+                    }
+                }
+            }
+            if (star_p == std::string_view::npos) {
+                return false;
+            }
+            p = star_p;
+            n = ++star_n;
+        }
+        while (p < pattern.size() && pattern[p] == '*') {
+            ++p;
+        }
+        return p == pattern.size();
+    }
+
+  private:
+    // the } closing the brace at open and the positions of its top level commas, npos when it is not closed
+    static size_t brace_close(const std::string & word, size_t open, std::vector<size_t> & commas) {
+        size_t depth = 0;
+        for (size_t i = open; i < word.size(); ++i) {
+            const char c = word[i];
+            if (c == '\\') {
+                ++i;
+            } else if (c == '{') {
+                ++depth;
+            } else if (c == '}' && --depth == 0) {
+                return i;
+            } else if (c == ',' && depth == 1) {
+                commas.push_back(i);
+            }
+        }
+        return std::string::npos;
+    }
+
+    // x..y[..step] of integers or of single letters
+    static bool sequence(std::string_view body, std::vector<std::string> & items) {
+        std::vector<std::string_view> parts;
+        for (size_t pos = 0;;) {
+            const size_t dots = body.find("..", pos);
+            parts.push_back(body.substr(pos, dots == std::string_view::npos ? std::string_view::npos : dots - pos));
+            if (dots == std::string_view::npos) {
+                break;
+            }
+            pos = dots + 2;
+        }
+        if (parts.size() < 2 || parts.size() > 3) {
+            return false;
+        }
+        long step = 1;
+        if (parts.size() == 3 && !Glob::parse_number(parts[2], step)) {
+            return false;
+        }
+        step = step < 0 ? -step : (step == 0 ? 1 : step);
+
+        long first = 0;
+        long last  = 0;
+        if (Glob::parse_number(parts[0], first) && Glob::parse_number(parts[1], last)) {
+            // {01..10}: the width of the longer end when either has a leading zero
+            const auto padded = [](std::string_view number) {
+                const size_t digits = number[0] == '-' ? 1 : 0;
+                return number.size() > digits + 1 && number[digits] == '0';
+            };
+            const size_t width = padded(parts[0]) || padded(parts[1]) ? std::max(parts[0].size(), parts[1].size()) : 0;
+            for (long i = first; first <= last ? i <= last : i >= last; i += first <= last ? step : -step) {
+                std::string item = std::to_string(i < 0 ? -i : i);
+                if (item.size() + (i < 0 ? 1 : 0) < width) {
+                    item.insert(0, width - item.size() - (i < 0 ? 1 : 0), '0');
+                }
+                items.push_back(i < 0 ? "-" + item : item);
+            }
+            return true;
+        }
+        if (parts[0].size() == 1 && parts[1].size() == 1 && std::isalpha(static_cast<unsigned char>(parts[0][0])) &&
+            std::isalpha(static_cast<unsigned char>(parts[1][0]))) {
+            const char from = parts[0][0];
+            const char to   = parts[1][0];
+            for (long c = from; from <= to ? c <= to : c >= to; c += from <= to ? step : -step) {
+                items.emplace_back(1, static_cast<char>(c));
+            }
+            return true;
+        }
+        return false;
+    }
+
+    static bool parse_number(std::string_view text, long & value) {
+        const size_t digits = !text.empty() && (text[0] == '-' || text[0] == '+') ? 1 : 0;
+        if (text.size() == digits || text.size() > 18 ||
+            text.find_first_not_of("0123456789", digits) != std::string_view::npos) {
+            return false;
+        }
+        value = std::stol(std::string(text));
+        return true;
+    }
+
+    // position of the ] closing the bracket expression at start, npos when it is not closed
+    static size_t bracket_end(std::string_view pattern, size_t start) {
+        size_t i = start + 1;
+        if (i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^')) {
+            ++i;
+        }
+        // a ] right after the [ (or the negation) is a member
+        if (i < pattern.size() && pattern[i] == ']') {
+            ++i;
+        }
+        for (; i < pattern.size(); ++i) {
+            if (pattern[i] == ']') {
+                return i;
+            }
+            if (pattern[i] == '/') {
+                break;
+            }
+        }
+        return std::string_view::npos;
+    }
+
+    // the set between the brackets, without them
+    static bool bracket_match(std::string_view set, char c) {
+        const bool negate = !set.empty() && (set[0] == '!' || set[0] == '^');
+        if (negate) {
+            set.remove_prefix(1);
+        }
+        bool matched = false;
+        for (size_t i = 0; i < set.size() && !matched; ++i) {
+            const unsigned char low = set[i];
+            if (i + 2 < set.size() && set[i + 1] == '-') {
+                const unsigned char high = set[i + 2];
+                matched                  = low <= static_cast<unsigned char>(c) && static_cast<unsigned char>(c) <= high;
+                i += 2;
+            } else {
+                matched = low == static_cast<unsigned char>(c);
+            }
+        }
+        return matched != negate;
+    }
+
+    static std::string unescape(std::string_view component) {
+        std::string result;
+        result.reserve(component.size());
+        for (size_t i = 0; i < component.size(); ++i) {
+            if (component[i] == '\\' && i + 1 < component.size()) {
+                ++i;
+            }
+            result += component[i];
+        }
+        return result;
+    }
+
+    // the entries of path matching the component, directories only when more components follow
+    static void match_directory(const std::string & path, std::string_view component, bool last,
+                                const Options & options, std::vector<std::string> & matches) {
+        const auto listing = DirCache::instance().list(path);
+        if (listing == nullptr) {
+            return;
+        }
+        for (const auto & entry : listing->entries) {
+            if ((!last && !entry.directory) || !Glob::match(component, entry.name, options.dotglob)) {
+                continue;
+            }
+            std::string match = path;
+            match.append(entry.name);
+            if (!last) {
+                match += '/';
+            }
+            matches.push_back(std::move(match));
+        }
+    }
+};
+
+#endif  // GLOB_HPP
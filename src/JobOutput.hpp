@@ -0,0 +1,238 @@
+#ifndef JOB_OUTPUT_HPP
+#define JOB_OUTPUT_HPP
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "EventLoop.hpp"
+
+/**
+ * The output of the background jobs of the interactive shell with [shell] capture_output = true. The stdout and
+ * stderr of such a job go into a pipe instead of the terminal, the event loop drains it into a ring of the job,
+ * so the job can not write over the prompt; `jobs output %N` prints the ring and `jobs tail -f %N` follows it.
+ * A ring keeps the last capture_size bytes of its job and all rings together take at most capture_total: a new
+ * ring takes the memory of the finished jobs, the oldest first, and gets what is left. With capture_spill every
+ * byte also goes to a file of the job in that directory.
+ */
+class JobOutput {
+  public:
+    struct Capture {
+        int                job_id = 0;
+        pid_t              pid    = 0;
+        std::string        command;
+        // the read end of the pipe, -1 after the EOF: every process of the job closed it
+        int                fd     = -1;
+        // byte N of the output is at N % size, sized with the first bytes
+        std::vector<char>  ring;
+        bool               sized   = false;
+        // every byte received, the ones which fell out of the ring too
+        std::uint64_t      written = 0;
+        int                spill_fd = -1;
+        std::string        spill_path;
+        // the order of the captures, the oldest finished one gives its memory first
+        std::uint64_t      sequence = 0;
+
+        std::uint64_t oldest() const { return written - std::min<std::uint64_t>(written, ring.size()); }
+    };
+
+    static JobOutput & instance() {
+        static JobOutput instance;
+        return instance;
+    }
+
+    JobOutput(const JobOutput &)             = delete;
+    JobOutput & operator=(const JobOutput &) = delete;
+
+    // job_size 0 turns the capture off, spill_dir "" keeps the output in memory only
+    void configure(size_t job_size, size_t total_size, const std::string & spill_dir) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        job_size_   = job_size;
+        total_size_ = std::max(total_size, job_size);
+        spill_dir_  = spill_dir;
+    }
+
+    // the scripts have no prompt to protect and no loop to drain the pipes
+    bool enabled() const { return job_size_ != 0 && EventLoop::instance().is_open(); }
+
+    // the read end of the pipe of a new background job, the shell closes the write end after the spawn
+    void attach(int fd, int job_id, pid_t pid, const std::string & command) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        auto capture      = std::make_shared<Capture>();
+        capture->job_id   = job_id;
+        capture->pid      = pid;
+        capture->command  = command;
+        capture->fd       = fd;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            capture->sequence = ++sequence_;
+            if (!spill_dir_.empty()) {
+                capture->spill_path = spill_dir_ + "/job-" + std::to_string(getpid()) + "-" + std::to_string(pid) +
+                                      ".log";
+                capture->spill_fd =
+                    open(capture->spill_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+                if (capture->spill_fd == -1) {
+                    perror(capture->spill_path.c_str());
+                    capture->spill_path.clear();
+                }
+            }
+            // the job id is free again, the output of the job which had it goes with it
+            const auto old = captures_.find(job_id);
+            if (old != captures_.end()) {
+                this->release(*old->second);
+                captures_.erase(old);
+            }
+            captures_[job_id] = capture;
+        }
+        EventLoop::instance().add(fd, EPOLLIN, [capture](std::uint32_t) { JobOutput::instance().drain(*capture); });
+    }
+
+    // %N is a job id, a number is the pid of the job; "" is the newest capture
+    std::shared_ptr<Capture> find(const std::string & job) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::shared_ptr<Capture>    found;
+        for (const auto & capture : captures_) {
+            const bool match = job.empty() ? found == nullptr || capture.second->sequence > found->sequence :
+                               job[0] == '%' ? job.substr(1) == std::to_string(capture.first) :
+                                               job == std::to_string(capture.second->pid);
+            if (match) {
+                found = capture.second;
+            }
+        }
+        return found;
+    }
+
+    // reads what is in the pipe now, false when the pipe is closed
+    bool drain(Capture & capture) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        char                        buffer[16384];
+        while (capture.fd != -1) {
+            const ssize_t n = read(capture.fd, buffer, sizeof(buffer));
+            if (n > 0) {
+                this->append(capture, buffer, static_cast<size_t>(n));
+                continue;
+            }
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1 && errno == EAGAIN) {
+                break;
+            }
+            // EOF, the ring stays till its memory or its job id is needed
+            EventLoop::instance().remove(capture.fd);
+            close(capture.fd);
+            capture.fd = -1;
+            if (capture.spill_fd != -1) {
+                close(capture.spill_fd);
+                capture.spill_fd = -1;
+            }
+        }
+        return capture.fd != -1;
+    }
+
+    // the bytes from byte number `from` on which are still in the ring, `from` is moved to the end
+    std::string read_from(const Capture & capture, std::uint64_t & from) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        from = std::max(from, capture.oldest());
+        std::string text(capture.written - from, '\0');
+        for (size_t copied = 0; copied < text.size();) {
+            const size_t pos   = (from + copied) % capture.ring.size();
+            const size_t chunk = std::min(text.size() - copied, capture.ring.size() - pos);
+            std::memcpy(text.data() + copied, capture.ring.data() + pos, chunk);
+            copied += chunk;
+        }
+        from = capture.written;
+        return text;
+    }
+
+  private:
+    std::mutex                                             mutex_;
+    std::unordered_map<int, std::shared_ptr<Capture>>      captures_;
+    size_t                                                 job_size_   = 0;
+    size_t                                                 total_size_ = 0;
+    // the sizes of the rings
+    size_t                                                 used_       = 0;
+    std::string                                            spill_dir_;
+    std::uint64_t                                          sequence_   = 0;
+
+    JobOutput() = default;
+
+    // called with the lock held
+    void append(Capture & capture, const char * data, size_t size) {
+        if (capture.spill_fd != -1 && write(capture.spill_fd, data, size) != static_cast<ssize_t>(size)) {
+            close(capture.spill_fd);
+            capture.spill_fd = -1;
+        }
+        if (!capture.sized) {
+            this->reserve(capture);
+        }
+        const size_t capacity = capture.ring.size();
+        if (capacity == 0) {
+            capture.written += size;
+            return;
+        }
+        // only the tail of a large read stays
+        if (size > capacity) {
+            capture.written += size - capacity;
+            data += size - capacity;
+            size = capacity;
+        }
+        while (size > 0) {
+            const size_t pos   = capture.written % capacity;
+            const size_t chunk = std::min(size, capacity - pos);
+            std::memcpy(capture.ring.data() + pos, data, chunk);
+            capture.written += chunk;
+            data += chunk;
+            size -= chunk;
+        }
+    }
+
+    // called with the lock held, the finished jobs give their memory to the new ring, the oldest first
+    void reserve(Capture & capture) {
+        capture.sized = true;
+        while (used_ + job_size_ > total_size_) {
+            auto victim = captures_.end();
+            for (auto it = captures_.begin(); it != captures_.end(); ++it) {
+                if (it->second->fd == -1 && !it->second->ring.empty() &&
+                    (victim == captures_.end() || it->second->sequence < victim->second->sequence)) {
+                    victim = it;
+                }
+            }
+            if (victim == captures_.end()) {
+                break;
+            }
+            this->release(*victim->second);
+            captures_.erase(victim);
+        }
+        capture.ring.resize(std::min(job_size_, total_size_ - std::min(used_, total_size_)));
+        used_ += capture.ring.size();
+    }
+
+    // called with the lock held
+    void release(Capture & capture) {
+        if (capture.fd != -1) {
+            EventLoop::instance().remove(capture.fd);
+            close(capture.fd);
+            capture.fd = -1;
+        }
+        if (capture.spill_fd != -1) {
+            close(capture.spill_fd);
+            capture.spill_fd = -1;
+        }
+        used_ -= capture.ring.size();
+        capture.ring.clear();
+        capture.ring.shrink_to_fit();
+    }
+};
+
+#endif  // JOB_OUTPUT_HPP
@@ -0,0 +1,370 @@
+#ifndef PARALLEL_RUNNER_HPP
+#define PARALLEL_RUNNER_HPP
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "ProcessManager.hpp"
+#include "Redirection.hpp"
+
+/**
+ * parallel [-j N] [-k] [-g] command [args with {}] [::: input...]
+ * Runs the command once per input (the ::: list or the lines of the standard input) with N jobs in flight.
+ * {} in the arguments is replaced with the input, without a {} the input is appended.
+ * A slot is refilled as soon as its job exits: every child has a pidfd and the runner sleeps in poll() on
+ * them (and on the output pipes), no timer or WNOHANG loop is involved. SIGCHLD stays blocked while the jobs
+ * run, so the shell's handler does not reap them; the pending signal is handled after the run.
+ * -g collects the output of a job and prints it when the job exits, -k does the same in the input order.
+ */
+class ParallelRunner {
+  public:
+    struct Options {
+        size_t                                jobs       = 0;
+        bool                                  group      = false;
+        bool                                  keep_order = false;
+        std::vector<std::string>              command;
+        std::vector<std::string>              inputs;
+        // complete command lines, used instead of command and inputs (the batches of the batch builtin)
+        std::vector<std::vector<std::string>> command_lines;
+        // false: the inputs are read from the standard input
+        bool                                  has_inputs = false;
+    };
+
+    // returns false with a message in error when the arguments are invalid
+    static bool parse(const std::vector<std::string> & args, Options & options, std::string & error) {
+        size_t i = 1;
+        for (; i < args.size() && args[i].size() > 1 && args[i][0] == '-'; ++i) {
+            const std::string & arg = args[i];
+            if (arg == "-k" || arg == "--keep-order") {
+                options.keep_order = true;
+            } else if (arg == "-g" || arg == "--group") {
+                options.group = true;
+            } else if (arg == "-j" || arg == "--jobs" || arg.rfind("-j", 0) == 0) {
+                const bool        separate = arg == "-j" || arg == "--jobs";
+                const std::string value    = separate ? (i + 1 < args.size() ? args[++i] : "") : arg.substr(2);
+                try {
+                    options.jobs = std::stoul(value);
+                } catch (const std::exception &) {
+                    error = "invalid number of jobs: '" + value + "'";
+                    return false;
+                }
+            } else if (arg == "--") {
+                ++i;
+                break;
+            } else {
+                error = "unknown option: " + arg;
+                return false;
+            }
+        }
+        for (; i < args.size(); ++i) {
+            if (args[i] == ":::") {
+                options.has_inputs = true;
+                options.inputs.assign(args.begin() + i + 1, args.end());
+                break;
+            }
+            options.command.push_back(args[i]);
+        }
+        if (options.command.empty()) {
+            error = "missing command";
+            return false;
+        }
+        if (options.jobs == 0) {
+            const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            options.jobs    = cpus > 0 ? cpus : 1;
+        }
+        return true;
+    }
+
+    ParallelRunner(Options options, BuiltinIO & io) : options_(std::move(options)), io_(io) {}
+
+    // the exit status is the number of failed jobs, at most 101 like GNU parallel
+    int run() {
+        if (!options_.has_inputs && options_.command_lines.empty()) {
+            this->read_inputs();
+        }
+        jobs_.resize(options_.command_lines.empty() ? options_.inputs.size() : options_.command_lines.size());
+
+        sigset_t old_mask;
+        ProcessManager::block_sigchld(old_mask);
+        io_.out.flush();
+
+        // without pidfd (before Linux 5.3) a signalfd wakes up the loop on every SIGCHLD
+        if (!ProcessManager::pidfd_supported()) {
+            sigset_t chld;
+            sigemptyset(&chld);
+            sigaddset(&chld, SIGCHLD);
+            signal_fd_ = signalfd(-1, &chld, SFD_CLOEXEC | SFD_NONBLOCK);
+        }
+
+        while (next_ < jobs_.size() && running_.size() < options_.jobs) {
+            this->start(next_++);
+        }
+        while (!running_.empty()) {
+            this->wait_events();
+        }
+        this->flush_ordered();
+
+        if (signal_fd_ != -1) {
+            close(signal_fd_);
+            // the signalfd consumed the SIGCHLDs of the background jobs too
+            raise(SIGCHLD);
+        }
+        sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+        return failed_ > 101 ? 101 : static_cast<int>(failed_);
+    }
+
+    // the lines of the fd, an empty last line is dropped
+    static std::vector<std::string> read_lines(int fd) {
+        std::vector<std::string> lines;
+        std::string              buffer;
+        char                     chunk[65536];
+        while (true) {
+            const ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            buffer.append(chunk, n);
+        }
+        size_t start = 0;
+        while (start < buffer.size()) {
+            size_t end = buffer.find('\n', start);
+            if (end == std::string::npos) {
+                end = buffer.size();
+            }
+            lines.push_back(buffer.substr(start, end - start));
+            start = end + 1;
+        }
+        return lines;
+    }
+
+  private:
+    struct Job {
+        pid_t       pid      = -1;
+        int         pidfd    = -1;
+        // read end of the output pipe, -1 when the output is not collected
+        int         out      = -1;
+        std::string output;
+        bool        exited   = false;
+        bool        finished = false;
+        bool        printed  = false;
+    };
+
+    Options             options_;
+    BuiltinIO &         io_;
+    std::vector<Job>    jobs_;
+    std::deque<size_t>  running_;
+    size_t              next_      = 0;
+    size_t              printed_   = 0;
+    size_t              failed_    = 0;
+    int                 signal_fd_ = -1;
+
+    bool collect_output() const { return options_.group || options_.keep_order; }
+
+    void read_inputs() { options_.inputs = ParallelRunner::read_lines(io_.in); }
+
+    std::vector<std::string> arguments_for(const std::string & input) const {
+        std::vector<std::string> args;
+        bool                     replaced = false;
+        for (const auto & arg : options_.command) {
+            std::string value = arg;
+            size_t      pos   = 0;
+            while ((pos = value.find("{}", pos)) != std::string::npos) {
+                value.replace(pos, 2, input);
+                pos += input.size();
+                replaced = true;
+            }
+            args.push_back(std::move(value));
+        }
+        if (!replaced) {
+            args.push_back(input);
+        }
+        return args;
+    }
+
+    void start(size_t index) {
+        Job & job    = jobs_[index];
+        int   out_fd = io_.out_fd;
+        int   pipe_fds[2];
+        if (this->collect_output() && pipe2(pipe_fds, O_CLOEXEC) == 0) {
+            job.out = pipe_fds[0];
+            out_fd  = pipe_fds[1];
+            fcntl(job.out, F_SETFL, O_NONBLOCK);
+        }
+        // the jobs join the process group of the shell, ^C on the terminal reaches them
+        job.pid = ProcessManager::spawn_stage(options_.command_lines.empty() ?
+                                                  this->arguments_for(options_.inputs[index]) :
+                                                  options_.command_lines[index],
+                                              STDIN_FILENO, out_fd, STDERR_FILENO, getpgrp());
+        if (out_fd != io_.out_fd) {
+            close(out_fd);
+        }
+        if (job.pid == -1) {
+            ++failed_;
+            job.exited = true;
+            this->close_output(job);
+            this->finish(index);
+            return;
+        }
+        if (signal_fd_ == -1) {
+            job.pidfd = ProcessManager::pidfd_open(job.pid);
+        }
+        running_.push_back(index);
+    }
+
+    void close_output(Job & job) {
+        if (job.out != -1) {
+            close(job.out);
+            job.out = -1;
+        }
+    }
+
+    // reap the job and start the next input in its slot
+    void reap(size_t index) {
+        Job & job    = jobs_[index];
+        int   status = 0;
+        if (waitpid(job.pid, &status, WNOHANG) <= 0) {
+            return;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            ++failed_;
+        }
+        job.exited = true;
+        if (job.pidfd != -1) {
+            close(job.pidfd);
+            job.pidfd = -1;
+        }
+        if (next_ < jobs_.size()) {
+            this->start(next_++);
+        }
+    }
+
+    void drain(Job & job) {
+        char buffer[65536];
+        while (true) {
+            const ssize_t n = read(job.out, buffer, sizeof(buffer));
+            if (n > 0) {
+                job.output.append(buffer, n);
+                continue;
+            }
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == 0) {
+                this->close_output(job);
+            }
+            return;
+        }
+    }
+
+    void wait_events() {
+        std::vector<pollfd> fds;
+        std::vector<size_t> owners;
+        for (const size_t index : running_) {
+            const Job & job = jobs_[index];
+            if (!job.exited && job.pidfd != -1) {
+                fds.push_back({ job.pidfd, POLLIN, 0 });
+                owners.push_back(index);
+            }
+            if (job.out != -1) {
+                fds.push_back({ job.out, POLLIN, 0 });
+                owners.push_back(index);
+            }
+        }
+        if (signal_fd_ != -1) {
+            fds.push_back({ signal_fd_, POLLIN, 0 });
+            owners.push_back(SIZE_MAX);
+        }
+        if (fds.empty()) {
+            return;
+        }
+        if (poll(fds.data(), fds.size(), -1) == -1) {
+            return;
+        }
+
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            if (owners[i] == SIZE_MAX) {
+                signalfd_siginfo info;
+                while (read(signal_fd_, &info, sizeof(info)) == sizeof(info)) {
+                }
+                // a SIGCHLD does not tell which children exited, every running job is checked
+                for (const size_t index : std::deque<size_t>(running_)) {
+                    if (!jobs_[index].exited) {
+                        this->reap(index);
+                    }
+                }
+                continue;
+            }
+            Job & job = jobs_[owners[i]];
+            if (fds[i].fd == job.out) {
+                this->drain(job);
+            } else if (!job.exited) {
+                this->reap(owners[i]);
+            }
+        }
+
+        // a job is finished when it exited and its output reached EOF
+        for (auto it = running_.begin(); it != running_.end();) {
+            if (jobs_[*it].exited && jobs_[*it].out == -1) {
+                const size_t index = *it;
+                it                 = running_.erase(it);
+                this->finish(index);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void write_output(Job & job) {
+        size_t written = 0;
+        while (written < job.output.size()) {
+            const ssize_t n = write(io_.out_fd, job.output.data() + written, job.output.size() - written);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            written += n;
+        }
+        job.output.clear();
+        job.output.shrink_to_fit();
+        job.printed = true;
+    }
+
+    void finish(size_t index) {
+        jobs_[index].finished = true;
+        if (options_.keep_order) {
+            this->flush_ordered();
+        } else if (options_.group) {
+            this->write_output(jobs_[index]);
+        }
+    }
+
+    // -k: print every finished job whose predecessors are printed already
+    void flush_ordered() {
+        if (!options_.keep_order) {
+            return;
+        }
+        while (printed_ < jobs_.size() && jobs_[printed_].finished) {
+            this->write_output(jobs_[printed_++]);
+        }
+    }
+};
+
+#endif  // PARALLEL_RUNNER_HPP
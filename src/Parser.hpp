@@ -0,0 +1,576 @@
+#ifndef PARSER_HPP
+#define PARSER_HPP
+
+#include <cctype>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Lexer and parser of the shell language.
+ * A list is a sequence of and-or lists separated by ';', '&' or newlines, an and-or list is a chain of
+ * commands joined by '&&' and '||'. A command is either a pipeline of simple commands or a compound command
+ * (if, while, until, for, case, { ... }, function definition). The words of a pipeline are kept in their
+ * source form (quotes and variable references are untouched), they are expanded when the command runs.
+ */
+namespace parser {
+
+enum class TokenType : std::uint8_t {
+    TK_WORD,
+    // |
+    TK_PIPE,
+    // &&
+    TK_AND_IF,
+    // ||
+    TK_OR_IF,
+    // ;
+    TK_SEMI,
+    // ;;
+    TK_DSEMI,
+    // &
+    TK_AMP,
+    // (
+    TK_LPAREN,
+    // )
+    TK_RPAREN,
+    TK_NEWLINE,
+    TK_END,
+};
+
+struct Token {
+    TokenType   type = TokenType::TK_END;
+    std::string text;
+    size_t      line = 1;
+};
+
+enum class CommandType : std::uint8_t {
+    // a pipeline of simple commands
+    CMD_SIMPLE,
+    CMD_IF,
+    CMD_WHILE,
+    CMD_UNTIL,
+    CMD_FOR,
+    CMD_CASE,
+    CMD_GROUP,
+    CMD_FUNCTION,
+};
+
+struct List;
+
+struct Command {
+    CommandType                           type   = CommandType::CMD_SIMPLE;
+    bool                                  negate = false;
+    size_t                                line   = 1;
+    // simple: the command line, stages joined with " | "; for: the variable; case: the word; function: the name
+    std::string                           text;
+    // simple: the words of the command line ("|" between the stages); for: the words after "in"
+    std::vector<std::string>              words;
+    // for: false when the "in" part is missing (loop over the positional parameters)
+    bool                                  has_in = false;
+    // if: condition, body, condition, body..., [else body]; while/until: condition, body;
+    // for/group/function: body; case: one body per clause
+    std::vector<List>                     bodies;
+    // case: the patterns of the clauses
+    std::vector<std::vector<std::string>> patterns;
+};
+
+struct AndOr {
+    std::vector<Command>   commands;
+    // ops[i] joins commands[i] and commands[i + 1], TK_AND_IF or TK_OR_IF
+    std::vector<TokenType> ops;
+    bool                   background = false;
+};
+
+struct List {
+    std::vector<AndOr> items;
+};
+
+using Script = List;
+
+class Lexer {
+  public:
+    explicit Lexer(std::string_view source) : source_(source) {}
+
+    // returns false with a message in error on an unterminated quote
+    bool tokenize(std::vector<Token> & tokens, std::string & error) {
+        while (true) {
+            this->skip_blanks();
+            if (pos_ >= source_.size()) {
+                tokens.push_back({ TokenType::TK_END, "", line_ });
+                return true;
+            }
+            const char c    = source_[pos_];
+            const char next = pos_ + 1 < source_.size() ? source_[pos_ + 1] : '\0';
+
+            if (c == '#') {
+                // comment till the end of the line
+                while (pos_ < source_.size() && source_[pos_] != '\n') {
+                    ++pos_;
+                }
+                continue;
+            }
+            if (c == '\n') {
+                tokens.push_back({ TokenType::TK_NEWLINE, "\n", line_++ });
+                ++pos_;
+                continue;
+            }
+            if (c == ';') {
+                const bool dsemi = next == ';';
+                tokens.push_back({ dsemi ? TokenType::TK_DSEMI : TokenType::TK_SEMI, dsemi ? ";;" : ";", line_ });
+                pos_ += dsemi ? 2 : 1;
+                continue;
+            }
+            if (c == '(' || c == ')') {
+                tokens.push_back({ c == '(' ? TokenType::TK_LPAREN : TokenType::TK_RPAREN, std::string(1, c), line_ });
+                ++pos_;
+                continue;
+            }
+            if (c == '|') {
+                const bool or_if = next == '|';
+                tokens.push_back({ or_if ? TokenType::TK_OR_IF : TokenType::TK_PIPE, or_if ? "||" : "|", line_ });
+                pos_ += or_if ? 2 : 1;
+                continue;
+            }
+            if (c == '&' && next != '>') {
+                const bool and_if = next == '&';
+                tokens.push_back({ and_if ? TokenType::TK_AND_IF : TokenType::TK_AMP, and_if ? "&&" : "&", line_ });
+                pos_ += and_if ? 2 : 1;
+                continue;
+            }
+
+            Token word{ TokenType::TK_WORD, "", line_ };
+            if (!this->read_word(word.text, error)) {
+                return false;
+            }
+            tokens.push_back(std::move(word));
+        }
+    }
+
+  private:
+    std::string_view source_;
+    size_t           pos_  = 0;
+    size_t           line_ = 1;
+
+    void skip_blanks() {
+        while (pos_ < source_.size()) {
+            const char c = source_[pos_];
+            if (c == ' ' || c == '\t' || c == '\r') {
+                ++pos_;
+            } else if (c == '\\' && pos_ + 1 < source_.size() && source_[pos_ + 1] == '\n') {
+                // line continuation
+                pos_ += 2;
+                ++line_;
+            } else {
+                return;
+            }
+        }
+    }
+
+    static bool is_operator(char c) {
+        return c == '|' || c == ';' || c == '\n' || c == ' ' || c == '\t' || c == '(' || c == ')';
+    }
+
+    // a word ends at an unquoted blank or operator, '>&' and '<&' belong to the word (redirections)
+    bool read_word(std::string & word, std::string & error) {
+        const size_t start_line = line_;
+        char         quote      = 0;
+        int          depth      = 0;
+
+        while (pos_ < source_.size()) {
+            const char c = source_[pos_];
+            if (quote != 0) {
+                if (c == '\\' && quote == '"' && pos_ + 1 < source_.size()) {
+                    word += c;
+                    word += source_[++pos_];
+                } else {
+                    if (c == quote) {
+                        quote = 0;
+                    }
+                    if (c == '\n') {
+                        ++line_;
+                    }
+                    word += c;
+                }
+                ++pos_;
+                continue;
+            }
+            if (c == '\\' && pos_ + 1 < source_.size()) {
+                if (source_[pos_ + 1] == '\n') {
+                    pos_ += 2;
+                    ++line_;
+                    continue;
+                }
+                word += c;
+                word += source_[pos_ + 1];
+                pos_ += 2;
+                continue;
+            }
+            if (c == '\'' || c == '"' || c == '`') {
+                quote = c;
+            } else if (c == '$' && pos_ + 1 < source_.size() && source_[pos_ + 1] == '(') {
+                // $(...) and $((...)) may contain operators
+                word += "$(";
+                pos_ += 2;
+                ++depth;
+                continue;
+            } else if (depth > 0) {
+                if (c == '(') {
+                    ++depth;
+                } else if (c == ')') {
+                    --depth;
+                } else if (c == '\n') {
+                    ++line_;
+                }
+            } else if (c == '\r' || is_operator(c)) {
+                break;
+            } else if (c == '&') {
+                // 2>&1 continues the word, &>file starts a new one
+                const char after = pos_ + 1 < source_.size() ? source_[pos_ + 1] : '\0';
+                if (word.empty() ? after != '>' : (word.back() != '>' && word.back() != '<')) {
+                    break;
+                }
+            }
+            word += c;
+            ++pos_;
+        }
+
+        if (quote != 0 || depth > 0) {
+            error = "line " + std::to_string(start_line) + ": unexpected EOF while looking for matching `" +
+                    std::string(1, quote != 0 ? quote : ')') + "'";
+            return false;
+        }
+        return true;
+    }
+};
+
+class Parser {
+  public:
+    static bool parse(std::string_view source, Script & script, std::string & error) {
+        std::vector<Token> tokens;
+        Lexer              lexer(source);
+        if (!lexer.tokenize(tokens, error)) {
+            return false;
+        }
+        Parser parser(tokens);
+        return parser.parse_script(script, error);
+    }
+
+  private:
+    const std::vector<Token> & tokens_;
+    size_t                     pos_ = 0;
+
+    explicit Parser(const std::vector<Token> & tokens) : tokens_(tokens) {}
+
+    const Token & peek() const { return tokens_[pos_]; }
+
+    bool accept(TokenType type) {
+        if (tokens_[pos_].type != type) {
+            return false;
+        }
+        ++pos_;
+        return true;
+    }
+
+    void skip_newlines() {
+        while (this->accept(TokenType::TK_NEWLINE)) {
+        }
+    }
+
+    static std::string unexpected(const Token & token) {
+        const std::string text = token.type == TokenType::TK_END     ? "end of file" :
+                                 token.type == TokenType::TK_NEWLINE ? "newline" :
+                                                                       token.text;
+        return "line " + std::to_string(token.line) + ": syntax error near unexpected token `" + text + "'";
+    }
+
+    bool is_word(const char * text) const {
+        return this->peek().type == TokenType::TK_WORD && this->peek().text == text;
+    }
+
+    // reserved words which close a list, they are only keywords in the place of a command
+    bool at_list_end() const {
+        const Token & token = this->peek();
+        if (token.type == TokenType::TK_END || token.type == TokenType::TK_DSEMI ||
+            token.type == TokenType::TK_RPAREN) {
+            return true;
+        }
+        if (token.type != TokenType::TK_WORD) {
+            return false;
+        }
+        for (const char * word : { "then", "elif", "else", "fi", "do", "done", "esac", "}" }) {
+            if (token.text == word) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool expect_word(const char * text, std::string & error) {
+        this->skip_newlines();
+        if (!this->is_word(text)) {
+            error = Parser::unexpected(this->peek());
+            return false;
+        }
+        ++pos_;
+        return true;
+    }
+
+    bool parse_script(Script & script, std::string & error) {
+        if (!this->parse_list(script, error)) {
+            return false;
+        }
+        if (this->peek().type != TokenType::TK_END) {
+            error = Parser::unexpected(this->peek());
+            return false;
+        }
+        return true;
+    }
+
+    bool parse_list(List & list, std::string & error) {
+        this->skip_newlines();
+        while (!this->at_list_end()) {
+            AndOr and_or;
+            if (!this->parse_and_or(and_or, error)) {
+                return false;
+            }
+            if (this->accept(TokenType::TK_AMP)) {
+                and_or.background = true;
+            } else if (!this->accept(TokenType::TK_SEMI) && !this->accept(TokenType::TK_NEWLINE) &&
+                       !this->at_list_end()) {
+                error = Parser::unexpected(this->peek());
+                return false;
+            }
+            list.items.push_back(std::move(and_or));
+            this->skip_newlines();
+        }
+        return true;
+    }
+
+    bool parse_and_or(AndOr & and_or, std::string & error) {
+        while (true) {
+            Command command;
+            if (!this->parse_command(command, error)) {
+                return false;
+            }
+            and_or.commands.push_back(std::move(command));
+
+            const TokenType op = this->peek().type;
+            if (op != TokenType::TK_AND_IF && op != TokenType::TK_OR_IF) {
+                return true;
+            }
+            ++pos_;
+            and_or.ops.push_back(op);
+            // a newline may follow the operator
+            this->skip_newlines();
+        }
+    }
+
+    bool parse_command(Command & command, std::string & error) {
+        command.line = this->peek().line;
+        if (this->is_word("!")) {
+            command.negate = true;
+            ++pos_;
+        }
+        bool compound = true;
+        bool parsed   = false;
+        if (this->is_word("if")) {
+            parsed = this->parse_if(command, error);
+        } else if (this->is_word("while") || this->is_word("until")) {
+            parsed = this->parse_while(command, error);
+        } else if (this->is_word("for")) {
+            parsed = this->parse_for(command, error);
+        } else if (this->is_word("case")) {
+            parsed = this->parse_case(command, error);
+        } else if (this->is_word("{")) {
+            parsed = this->parse_group(command, error);
+        } else if (this->is_word("function") ||
+                   (this->peek().type == TokenType::TK_WORD && tokens_[pos_ + 1].type == TokenType::TK_LPAREN)) {
+            parsed = this->parse_function(command, error);
+        } else {
+            compound = false;
+            parsed   = this->parse_pipeline(command, error);
+        }
+        if (!parsed) {
+            return false;
+        }
+        if (compound && (this->peek().type == TokenType::TK_WORD || this->peek().type == TokenType::TK_PIPE)) {
+            error = "line " + std::to_string(this->peek().line) +
+                    ": redirections and pipes are not supported on compound commands";
+            return false;
+        }
+        return true;
+    }
+
+    bool parse_pipeline(Command & command, std::string & error) {
+        command.type = CommandType::CMD_SIMPLE;
+        while (true) {
+            if (this->peek().type != TokenType::TK_WORD) {
+                error = Parser::unexpected(this->peek());
+                return false;
+            }
+            while (this->peek().type == TokenType::TK_WORD) {
+                if (!command.text.empty() && command.text.back() != ' ') {
+                    command.text += ' ';
+                }
+                command.text += tokens_[pos_].text;
+                command.words.push_back(tokens_[pos_++].text);
+            }
+            if (!this->accept(TokenType::TK_PIPE)) {
+                return true;
+            }
+            command.text += " | ";
+            command.words.emplace_back("|");
+            this->skip_newlines();
+        }
+    }
+
+    bool parse_body(Command & command, std::string & error) {
+        List body;
+        if (!this->parse_list(body, error)) {
+            return false;
+        }
+        command.bodies.push_back(std::move(body));
+        return true;
+    }
+
+    // if list; then list; [elif list; then list;]... [else list;] fi
+    bool parse_if(Command & command, std::string & error) {
+        command.type = CommandType::CMD_IF;
+        ++pos_;
+        while (true) {
+            if (!this->parse_body(command, error) || !this->expect_word("then", error) ||
+                !this->parse_body(command, error)) {
+                return false;
+            }
+            if (this->is_word("elif")) {
+                ++pos_;
+                continue;
+            }
+            if (this->is_word("else")) {
+                ++pos_;
+                if (!this->parse_body(command, error)) {
+                    return false;
+                }
+            }
+            return this->expect_word("fi", error);
+        }
+    }
+
+    // while list; do list; done
+    bool parse_while(Command & command, std::string & error) {
+        command.type = this->is_word("while") ? CommandType::CMD_WHILE : CommandType::CMD_UNTIL;
+        ++pos_;
+        return this->parse_body(command, error) && this->expect_word("do", error) &&
+               this->parse_body(command, error) && this->expect_word("done", error);
+    }
+
+    // for name [in word...]; do list; done
+    bool parse_for(Command & command, std::string & error) {
+        command.type = CommandType::CMD_FOR;
+        ++pos_;
+        if (this->peek().type != TokenType::TK_WORD) {
+            error = Parser::unexpected(this->peek());
+            return false;
+        }
+        command.text = tokens_[pos_++].text;
+        this->skip_newlines();
+        if (this->is_word("in")) {
+            ++pos_;
+            command.has_in = true;
+            while (this->peek().type == TokenType::TK_WORD) {
+                command.words.push_back(tokens_[pos_++].text);
+            }
+        }
+        this->accept(TokenType::TK_SEMI);
+        return this->expect_word("do", error) && this->parse_body(command, error) &&
+               this->expect_word("done", error);
+    }
+
+    // case word in [(]pattern[|pattern]...) list ;; ... esac
+    bool parse_case(Command & command, std::string & error) {
+        command.type = CommandType::CMD_CASE;
+        ++pos_;
+        if (this->peek().type != TokenType::TK_WORD) {
+            error = Parser::unexpected(this->peek());
+            return false;
+        }
+        command.text = tokens_[pos_++].text;
+        if (!this->expect_word("in", error)) {
+            return false;
+        }
+        this->skip_newlines();
+        while (!this->is_word("esac")) {
+            this->accept(TokenType::TK_LPAREN);
+            std::vector<std::string> patterns;
+            while (true) {
+                if (this->peek().type != TokenType::TK_WORD) {
+                    error = Parser::unexpected(this->peek());
+                    return false;
+                }
+                patterns.push_back(tokens_[pos_++].text);
+                if (!this->accept(TokenType::TK_PIPE)) {
+                    break;
+                }
+            }
+            if (!this->accept(TokenType::TK_RPAREN)) {
+                error = Parser::unexpected(this->peek());
+                return false;
+            }
+            if (!this->parse_body(command, error)) {
+                return false;
+            }
+            command.patterns.push_back(std::move(patterns));
+            // the last clause may omit the ;;
+            if (!this->accept(TokenType::TK_DSEMI) && !this->is_word("esac")) {
+                error = Parser::unexpected(this->peek());
+                return false;
+            }
+            this->skip_newlines();
+        }
+        ++pos_;
+        return true;
+    }
+
+    // { list; }
+    bool parse_group(Command & command, std::string & error) {
+        command.type = CommandType::CMD_GROUP;
+        ++pos_;
+        return this->parse_body(command, error) && this->expect_word("}", error);
+    }
+
+    // name() compound-command, function name [()] compound-command
+    bool parse_function(Command & command, std::string & error) {
+        command.type = CommandType::CMD_FUNCTION;
+        if (this->is_word("function")) {
+            ++pos_;
+        }
+        if (this->peek().type != TokenType::TK_WORD) {
+            error = Parser::unexpected(this->peek());
+            return false;
+        }
+        command.text = tokens_[pos_++].text;
+        if (this->accept(TokenType::TK_LPAREN) && !this->accept(TokenType::TK_RPAREN)) {
+            error = Parser::unexpected(this->peek());
+            return false;
+        }
+        this->skip_newlines();
+
+        Command body;
+        if (!this->parse_command(body, error)) {
+            return false;
+        }
+        if (body.type == CommandType::CMD_SIMPLE || body.type == CommandType::CMD_FUNCTION) {
+            error = "line " + std::to_string(body.line) + ": a function body must be a compound command";
+            return false;
+        }
+        List list;
+        list.items.push_back({ { std::move(body) }, {}, false });
+        command.bodies.push_back(std::move(list));
+        return true;
+    }
+};
+
+}  // namespace parser
+
+#endif  // PARSER_HPP
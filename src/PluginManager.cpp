@@ -61,13 +61,15 @@ bool PluginManager::isPluginEnabled(const std::string & name) const {
     return it != plugins.end() && it->second.enabled;
 }
 
-bool PluginManager::OnCommand(std::vector<std::string> & args) {
+bool PluginManager::OnCommand(const std::vector<std::string> & args) {
     if (args.empty()) {
         return true;
     }
 
     const std::string &      command = args[0];
-    std::vector<std::string> commandArgs(args.begin() + 1, args.end());
+    // built for the first plugin which has an OnCommand, most commands do not need the copy
+    std::vector<std::string> commandArgs;
+    bool                     has_args = false;
 
     for (const auto & [name, plugin] : plugins) {
         if (!plugin.enabled) {
@@ -78,6 +80,10 @@ bool PluginManager::OnCommand(std::vector<std::string> & args) {
         if (!luaFunc.valid()) {
             continue;
         }
+        if (!has_args) {
+            commandArgs.assign(args.begin() + 1, args.end());
+            has_args = true;
+        }
 
         try {
             sol::protected_function_result result = luaFunc(plugin.table, command, commandArgs);
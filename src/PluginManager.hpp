@@ -119,7 +119,7 @@ class PluginManager {
     bool isPluginEnabled(const std::string & name) const;
 
     // callbacks
-    bool OnCommand(std::vector<std::string> & args);
+    bool OnCommand(const std::vector<std::string> & args);
     bool OnPromptFormat(std::string & prompt);
 
     SetConfigValue setConfigCallback = nullptr;
@@ -1,18 +1,41 @@
 #ifndef PROCESS_MANAGER_HPP
 #define PROCESS_MANAGER_HPP
 
+#include <fcntl.h>
 #include <signal.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <sstream>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "Arena.hpp"
+#include "EventLoop.hpp"
+#include "ForkServer.hpp"
+#include "JobOutput.hpp"
+#include "Redirection.hpp"
+#include "ResourceLimits.hpp"
+
 class ProcessManager {
   public:
     static ProcessManager & instance() {
@@ -50,19 +73,85 @@ class ProcessManager {
 
     static std::string typeToString(ProcessManager::ProcessType type) { return process_type_map.at(type); }
 
+    using Clock = std::chrono::steady_clock;
+
+    // what the kernel accounted for the reaped members of a job (wait4), the wall time is measured by the shell
+    struct Usage {
+        double wall        = 0;
+        double user        = 0;
+        double sys         = 0;
+        // the largest member, KiB
+        long   max_rss     = 0;
+        long   in_blocks   = 0;
+        long   out_blocks  = 0;
+        long   voluntary   = 0;
+        long   involuntary = 0;
+
+        void add(const rusage & ru) {
+            user += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+            sys += ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+            max_rss = std::max(max_rss, ru.ru_maxrss);
+            in_blocks += ru.ru_inblock;
+            out_blocks += ru.ru_oublock;
+            voluntary += ru.ru_nvcsw;
+            involuntary += ru.ru_nivcsw;
+        }
+
+        // the report of the time builtin, the first three lines like bash
+        std::string report() const {
+            char buffer[512];
+            snprintf(buffer, sizeof(buffer),
+                     "real\t%s\nuser\t%s\nsys\t%s\nmaxrss\t%ld KiB\nblocks\t%ld in, %ld out\n"
+                     "ctxsw\t%ld voluntary, %ld involuntary\n",
+                     Usage::minutes(wall).c_str(), Usage::minutes(user).c_str(), Usage::minutes(sys).c_str(), max_rss,
+                     in_blocks, out_blocks, voluntary, involuntary);
+            return buffer;
+        }
+
+        // one line, for [shell] report_time
+        std::string summary() const {
+            char buffer[160];
+            snprintf(buffer, sizeof(buffer), "%.3fs real, %.3fs user, %.3fs sys, %ld KiB rss", wall, user, sys,
+                     max_rss);
+            return buffer;
+        }
+
+        static std::string minutes(double seconds) {
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "%dm%.3fs", static_cast<int>(seconds / 60),
+                     seconds - 60 * static_cast<int>(seconds / 60));
+            return buffer;
+        }
+    };
+
     struct Process {
         std::string              command;
         std::vector<std::string> args;
         pid_t                    pid;
         ProcessType              type        = ProcessManager::ProcessType::PM_PROC_TYPE_ANY;
         ProcessState             state       = ProcessManager::ProcessState::PM_PROC_STATE_RUNNING;
-        bool                     deleted     = false;
         int                      exit_status = 0;
+        // the small number of the job (%1), given when it is added to the table
+        int                      job_id      = 0;
+        // members of the job (the whole pipeline) which are not yet finished, pid is the process group id
+        std::vector<pid_t>       pids;
+        // the exit status of the job comes from the last stage of the pipeline
+        pid_t                    last_pid    = -1;
+        Clock::time_point        started     = Clock::now();
+        // of the reaped members, the wall time is set when the job finished
+        Usage                    usage;
+        // the cgroup leaf of a job with limits, removed when the job finished
+        std::string              cgroup;
 
         static std::string argsToCommand(const std::vector<std::string> & args) {
+            size_t size = 0;
+            for (const auto & arg : args) {
+                size += arg.size() + 1;
+            }
             std::string command;
+            command.reserve(size);
             for (const auto & arg : args) {
-                command += arg + " ";
+                command.append(arg).push_back(' ');
             }
             return command;
         }
@@ -78,18 +167,49 @@ class ProcessManager {
         }
     };
 
+    struct PipelineStage {
+        std::vector<std::string>                                            args;
+        std::vector<Redirection>                                            redirections;
+        // set when the stage is a shell builtin, it will not be exec'd
+        std::function<void(const std::vector<std::string> &, BuiltinIO &)> builtin = nullptr;
+    };
+
+    // a background job waiting for a free slot ([shell] max_jobs), its job id is given when it is queued
+    struct Queued {
+        int                        job_id   = 0;
+        // the nice value of the job, the lowest starts first with [shell] job_order = priority
+        int                        priority = 0;
+        std::string                command;
+        Clock::time_point          queued   = Clock::now();
+        std::vector<PipelineStage> stages;
+        std::optional<Limits>      limits;
+    };
+
+    // what jobs and the prompt read, replaced as a whole when the table changes
+    struct Snapshot {
+        // ordered by job id
+        std::vector<Process> jobs;
+        // in the order they were queued
+        std::vector<Queued>  queued;
+        size_t               running = 0;
+        size_t               stopped = 0;
+    };
+
     ProcessManager() = default;
 
     ~ProcessManager() {
-        for (auto & process : processes_) {
-            if (process->state == ProcessState::PM_PROC_STATE_RUNNING) {
-                kill(process->pid, SIGKILL);
+        for (auto & job : jobs_) {
+            // the pid of a job is its process group, every stage of the pipeline goes
+            if (job.second->state == ProcessState::PM_PROC_STATE_RUNNING) {
+                kill(-job.second->pid, SIGKILL);
             }
         }
-        processes_.clear();
-        for (auto & thread : threads_) {
-            if (thread.joinable()) {
-                thread.join();
+        jobs_.clear();
+        for (auto & job : threads_) {
+            for (auto & thread : job.second) {
+                if (thread.joinable()) {
+                    thread.join();
+                }
             }
         }
     }
@@ -97,124 +217,573 @@ class ProcessManager {
     ProcessManager(const ProcessManager &)             = delete;
     ProcessManager & operator=(const ProcessManager &) = delete;
 
-    static void start_process(const std::vector<std::string> & args, bool run_in_background) {
-        const auto grpid = getpgrp();
-        pid_t      pid   = fork();
+    // returns the exit status of a foreground job, 0 for a background job and 127 if the launch failed
+    static int start_process(const std::vector<std::string> & args, bool run_in_background,
+                             const std::vector<Redirection> & redirections = {}, const Limits * limits = nullptr) {
+        if (run_in_background && ProcessManager::instance().enqueue({ { args, redirections } }, limits)) {
+            return 0;
+        }
+        const auto        grpid  = getpgrp();
+        const std::string cgroup = ProcessManager::job_cgroup(limits);
+        int               capture[2];
+        ProcessManager::open_capture(run_in_background, capture);
+        const int out_fd = capture[1] != -1 ? capture[1] : STDOUT_FILENO;
+        const int err_fd = capture[1] != -1 ? capture[1] : STDERR_FILENO;
+        // the SIGCHLD handler must not reap the child before it is registered
+        sigset_t  old_mask;
+        ProcessManager::block_sigchld(old_mask);
+        // the child gets its own process group, posix_spawn never copies the page tables of the shell
+        const pid_t pid =
+            ProcessManager::spawn_stage(args, STDIN_FILENO, out_fd, err_fd, 0, redirections, limits, cgroup);
         if (pid == -1) {
-            perror("Fork failed");
-            return;
+            sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+            ProcessManager::attach_capture(capture, nullptr);
+            if (!cgroup.empty()) {
+                Cgroups::remove(cgroup);
+            }
+            return 127;
         }
 
-        if (pid == 0) {
-            // Child process
-            setpgid(0, 0);  // Create a new process group for the child
-            signal(SIGINT, SIG_DFL);
-            signal(SIGTSTP, SIG_DFL);
+        const auto type =
+            run_in_background ? ProcessType::PM_PROC_TYPE_BACKGROUND : ProcessType::PM_PROC_TYPE_FOREGROUND;
+
+        Process proc;
+        proc.command                         = Process::argsToCommand(args);
+        proc.args                            = args;
+        proc.pid                             = pid;
+        proc.type                            = type;
+        proc.state                           = ProcessState::PM_PROC_STATE_RUNNING;
+        proc.pids                            = { pid };
+        proc.last_pid                        = pid;
+        proc.cgroup                          = cgroup;
+        std::shared_ptr<Process> process_ptr = std::make_shared<Process>(std::move(proc));
+
+        ProcessManager::instance().process_add(process_ptr);
+        ProcessManager::attach_capture(capture, process_ptr);
+
+        if (run_in_background) {
+            sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+            // Handle background process logic
+            std::cout << "[" << process_ptr->job_id << "] Process " << pid << " running in background.\n";
+            ProcessManager::instance().process_set_type(pid, ProcessType::PM_PROC_TYPE_BACKGROUND);
+            return 0;
+        }
+        // Handle foreground process logic, the SIGCHLD handler stays blocked till the job is waited for
+        ProcessManager::process_handle_foreground(pid, grpid);
+        sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+        return process_ptr->state == ProcessState::PM_PROC_STATE_STOPPED ? 128 + SIGTSTP : process_ptr->exit_status;
+    }
+
+    /**
+     * Start every stage of a pipeline in one process group, connected with pipes.
+     * External commands are started with posix_spawn, builtins run on a thread of the shell and write into
+     * the pipe through their BuiltinIO. The whole pipeline is tracked as one job, the job's pid is the process
+     * group id. A background job may have to wait in the queue first, job_id is the id it got there.
+     */
+    static int start_pipeline(const std::vector<PipelineStage> & stages, bool run_in_background,
+                              const Limits * limits = nullptr, int job_id = 0) {
+        if (stages.empty()) {
+            return 0;
+        }
+        if (run_in_background && job_id == 0 && ProcessManager::instance().enqueue(stages, limits)) {
+            return 0;
+        }
+        const auto               grpid  = getpgrp();
+        // one leaf for the whole pipeline, the limits are the ones of the job
+        const std::string        cgroup = ProcessManager::job_cgroup(limits);
+        pid_t                    pgid   = 0;
+        std::vector<pid_t>       pids;
+        std::vector<std::thread> builtin_threads;
+        int                      in_fd = STDIN_FILENO;
+        // the stdout of the last stage and the stderr of the external ones
+        int                      capture[2];
+        ProcessManager::open_capture(run_in_background, capture);
+        const int                err_fd = capture[1] != -1 ? capture[1] : STDERR_FILENO;
+        sigset_t                 old_mask;
+        ProcessManager::block_sigchld(old_mask);
 
-            std::vector<char *> c_args(args.size() + 1);
-            for (size_t i = 0; i < args.size(); ++i) {
-                c_args[i] = const_cast<char *>(args[i].c_str());
+        for (size_t i = 0; i < stages.size(); ++i) {
+            const bool last        = i + 1 == stages.size();
+            int        pipe_fds[2] = { -1, -1 };
+            if (!last && pipe2(pipe_fds, O_CLOEXEC) == -1) {
+                perror("pipe2");
+                break;
             }
-            c_args[args.size()] = nullptr;
+            const int    out_fd = !last ? pipe_fds[1] : capture[1] != -1 ? capture[1] : STDOUT_FILENO;
+            const auto & stage  = stages[i];
 
-            if (execvp(c_args[0], c_args.data()) == -1) {
-                perror("Exec failed");
-                exit(EXIT_FAILURE);
+            if (stage.builtin) {
+                // the thread owns the pipe ends of the stage, closing them signals EOF to the next stage
+                builtin_threads.emplace_back(ProcessManager::run_builtin_stage, stage, in_fd,
+                                             out_fd == capture[1] ? fcntl(out_fd, F_DUPFD_CLOEXEC, 0) : out_fd);
+            } else {
+                const pid_t pid = ProcessManager::spawn_stage(stage.args, in_fd, out_fd, err_fd, pgid,
+                                                              stage.redirections, limits, cgroup);
+                if (pid > 0) {
+                    if (pgid == 0) {
+                        pgid = pid;
+                    }
+                    pids.push_back(pid);
+                }
+                if (in_fd != STDIN_FILENO) {
+                    close(in_fd);
+                }
+                if (!last) {
+                    close(pipe_fds[1]);
+                }
             }
-        } else {
-            const auto type =
-                run_in_background ? ProcessType::PM_PROC_TYPE_BACKGROUND : ProcessType::PM_PROC_TYPE_FOREGROUND;
+            in_fd = last ? STDIN_FILENO : pipe_fds[0];
+        }
 
-            setpgid(pid, pid);
+        if (pids.empty()) {
+            sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+            ProcessManager::attach_capture(capture, nullptr);
+            if (!cgroup.empty()) {
+                Cgroups::remove(cgroup);
+            }
+            for (auto & thread : builtin_threads) {
+                thread.join();
+            }
+            return stages.back().builtin ? 0 : 127;
+        }
+
+        const auto type =
+            run_in_background ? ProcessType::PM_PROC_TYPE_BACKGROUND : ProcessType::PM_PROC_TYPE_FOREGROUND;
 
-            Process proc                         = { Process::argsToCommand(args), args, pid, type };
-            proc.state                           = ProcessState::PM_PROC_STATE_RUNNING;
-            std::shared_ptr<Process> process_ptr = std::make_shared<Process>(std::move(proc));
+        std::vector<std::string> args;
+        for (const auto & stage : stages) {
+            args.insert(args.end(), stage.args.begin(), stage.args.end());
+        }
 
-            ProcessManager::instance().process_add(process_ptr);
+        Process proc;
+        proc.command  = ProcessManager::pipeline_command(stages);
+        proc.args     = args;
+        proc.pid      = pgid;
+        proc.type     = type;
+        proc.job_id   = job_id;
+        proc.state    = ProcessState::PM_PROC_STATE_RUNNING;
+        proc.pids     = pids;
+        proc.last_pid = stages.back().builtin ? -1 : pids.back();
+        proc.cgroup   = cgroup;
 
-            if (run_in_background) {
-                // Handle background process logic
-                std::cout << "Process " << pid << " running in background.\n";
-                ProcessManager::instance().process_set_type(pid, ProcessType::PM_PROC_TYPE_BACKGROUND);
-            } else {
-                // Handle foreground process logic
-                ProcessManager::process_handle_foreground(pid, grpid);
+        std::shared_ptr<Process> process_ptr = std::make_shared<Process>(std::move(proc));
+        ProcessManager::instance().process_add(process_ptr);
+        ProcessManager::attach_capture(capture, process_ptr);
+
+        if (!run_in_background) {
+            ProcessManager::process_handle_foreground(pgid, grpid);
+            sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+        } else if (job_id != 0) {
+            sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+            // a queued job starts when another one finished, it is reported with the finished ones
+            std::lock_guard<std::mutex> lock(ProcessManager::instance().processes_mutex_);
+            ProcessManager::instance().notify(process_ptr, "started");
+        } else {
+            sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+            std::cout << "[" << process_ptr->job_id << "] Process " << pgid << " running in background.\n";
+        }
+
+        // a builtin writing into a stopped or background job must not block the prompt
+        if (run_in_background || process_ptr->state == ProcessState::PM_PROC_STATE_STOPPED) {
+            auto &                      manager = ProcessManager::instance();
+            std::lock_guard<std::mutex> lock(manager.processes_mutex_);
+            // they go with the job when it is reaped, a job reaped already has no one to wait for them
+            for (auto & thread : builtin_threads) {
+                if (manager.jobs_.contains(pgid)) {
+                    manager.threads_[pgid].push_back(std::move(thread));
+                } else {
+                    thread.detach();
+                }
             }
+            return run_in_background ? 0 : 128 + SIGTSTP;
         }
+        for (auto & thread : builtin_threads) {
+            thread.join();
+        }
+        return process_ptr->exit_status;
     }
 
-    bool process_delete(const pid_t & pid, const int & status_code = -1) {
-        std::lock_guard<std::mutex> lock(processes_mutex_);
-        for (auto it = processes_.begin(); it != processes_.end(); ++it) {
-            if ((*it)->pid == pid) {
-                (*it)->deleted = true;
-                (*it)->state   = ProcessState::PM_PROC_STATE_COMPLETED;
-                if (status_code != -1 && (*it)->exit_status != status_code) {
-                    (*it)->exit_status = status_code;
+    static void run_builtin_stage(const PipelineStage & stage, int in_fd, int out_fd) {
+        int              fds[3] = { in_fd, out_fd, STDERR_FILENO };
+        std::vector<int> owned;
+        if (in_fd != STDIN_FILENO) {
+            owned.push_back(in_fd);
+        }
+        if (out_fd != STDOUT_FILENO) {
+            owned.push_back(out_fd);
+        }
+        std::string error;
+        if (!Redirections::open_for_builtin(stage.redirections, fds, owned, error)) {
+            std::cerr << error << "\n";
+            for (const int fd : owned) {
+                close(fd);
+            }
+            return;
+        }
+        BuiltinIO io(fds[0], fds[1], fds[2], std::move(owned));
+        try {
+            stage.builtin(stage.args, io);
+        } catch (const std::exception & e) {
+            io.err << stage.args[0] << ": " << e.what() << "\n";
+        }
+    }
+
+    /**
+     * Launch a command with posix_spawnp. glibc implements it with clone(CLONE_VM | CLONE_VFORK), so the
+     * cost does not grow with the memory of the shell (Lua state, binary index) like fork() does.
+     * The process group, the default signal dispositions and the empty signal mask are set by the spawn
+     * attributes before the exec. pgid 0 creates a new process group led by the new process.
+     * When the fork server is running the launch is delegated to it. A job with limits is forked by
+     * spawn_limited().
+     */
+    static pid_t spawn_stage(const std::vector<std::string> & args, int in_fd, int out_fd, int err_fd, pid_t pgid,
+                             const std::vector<Redirection> & redirections = {}, const Limits * limits = nullptr,
+                             const std::string & cgroup = {}) {
+        if (args.empty()) {
+            return -1;
+        }
+        if (limits != nullptr) {
+            return ProcessManager::spawn_limited(args, in_fd, out_fd, err_fd, pgid, redirections, *limits, cgroup);
+        }
+        if (ForkServer::instance().available()) {
+            int         err = 0;
+            const pid_t pid = ForkServer::instance().spawn(args, in_fd, out_fd, err_fd, pgid, redirections, err);
+            if (err == 0) {
+                return pid;
+            }
+            if (err != EPIPE) {
+                // the child which failed is not a member of a job, nothing else reaps it
+                if (pid > 0) {
+                    waitpid(pid, nullptr, 0);
                 }
-                return true;
+                std::cerr << args[0] << ": " << strerror(err) << "\n";
+                return -1;
             }
+            // the helper is gone, launch it from the shell
+        }
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t          attr;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawnattr_init(&attr);
+
+        if (in_fd != STDIN_FILENO) {
+            posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+        }
+        if (out_fd != STDOUT_FILENO) {
+            posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+        }
+        if (err_fd != STDERR_FILENO) {
+            posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+        }
+        // redirections come after the pipe, like "cmd 2>&1 | less"
+        Redirections::add_spawn_actions(&actions, redirections);
+
+        // the shell ignores the job control signals, ignored signals would survive the exec
+        sigset_t default_signals;
+        sigemptyset(&default_signals);
+        for (const int sig : { SIGINT, SIGTSTP, SIGQUIT, SIGTTOU, SIGTTIN, SIGPIPE, SIGCHLD }) {
+            sigaddset(&default_signals, sig);
         }
-        return false;
+        sigset_t empty_mask;
+        sigemptyset(&empty_mask);
+
+        posix_spawnattr_setsigdefault(&attr, &default_signals);
+        posix_spawnattr_setsigmask(&attr, &empty_mask);
+        posix_spawnattr_setpgroup(&attr, pgid);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+        const arena::Argv argv(args);
+        pid_t             pid = -1;
+        const int         rc  = posix_spawnp(&pid, argv[0], &actions, &attr, argv.data(), environ);
+
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+
+        if (rc != 0) {
+            std::cerr << args[0] << ": " << strerror(rc) << "\n";
+            return -1;
+        }
+        return pid;
     }
 
-    bool process_add(std::shared_ptr<Process> & process) {
-        std::lock_guard<std::mutex> lock(processes_mutex_);
-        for (const auto & _process : processes_) {
-            if (_process->pid == process->pid) {
+    /**
+     * Launch a command with limits. posix_spawn has no step between the fork and the exec where the rlimits
+     * could be set and the cgroup entered, these few jobs pay for a fork(). Only syscalls run in the child,
+     * the argv and the path of the leaf are built before it; an exec error comes back through a close-on-exec
+     * pipe like in the fork server.
+     */
+    static pid_t spawn_limited(const std::vector<std::string> & args, int in_fd, int out_fd, int err_fd, pid_t pgid,
+                               const std::vector<Redirection> & redirections, const Limits & limits,
+                               const std::string & cgroup) {
+        const arena::Argv argv(args);
+        const std::string procs = cgroup.empty() ? std::string() : cgroup + "/cgroup.procs";
+        int               err_pipe[2];
+        if (pipe2(err_pipe, O_CLOEXEC) == -1) {
+            perror("pipe2");
+            return -1;
+        }
+        const pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            close(err_pipe[0]);
+            close(err_pipe[1]);
+            return -1;
+        }
+        if (pid == 0) {
+            close(err_pipe[0]);
+            setpgid(0, pgid);
+            for (const int sig : { SIGINT, SIGTSTP, SIGQUIT, SIGTTOU, SIGTTIN, SIGPIPE, SIGCHLD }) {
+                signal(sig, SIG_DFL);
+            }
+            sigset_t empty_mask;
+            sigemptyset(&empty_mask);
+            sigprocmask(SIG_SETMASK, &empty_mask, nullptr);
+
+            if (in_fd != STDIN_FILENO) {
+                dup2(in_fd, STDIN_FILENO);
+            }
+            if (out_fd != STDOUT_FILENO) {
+                dup2(out_fd, STDOUT_FILENO);
+            }
+            if (err_fd != STDERR_FILENO) {
+                dup2(err_fd, STDERR_FILENO);
+            }
+            int err = Redirections::apply(redirections);
+            if (err == 0) {
+                err = limits.apply(procs.empty() ? nullptr : procs.c_str());
+            }
+            if (err == 0) {
+                execvp(argv[0], argv.data());
+                err = errno;
+            }
+            [[maybe_unused]] const ssize_t written = write(err_pipe[1], &err, sizeof(err));
+            _exit(127);
+        }
+        // the next stage of a pipeline joins the group, it must exist already
+        setpgid(pid, pgid == 0 ? pid : pgid);
+        close(err_pipe[1]);
+        int err = 0;
+        if (read(err_pipe[0], &err, sizeof(err)) != static_cast<ssize_t>(sizeof(err))) {
+            err = 0;
+        }
+        close(err_pipe[0]);
+        if (err != 0) {
+            waitpid(pid, nullptr, 0);
+            std::cerr << args[0] << ": " << strerror(err) << "\n";
+            return -1;
+        }
+        return pid;
+    }
+
+    // the pipe of the output of a new background job when JobOutput captures it, { -1, -1 } otherwise
+    static void open_capture(bool run_in_background, int (&fds)[2]) {
+        fds[0] = fds[1] = -1;
+        if (run_in_background && JobOutput::instance().enabled() && pipe2(fds, O_CLOEXEC) == -1) {
+            perror("pipe2");
+            fds[0] = fds[1] = -1;
+        }
+    }
+
+    // the job has the write end now, the read end goes to the event loop; nullptr: the job did not start
+    static void attach_capture(int (&fds)[2], const std::shared_ptr<Process> & job) {
+        if (fds[0] == -1) {
+            return;
+        }
+        close(fds[1]);
+        if (job != nullptr) {
+            JobOutput::instance().attach(fds[0], job->job_id, job->pid, job->command);
+        } else {
+            close(fds[0]);
+        }
+    }
+
+    // "a | b", the command of a job
+    static std::string pipeline_command(const std::vector<PipelineStage> & stages) {
+        std::string command;
+        for (const auto & stage : stages) {
+            command += (command.empty() ? "" : "| ") + Process::argsToCommand(stage.args);
+        }
+        return command;
+    }
+
+    /**
+     * A background job waits in the queue while max_jobs background jobs run, true when it was queued.
+     * A job whose redirections use the fds of a builtin (limit cmd > file &) can not wait, the builtin closes
+     * them when it returns; it starts right away.
+     */
+    bool enqueue(const std::vector<PipelineStage> & stages, const Limits * limits) {
+        std::string message;
+        {
+            std::lock_guard<std::mutex> lock(processes_mutex_);
+            if (max_jobs == 0 || (queue_.empty() && this->running_background() < max_jobs)) {
                 return false;
             }
+            for (const auto & stage : stages) {
+                for (const auto & redirection : stage.redirections) {
+                    if (redirection.type == Redirection::RD_DUP && redirection.target_fd > STDERR_FILENO) {
+                        return false;
+                    }
+                }
+            }
+            Queued job;
+            job.job_id   = this->next_job_id();
+            job.priority = limits != nullptr ? limits->nice.value_or(0) : 0;
+            job.command  = ProcessManager::pipeline_command(stages);
+            job.stages   = stages;
+            if (limits != nullptr) {
+                job.limits = *limits;
+            }
+            message = "[" + std::to_string(job.job_id) + "] Queued: " + job.command + "\n";
+            queue_.push_back(std::move(job));
+            this->publish();
         }
-        this->processes_.push_back(process);
+        // a blocked terminal must not hold up the reapers and jobs
+        std::cout << message;
         return true;
     }
 
-    std::shared_ptr<Process> process_get(const pid_t & pid) {
-        std::lock_guard<std::mutex> lock(processes_mutex_);
-        for (const auto & _process : processes_) {
-            if (_process->pid == pid) {
-                return _process;
+    /**
+     * Start queued jobs while fewer than max_jobs background jobs run: the first one, or with job_order =
+     * priority the first one of the lowest nice value. Called when a job finished, never with the lock held.
+     */
+    void dispatch() {
+        while (true) {
+            Queued next;
+            {
+                std::lock_guard<std::mutex> lock(processes_mutex_);
+                if (queue_.empty() || (max_jobs != 0 && this->running_background() >= max_jobs)) {
+                    return;
+                }
+                auto it = queue_.begin();
+                if (priority_order) {
+                    it = std::min_element(queue_.begin(), queue_.end(), [](const Queued & a, const Queued & b) {
+                        return a.priority < b.priority;
+                    });
+                }
+                next = std::move(*it);
+                queue_.erase(it);
+                this->publish();
             }
+            ProcessManager::start_pipeline(next.stages, true, next.limits.has_value() ? &*next.limits : nullptr,
+                                           next.job_id);
         }
-        return nullptr;
     }
 
-    std::shared_ptr<Process> process_get(const pid_t & pid, const ProcessType & type) {
-        std::lock_guard<std::mutex> lock(processes_mutex_);
-        for (const auto & _process : processes_) {
-            if (_process->pid == pid && _process->type == type) {
-                return _process;
-            }
+    // the cgroup leaf of a new job, "" without limits which need one or without a writable subtree
+    static std::string job_cgroup(const Limits * limits) {
+        return limits != nullptr && limits->wants_cgroup() ? Cgroups::instance().create(*limits) : std::string();
+    }
+
+    /**
+     * Replace the shell with the command, used for the last command of a -c string or a script like
+     * "sh -c cmd" does, it saves a whole process launch. Returns only when the exec failed.
+     */
+    static int exec_process(const std::vector<std::string> & args, const std::vector<Redirection> & redirections) {
+        if (args.empty()) {
+            return 0;
         }
-        return nullptr;
+        std::cout.flush();
+        std::cerr.flush();
+
+        const int err = Redirections::apply(redirections);
+        if (err != 0) {
+            std::cerr << args[0] << ": " << strerror(err) << "\n";
+            return 1;
+        }
+        for (const int sig : { SIGINT, SIGTSTP, SIGQUIT, SIGTTOU, SIGTTIN, SIGPIPE, SIGCHLD }) {
+            signal(sig, SIG_DFL);
+        }
+        sigset_t empty_mask;
+        sigemptyset(&empty_mask);
+        sigprocmask(SIG_SETMASK, &empty_mask, nullptr);
+
+        const arena::Argv argv(args);
+        execvp(argv[0], argv.data());
+
+        const int exec_errno = errno;
+        std::cerr << args[0] << ": " << strerror(exec_errno) << "\n";
+        return exec_errno == ENOENT ? 127 : 126;
     }
 
-    std::shared_ptr<Process> process_get(const pid_t & pid, const ProcessState & state) {
+    static void block_sigchld(sigset_t & old_mask) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    }
+
+    // returns the job when the pid was its last running member, the job is then removed from the table
+    std::shared_ptr<Process> process_delete(const pid_t & pid, const int & status_code = -1,
+                                            const rusage * usage = nullptr) {
+        std::lock_guard<std::mutex> lock(processes_mutex_);
+        return this->remove_member(pid, status_code, usage);
+    }
+
+    bool process_add(std::shared_ptr<Process> & process) {
         std::lock_guard<std::mutex> lock(processes_mutex_);
-        for (const auto & _process : processes_) {
-            if (_process->pid == pid && _process->state == state) {
-                return _process;
+        if (jobs_.contains(process->pid)) {
+            return false;
+        }
+        // a queued job brings its id along
+        if (process->job_id == 0) {
+            process->job_id = this->next_job_id();
+        }
+        // the members are not reaped yet, their pids can not belong to another process
+        for (const pid_t member : process->pids) {
+            const int pidfd  = ProcessManager::pidfd_open(member);
+            members_[member] = Member{ process->pid, pidfd };
+            // the exit wakes up the event loop, which reaps exactly this pid
+            if (pidfd != -1 && EventLoop::instance().is_open()) {
+                EventLoop::instance().add(pidfd, EPOLLIN,
+                                          [member](std::uint32_t) { ProcessManager::instance().reap_child(member); });
             }
         }
-        return nullptr;
+        jobs_.emplace(process->pid, process);
+        this->publish();
+        return true;
     }
 
-    std::shared_ptr<Process> process_get(const pid_t & pid, const ProcessState & state, const ProcessType & type) {
+    std::shared_ptr<Process> process_get(const pid_t & pid) {
         std::lock_guard<std::mutex> lock(processes_mutex_);
-        for (const auto & _process : processes_) {
-            if (_process->pid == pid && _process->state == state && _process->type == type) {
-                return _process;
+        const auto                  it = jobs_.find(pid);
+        return it != jobs_.end() ? it->second : nullptr;
+    }
+
+    std::shared_ptr<Process> process_get(const pid_t & pid, const ProcessType & type) {
+        auto process = this->process_get(pid);
+        return process != nullptr && process->type == type ? process : nullptr;
+    }
+
+    std::shared_ptr<Process> process_get(const pid_t & pid, const ProcessState & state) {
+        auto process = this->process_get(pid);
+        return process != nullptr && process->state == state ? process : nullptr;
+    }
+
+    std::shared_ptr<Process> process_get(const pid_t & pid, const ProcessState & state, const ProcessType & type) {
+        auto process = this->process_get(pid);
+        return process != nullptr && process->state == state && process->type == type ? process : nullptr;
+    }
+
+    pid_t process_get_latest_stopped_pid() const {
+        const auto jobs = this->snapshot();
+        for (auto it = jobs->jobs.rbegin(); it != jobs->jobs.rend(); ++it) {
+            if (it->state == ProcessManager::ProcessState::PM_PROC_STATE_STOPPED) {
+                return it->pid;
             }
         }
-        return nullptr;
+        return -1;
     }
 
-    pid_t process_get_latest_stopped_pid() {
-        std::lock_guard<std::mutex> lock(processes_mutex_);
-        for (auto it = processes_.rbegin(); it != processes_.rend(); ++it) {
-            if ((*it)->state == ProcessManager::ProcessState::PM_PROC_STATE_STOPPED) {
-                return (*it)->pid;
+    // the pid of a job given as %N (its job id) or as a pid, -1 when there is no such job
+    pid_t process_get_job_pid(const std::string & job) const {
+        const bool by_id = job.size() > 1 && job[0] == '%';
+        if (job.empty() || job.find_first_not_of("0123456789", by_id ? 1 : 0) != std::string::npos) {
+            return -1;
+        }
+        const long value = std::strtol(job.c_str() + (by_id ? 1 : 0), nullptr, 10);
+        for (const auto & process : this->snapshot()->jobs) {
+            if ((by_id ? process.job_id : process.pid) == value) {
+                return process.pid;
             }
         }
         return -1;
@@ -223,8 +792,13 @@ class ProcessManager {
     static void process_handle_foreground(const pid_t & pid, const pid_t group_id) {
         bool bring_foreground = false;
 
+        // the job is reaped here, not by the SIGCHLD handler
+        sigset_t old_mask;
+        ProcessManager::block_sigchld(old_mask);
+
         auto proc = ProcessManager::instance().process_get(pid);
         if (!proc) {
+            sigprocmask(SIG_SETMASK, &old_mask, nullptr);
             std::cerr << "No such process\n";
             return;
         }
@@ -247,111 +821,354 @@ class ProcessManager {
         }
 
         ProcessManager::instance().process_set_type(pid, ProcessType::PM_PROC_TYPE_FOREGROUND);
+        foreground_pgid_ = pid;
 
-        pid_t w;
-        int   status;
+        pid_t  w;
+        int    status;
+        rusage usage{};
 
-        do {
-            w = waitpid(pid, &status, WUNTRACED | WCONTINUED);
+        // the job is a process group, wait for every member of it
+        while (true) {
+            w = wait4(-pid, &status, WUNTRACED | WCONTINUED, &usage);
             if (w == -1) {
-                perror("waitpid");
+                if (errno == EINTR) {
+                    continue;
+                }
+                // ECHILD: the members were already reaped by the SIGCHLD handler
+                if (errno != ECHILD) {
+                    perror("waitpid");
+                }
                 break;
             }
 
-            //            std::cout << "(waitpid) Process " << pid << " state: " << ProcessManager::statusToString(proc->state)
-            //                      << " type: " << ProcessManager::typeToString(proc->type) << "\n";
-
             if (WIFEXITED(status)) {
-                //printf("%d exited, status=%d\n", pid, WEXITSTATUS(status));
-                ProcessManager::instance().process_delete(pid, WEXITSTATUS(status));
+                if (ProcessManager::instance().process_delete(w, WEXITSTATUS(status), &usage)) {
+                    break;
+                }
             } else if (WIFSIGNALED(status)) {
-                //printf("%d killed by signal %d\n", pid, WTERMSIG(status));
-                ProcessManager::instance().process_delete(pid, WTERMSIG(status));
+                if (ProcessManager::instance().process_delete(w, 128 + WTERMSIG(status), &usage)) {
+                    break;
+                }
             } else if (WIFSTOPPED(status)) {
-                //printf("%d stopped by signal %d\n", pid, WSTOPSIG(status));
                 ProcessManager::instance().process_set_state(pid, ProcessState::PM_PROC_STATE_STOPPED);
                 ProcessManager::instance().process_set_type(pid, ProcessType::PM_PROC_TYPE_BACKGROUND);
                 break;
             } else if (WIFCONTINUED(status)) {
-                //printf("%d continued\n", pid);
                 ProcessManager::instance().process_set_exit_status(pid, 0);
             }
+        }
 
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-
+        foreground_pgid_ = 0;
+        if (proc->state == ProcessState::PM_PROC_STATE_COMPLETED) {
+            ProcessManager::instance().last_foreground_usage_ = proc->usage;
+            if (report_time > 0 && proc->usage.wall >= report_time) {
+                std::cerr << "[time] " << proc->usage.summary() << ": " << proc->command << "\n";
+            }
+        }
         tcsetpgrp(STDIN_FILENO, group_id);
         tcsetpgrp(STDOUT_FILENO, group_id);
         tcsetpgrp(STDERR_FILENO, group_id);
+        sigprocmask(SIG_SETMASK, &old_mask, nullptr);
     }
 
     void process_set_type(const pid_t & pid, const ProcessType & type) {
         std::lock_guard<std::mutex> lock(processes_mutex_);
-        for (auto & _process : processes_) {
-            if (_process->pid == pid) {
-                _process->type = type;
-                return;
-            }
+        const auto                  it = jobs_.find(pid);
+        if (it != jobs_.end()) {
+            it->second->type = type;
+            this->publish();
         }
     }
 
     void process_set_state(const pid_t & pid, const ProcessState & state) {
         std::lock_guard<std::mutex> lock(processes_mutex_);
-        for (auto & _process : processes_) {
-            if (_process->pid == pid) {
-                _process->state = state;
-                return;
-            }
+        const auto                  it = jobs_.find(pid);
+        if (it != jobs_.end()) {
+            it->second->state = state;
+            this->publish();
         }
     }
 
     void process_set_exit_status(const pid_t & pid, const int & exit_status) {
         std::lock_guard<std::mutex> lock(processes_mutex_);
-        for (auto & _process : processes_) {
-            if (_process->pid == pid) {
-                _process->exit_status = exit_status;
-                return;
+        const auto                  it = jobs_.find(pid);
+        if (it != jobs_.end()) {
+            it->second->exit_status = exit_status;
+        }
+    }
+
+    /**
+     * Reap every member of the jobs which exited, stopped or continued. Used when a wakeup does not tell which
+     * child changed: a SIGCHLD without pidfds (pending signals are merged, one may stand for many children),
+     * before the prompt and between the commands of a script. Only the pids of the table are waited for, the
+     * children of parallel and batch are reaped by them. The changes of the background jobs are queued for
+     * the next prompt.
+     */
+    void reap_children() {
+        std::vector<pid_t> members;
+        {
+            std::lock_guard<std::mutex> lock(processes_mutex_);
+            members.reserve(members_.size());
+            for (const auto & member : members_) {
+                members.push_back(member.first);
             }
         }
+        // the notifications come in the order the jobs were started
+        std::sort(members.begin(), members.end());
+        for (const pid_t pid : members) {
+            this->reap_child(pid);
+        }
+        this->dispatch();
     }
 
-    static void handle_completed_processes() {
-        int   status;
-        int   wait;
-        pid_t pid;
+    // the scripts reap only after a SIGCHLD, they do not wait for every member after every command
+    void reap_children_signaled() {
+        if (child_signaled_.exchange(false, std::memory_order_relaxed)) {
+            this->reap_children();
+        }
+    }
 
-        while (true) {
-            pid = wait3(&status, WNOHANG, (struct rusage *) NULL);
-            if (pid == 0) {
-                return;
+    /**
+     * Reap one member of a job when it exited, stopped or continued. The wait and the update of the table
+     * happen under the lock, a job found in the table always has an unreaped member which keeps its process
+     * group id from being used again: kill(-pgid) of a job in the table never hits an unrelated process.
+     * Returns the job when this was its last member, the job is reported unless report is false.
+     */
+    std::shared_ptr<Process> reap_child(pid_t pid, bool report = true) {
+        std::unique_lock<std::mutex> lock(processes_mutex_);
+        if (!members_.contains(pid)) {
+            return nullptr;
+        }
+        int         status = 0;
+        rusage      usage{};
+        const pid_t w = wait4(pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage);
+        if (w <= 0) {
+            return nullptr;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            const auto job =
+                this->remove_member(pid, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status), &usage);
+            if (job != nullptr && report) {
+                this->notify(job, "completed");
+            }
+            // its slot is free, a queued job starts right away
+            if (job != nullptr && !queue_.empty()) {
+                lock.unlock();
+                this->dispatch();
+            }
+            return job;
+        }
+        if (WIFSTOPPED(status)) {
+            if (const auto job = this->member_state(pid, ProcessState::PM_PROC_STATE_STOPPED)) {
+                this->notify(job, "stopped");
+            }
+        } else if (WIFCONTINUED(status)) {
+            this->member_state(pid, ProcessState::PM_PROC_STATE_RUNNING);
+        }
+        return nullptr;
+    }
+
+    /**
+     * The wait builtin: sleeps in an epoll on the pidfds of the members of the jobs till every job (any: the
+     * first one) finished. Without pidfds the members are polled every 10 ms. timeout_ms -1 waits forever.
+     * Returns the exit status of the last finished job, 124 after the timeout and 130 when ^C interrupted it.
+     */
+    int wait_jobs(const std::vector<pid_t> & jobs, bool any, int timeout_ms) {
+        std::vector<pid_t> members;
+        const int          epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        bool               polled   = false;
+        {
+            std::lock_guard<std::mutex> lock(processes_mutex_);
+            for (const pid_t job : jobs) {
+                const auto it = jobs_.find(job);
+                if (it == jobs_.end()) {
+                    continue;
+                }
+                for (const pid_t member : it->second->pids) {
+                    members.push_back(member);
+                    epoll_event event{};
+                    event.events   = EPOLLIN;
+                    event.data.u64 = static_cast<std::uint64_t>(member);
+                    const int fd   = members_[member].pidfd;
+                    polled |= fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1;
+                }
+            }
+        }
+        // ^C: the interactive shell blocks it and gets it from the signalfd, in a script it interrupts epoll_wait
+        sigset_t interrupt;
+        sigemptyset(&interrupt);
+        sigaddset(&interrupt, SIGINT);
+        const int signal_fd = signalfd(-1, &interrupt, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (signal_fd != -1) {
+            epoll_event event{};
+            event.events   = EPOLLIN;
+            event.data.u64 = 0;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event);
+        }
+        interrupted_ = false;
+
+        std::vector<pid_t> pending(jobs);
+        int                status   = 0;
+        const auto         deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+        while (!pending.empty()) {
+            int wait_ms = -1;
+            if (timeout_ms >= 0) {
+                const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+                if (left.count() <= 0) {
+                    status = 124;
+                    break;
+                }
+                wait_ms = static_cast<int>(left.count());
+            }
+            if (polled) {
+                wait_ms = wait_ms == -1 ? 10 : std::min(wait_ms, 10);
+            }
+            epoll_event events[16];
+            const int   count = epoll_wait(epoll_fd, events, 16, wait_ms);
+            if ((count == -1 && errno != EINTR) || interrupted_) {
+                status = 128 + SIGINT;
+                break;
             }
-            if (pid == -1) {
-                return;
+            std::vector<pid_t> ready;
+            for (int i = 0; i < count; ++i) {
+                if (events[i].data.u64 == 0) {
+                    signalfd_siginfo info{};
+                    while (read(signal_fd, &info, sizeof(info)) == static_cast<ssize_t>(sizeof(info))) {
+                    }
+                    interrupted_ = true;
+                    continue;
+                }
+                ready.push_back(static_cast<pid_t>(events[i].data.u64));
+            }
+            if (interrupted_) {
+                status = 128 + SIGINT;
+                break;
             }
-            const auto rcode = WEXITSTATUS(status);
-            if (ProcessManager::instance().process_delete(pid, rcode)) {
-                std::cout << "Process " << pid << " completed.\n";
+            // an exited pidfd stays readable, the member is reaped right away; without pidfd every one is tried
+            for (const pid_t member : polled ? std::vector<pid_t>(members) : ready) {
+                const auto job = this->reap_child(member, false);
+                if (job == nullptr) {
+                    continue;
+                }
+                std::erase(members, member);
+                if (std::erase(pending, job->pid) > 0) {
+                    status = job->exit_status;
+                    if (any) {
+                        pending.clear();
+                    }
+                }
             }
+        }
+        if (signal_fd != -1) {
+            close(signal_fd);
+        }
+        close(epoll_fd);
+        return status;
+    }
+
+    // the interactive shell prints the job changes before its prompt, scripts do not report them
+    void set_notifications(bool enabled) { notifications_enabled_ = enabled; }
+
+    std::vector<std::string> take_notifications() {
+        std::lock_guard<std::mutex> lock(processes_mutex_);
+        return std::exchange(notifications_, {});
+    }
+
+    // the signal handler of the scripts, only async-signal-safe calls: ^C and ^Z go to the foreground job
+    static void handle_signal(int signal) {
+        if (signal == SIGCHLD) {
+            child_signaled_ = true;
             return;
         }
+        if (signal == SIGINT) {
+            interrupted_ = true;
+        }
+        const pid_t pgid = foreground_pgid_.load(std::memory_order_relaxed);
+        if (pgid > 0) {
+            kill(-pgid, signal);
+        }
+    }
+
+    // foreground jobs running longer (seconds) print their usage to stderr, 0 turns it off; [shell] report_time
+    inline static double report_time    = 0;
+    // background jobs running at once, the others wait in the queue; 0: no limit; [shell] max_jobs
+    inline static size_t max_jobs       = 0;
+    // [shell] job_order = priority (the default) or fifo
+    inline static bool   priority_order = true;
+
+    // the usage of the last foreground job which finished since the previous call, for the time builtin
+    Usage take_foreground_usage() { return std::exchange(last_foreground_usage_, Usage{}); }
+
+    /**
+     * The usage of a job which still runs, for jobs: the reaped members from wait4, the running ones from
+     * /proc/<pid>/stat (user and sys time) and the current resident set of them in place of the maximum.
+     */
+    static Usage live_usage(const Process & process) {
+        Usage      usage    = process.usage;
+        const long ticks    = sysconf(_SC_CLK_TCK);
+        const long page_kib = sysconf(_SC_PAGESIZE) / 1024;
+        usage.wall          = std::chrono::duration<double>(Clock::now() - process.started).count();
+        for (const pid_t pid : process.pids) {
+            std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+            std::string   line;
+            if (!std::getline(stat, line)) {
+                continue;
+            }
+            // the fields after the command, which may contain spaces: state is field 3, utime 14, stime 15, rss 24
+            std::istringstream fields(line.substr(line.rfind(')') + 2));
+            std::string        field;
+            for (int index = 3; fields >> field && index <= 24; ++index) {
+                if (index == 14) {
+                    usage.user += std::stod(field) / ticks;
+                } else if (index == 15) {
+                    usage.sys += std::stod(field) / ticks;
+                } else if (index == 24) {
+                    usage.max_rss = std::max(usage.max_rss, std::stol(field) * page_kib);
+                }
+            }
+        }
+        return usage;
+    }
+
+    // pidfd_open(2), -1 before Linux 5.3
+    static int pidfd_open(pid_t pid) { return static_cast<int>(syscall(SYS_pidfd_open, pid, 0)); }
+
+    static bool pidfd_supported() {
+        static const bool supported = [] {
+            const int fd = ProcessManager::pidfd_open(getpid());
+            if (fd == -1) {
+                return false;
+            }
+            close(fd);
+            return true;
+        }();
+        return supported;
+    }
+
+    // false when the job is not in the table (any more)
+    bool signal_job(pid_t pid, int signal) {
+        std::lock_guard<std::mutex> lock(processes_mutex_);
+        // reap_child holds the lock too: while the job is in the table its process group id is its own
+        return jobs_.contains(pid) && kill(-pid, signal) != -1;
     }
 
     static void send_signal_to_process(pid_t pid, int signal) {
         switch (signal) {
             case SIGKILL:
                 std::cout << "Killing process " << pid << "\n";
-                if (kill(pid, SIGKILL) != 1) {
+                if (ProcessManager::instance().signal_job(pid, SIGKILL)) {
                     ProcessManager::instance().process_set_state(pid, ProcessState::PM_PROC_STATE_COMPLETED);
                 }
                 break;
             case SIGSTOP:
                 std::cout << "Stopping process " << pid << "\n";
-                if (kill(pid, SIGSTOP) != -1) {
+                if (ProcessManager::instance().signal_job(pid, SIGSTOP)) {
                     ProcessManager::instance().process_set_state(pid, ProcessState::PM_PROC_STATE_STOPPED);
                 }
                 break;
             case SIGCONT:
                 std::cout << "Continuing process " << pid << "\n";
-                if (kill(pid, SIGCONT) != -1) {
+                if (ProcessManager::instance().signal_job(pid, SIGCONT)) {
                     ProcessManager::instance().process_set_state(pid, ProcessState::PM_PROC_STATE_RUNNING);
                 }
                 break;
@@ -363,10 +1180,10 @@ class ProcessManager {
 
     void send_signal_to_foregound(int signal) {
         std::lock_guard<std::mutex> lock(processes_mutex_);
-        for (auto & process : processes_) {
-            if (process->state == ProcessState::PM_PROC_STATE_RUNNING &&
-                process->type == ProcessType::PM_PROC_TYPE_FOREGROUND) {
-                kill(process->pid, signal);
+        for (auto & job : jobs_) {
+            if (job.second->state == ProcessState::PM_PROC_STATE_RUNNING &&
+                job.second->type == ProcessType::PM_PROC_TYPE_FOREGROUND) {
+                kill(-job.second->pid, signal);
             }
         }
     }
@@ -374,67 +1191,180 @@ class ProcessManager {
     void send_signal_to_all_processes(int signal) {
         std::lock_guard<std::mutex> lock(processes_mutex_);
         std::cout << "Sending signal " << signal << " to all processes\n";
-        for (auto & process : processes_) {
+        // like signal_job: to the process group, not only to the leader of the pipeline
+        for (auto & job : jobs_) {
+            auto & process = job.second;
             if (signal == SIGKILL) {
-                kill(process->pid, signal);
+                kill(-process->pid, signal);
             }
             if (signal == SIGSTOP && process->state == ProcessState::PM_PROC_STATE_RUNNING) {
                 process->state = ProcessState::PM_PROC_STATE_STOPPED;
-                kill(process->pid, signal);
+                kill(-process->pid, signal);
             }
             if (signal == SIGCONT && process->state == ProcessState::PM_PROC_STATE_STOPPED) {
                 process->state = ProcessState::PM_PROC_STATE_RUNNING;
-                kill(process->pid, signal);
+                kill(-process->pid, signal);
             }
         }
+        this->publish();
     }
 
+    // the jobs as they were at the last change of the table, read without taking the lock
+    std::shared_ptr<const Snapshot> snapshot() const { return snapshot_.load(std::memory_order_acquire); }
+
     std::vector<Process> get_running_processes() const {
-        std::lock_guard<std::mutex> lock(processes_mutex_);
-        std::vector<Process>        running;
-        for (const auto & process : processes_) {
-            if (process->state == ProcessState::PM_PROC_STATE_RUNNING) {
-                running.push_back(*process);
+        std::vector<Process> running;
+        for (const auto & process : this->snapshot()->jobs) {
+            if (process.state == ProcessState::PM_PROC_STATE_RUNNING) {
+                running.push_back(process);
             }
         }
         return running;
     }
 
     std::vector<Process> get_stopped_processes() const {
-        std::lock_guard<std::mutex> lock(processes_mutex_);
-        std::vector<Process>        stopped;
-        for (const auto & process : processes_) {
-            if (process->state == ProcessState::PM_PROC_STATE_STOPPED) {
-                stopped.push_back(*process);
+        std::vector<Process> stopped;
+        for (const auto & process : this->snapshot()->jobs) {
+            if (process.state == ProcessState::PM_PROC_STATE_STOPPED) {
+                stopped.push_back(process);
             }
         }
         return stopped;
     }
 
-    size_t get_running_processes_count() const {
-        std::lock_guard<std::mutex> lock(processes_mutex_);
-        size_t                      count = 0;
-        for (const auto & process : processes_) {
-            if (process->state == ProcessState::PM_PROC_STATE_RUNNING) {
-                count++;
-            }
+    size_t get_running_processes_count() const { return this->snapshot()->running; }
+
+    size_t get_stopped_processes_count() const { return this->snapshot()->stopped; }
+
+  private:
+    struct Member {
+        // the pid of the job
+        pid_t job   = -1;
+        int   pidfd = -1;
+    };
+
+    // the jobs by their pid, the process group id of a pipeline
+    std::unordered_map<pid_t, std::shared_ptr<Process>> jobs_;
+    // the not yet reaped members of the jobs
+    std::unordered_map<pid_t, Member>                   members_;
+    std::atomic<std::shared_ptr<const Snapshot>>        snapshot_{ std::make_shared<const Snapshot>() };
+    mutable std::mutex                                  processes_mutex_;
+    // the builtin stages of the background and stopped jobs, by the pid of their job
+    std::unordered_map<pid_t, std::vector<std::thread>> threads_;
+    // the background jobs waiting for a slot
+    std::vector<Queued>                                 queue_;
+    std::vector<std::string>                            notifications_;
+    bool                                                notifications_enabled_ = false;
+    Usage                                               last_foreground_usage_;
+    // the job waited for in the foreground, 0 at the prompt
+    inline static std::atomic<pid_t>                    foreground_pgid_{ 0 };
+    // set by the signal handler of the scripts
+    inline static std::atomic<bool>                     child_signaled_{ false };
+    inline static std::atomic<bool>                     interrupted_{ false };
+
+    // called with the lock held; like bash: one more than the highest job id in use, the queued ones too
+    int next_job_id() const {
+        int job_id = 0;
+        for (const auto & job : jobs_) {
+            job_id = std::max(job_id, job.second->job_id);
         }
-        return count;
+        for (const auto & job : queue_) {
+            job_id = std::max(job_id, job.job_id);
+        }
+        return job_id + 1;
     }
 
-    size_t get_stopped_processes_count() const {
-        std::lock_guard<std::mutex> lock(processes_mutex_);
-        size_t                      count = 0;
-        for (const auto & process : processes_) {
-            if (process->state == ProcessState::PM_PROC_STATE_STOPPED) {
-                count++;
+    // called with the lock held, the stopped ones and the foreground job do not take a slot
+    size_t running_background() const {
+        return static_cast<size_t>(std::count_if(jobs_.begin(), jobs_.end(), [](const auto & job) {
+            return job.second->type == ProcessType::PM_PROC_TYPE_BACKGROUND &&
+                   job.second->state == ProcessState::PM_PROC_STATE_RUNNING;
+        }));
+    }
+
+    // called with the lock held, the member is reaped; returns the job when it was its last member
+    std::shared_ptr<Process> remove_member(pid_t pid, int status_code, const rusage * usage = nullptr) {
+        const auto member = members_.find(pid);
+        const auto it     = jobs_.find(member != members_.end() ? member->second.job : pid);
+        if (member != members_.end()) {
+            if (member->second.pidfd != -1) {
+                if (EventLoop::instance().is_open()) {
+                    EventLoop::instance().remove(member->second.pidfd);
+                }
+                close(member->second.pidfd);
             }
+            members_.erase(member);
+        }
+        if (it == jobs_.end()) {
+            return nullptr;
+        }
+        auto process = it->second;
+        std::erase(process->pids, pid);
+        if (status_code != -1 && pid == process->last_pid) {
+            process->exit_status = status_code;
+        }
+        if (usage != nullptr) {
+            process->usage.add(*usage);
         }
-        return count;
+        if (!process->pids.empty()) {
+            return nullptr;
+        }
+        if (!process->cgroup.empty()) {
+            Cgroups::remove(process->cgroup);
+        }
+        // the external stages are gone, the builtin ones got their EOF or EPIPE and end on their own
+        const auto threads = threads_.find(process->pid);
+        if (threads != threads_.end()) {
+            for (auto & thread : threads->second) {
+                thread.detach();
+            }
+            threads_.erase(threads);
+        }
+        // the caller reports it, nothing refers to the job after that; its job id is free again
+        process->state      = ProcessState::PM_PROC_STATE_COMPLETED;
+        process->usage.wall = std::chrono::duration<double>(Clock::now() - process->started).count();
+        jobs_.erase(it);
+        this->publish();
+        return process;
+    }
+
+    // called with the lock held, the state of the job of a member pid; returns the job when its state changed
+    std::shared_ptr<Process> member_state(pid_t pid, ProcessState state) {
+        const auto member = members_.find(pid);
+        const auto it     = member != members_.end() ? jobs_.find(member->second.job) : jobs_.end();
+        if (it == jobs_.end() || it->second->state == state) {
+            return nullptr;
+        }
+        it->second->state = state;
+        if (state == ProcessState::PM_PROC_STATE_STOPPED) {
+            it->second->type = ProcessType::PM_PROC_TYPE_BACKGROUND;
+        }
+        this->publish();
+        return it->second;
+    }
+
+    // called with the lock held
+    void notify(const std::shared_ptr<Process> & job, const char * what) {
+        if (!notifications_enabled_) {
+            return;
+        }
+        notifications_.push_back("[" + std::to_string(job->job_id) + "] Process " + std::to_string(job->pid) + " " +
+                                 what + ".");
+    }
+
+    // called with the lock held after every change which jobs or the prompt can see
+    void publish() {
+        auto snapshot = std::make_shared<Snapshot>();
+        snapshot->jobs.reserve(jobs_.size());
+        for (const auto & job : jobs_) {
+            snapshot->jobs.push_back(*job.second);
+            snapshot->running += job.second->state == ProcessState::PM_PROC_STATE_RUNNING ? 1 : 0;
+            snapshot->stopped += job.second->state == ProcessState::PM_PROC_STATE_STOPPED ? 1 : 0;
+        }
+        std::sort(snapshot->jobs.begin(), snapshot->jobs.end(),
+                  [](const Process & a, const Process & b) { return a.job_id < b.job_id; });
+        snapshot->queued = queue_;
+        snapshot_.store(std::move(snapshot), std::memory_order_release);
     }
-  private:
-    std::vector<std::shared_ptr<Process>> processes_;
-    mutable std::mutex                    processes_mutex_;
-    std::vector<std::thread>              threads_;
 };
 #endif
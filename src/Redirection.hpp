@@ -0,0 +1,310 @@
+#ifndef REDIRECTION_HPP
+#define REDIRECTION_HPP
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+struct Redirection {
+    enum Type : std::uint8_t {
+        // N>file, N>|file
+        RD_OUTPUT,
+        // N>>file
+        RD_APPEND,
+        // N<file
+        RD_INPUT,
+        // N<>file
+        RD_READ_WRITE,
+        // N>&M, N<&M
+        RD_DUP,
+        // N>&-, N<&-
+        RD_CLOSE,
+    };
+
+    int         fd = STDOUT_FILENO;
+    Type        type = RD_OUTPUT;
+    std::string target;
+    int         target_fd = -1;
+
+    int open_flags() const {
+        switch (type) {
+            case RD_OUTPUT:
+                return O_WRONLY | O_CREAT | O_TRUNC;
+            case RD_APPEND:
+                return O_WRONLY | O_CREAT | O_APPEND;
+            case RD_INPUT:
+                return O_RDONLY;
+            case RD_READ_WRITE:
+                return O_RDWR | O_CREAT;
+            default:
+                return 0;
+        }
+    }
+
+    bool is_file() const { return type != RD_DUP && type != RD_CLOSE; }
+
+    // one line form used to pass the redirection to the fork server
+    std::string serialize() const {
+        return std::to_string(fd) + " " + std::to_string(type) + " " + std::to_string(target_fd) + " " + target;
+    }
+
+    static Redirection deserialize(const std::string & line) {
+        Redirection r;
+        int         type = 0;
+        int         read = 0;
+        sscanf(line.c_str(), "%d %d %d %n", &r.fd, &type, &r.target_fd, &read);
+        r.type   = static_cast<Type>(type);
+        r.target = line.substr(std::min<size_t>(read, line.size()));
+        return r;
+    }
+};
+
+/**
+ * The streams a builtin writes to. By default they are std::cout and std::cerr, redirections and pipelines
+ * point them at any other fd, so a builtin never needs a forked subshell.
+ */
+class BuiltinIO {
+  private:
+    std::unique_ptr<utils::FdStreamBuf> out_buf_;
+    std::unique_ptr<utils::FdStreamBuf> err_buf_;
+    std::vector<int>                    owned_fds_;
+
+    static std::streambuf * buffer_for(int fd, std::unique_ptr<utils::FdStreamBuf> & owned) {
+        if (fd == STDOUT_FILENO) {
+            return std::cout.rdbuf();
+        }
+        if (fd == STDERR_FILENO) {
+            return std::cerr.rdbuf();
+        }
+        owned = std::make_unique<utils::FdStreamBuf>(fd);
+        return owned.get();
+    }
+
+  public:
+    int          in;
+    // the fds behind out and err, for builtins which start processes writing to them
+    int          out_fd;
+    int          err_fd;
+    std::ostream out;
+    std::ostream err;
+    // exit status of the builtin
+    int          status     = 0;
+    // the command line ended with &, a builtin which starts a job (limit) starts it in the background
+    bool         background = false;
+
+    // owned_fds are closed when the builtin finished
+    explicit BuiltinIO(int in_fd = STDIN_FILENO, int out_fd = STDOUT_FILENO, int err_fd = STDERR_FILENO,
+                       std::vector<int> owned_fds = {}) :
+        owned_fds_(std::move(owned_fds)),
+        in(in_fd),
+        out_fd(out_fd),
+        err_fd(err_fd),
+        out(buffer_for(out_fd, out_buf_)),
+        err(buffer_for(err_fd, err_buf_)) {}
+
+    BuiltinIO(const BuiltinIO &)             = delete;
+    BuiltinIO & operator=(const BuiltinIO &) = delete;
+
+    ~BuiltinIO() {
+        out.flush();
+        err.flush();
+        out_buf_.reset();
+        err_buf_.reset();
+        for (const int fd : owned_fds_) {
+            close(fd);
+        }
+    }
+};
+
+class Redirections {
+  public:
+    /**
+     * Move the redirection operators (>, >>, <, <>, &>, &>>, N>&M, N<&M, N>&-) out of the arguments.
+     * The arguments flagged in quoted (one flag per argument, nullptr: none) are words, not operators; the
+     * flags of the arguments which are left stay in quoted. Returns false with a message in error on a syntax error.
+     */
+    static bool extract(std::vector<std::string> & args, std::vector<Redirection> & redirections,
+                        std::string & error, std::vector<bool> * quoted = nullptr) {
+        std::vector<std::string> remaining;
+        std::vector<bool>        remaining_quoted;
+
+        for (size_t i = 0; i < args.size(); ++i) {
+            const std::string & token = args[i];
+            size_t              pos   = 0;
+            int                 fd    = -1;
+            bool                both  = false;
+
+            const bool is_quoted = quoted != nullptr && i < quoted->size() && (*quoted)[i];
+            if (is_quoted) {
+                remaining.push_back(token);
+                remaining_quoted.push_back(true);
+                continue;
+            }
+            if (token.size() > 1 && token[0] == '&' && token[1] == '>') {
+                both = true;
+                pos  = 1;
+            } else {
+                while (pos < token.size() && std::isdigit(static_cast<unsigned char>(token[pos]))) {
+                    ++pos;
+                }
+                if (pos > 0 && pos < token.size() && pos < 10) {
+                    fd = std::stoi(token.substr(0, pos));
+                }
+            }
+            if (pos >= token.size() || (token[pos] != '>' && token[pos] != '<')) {
+                remaining.push_back(token);
+                remaining_quoted.push_back(false);
+                continue;
+            }
+
+            Redirection redirection;
+            size_t      op_len = 1;
+            const char  next   = pos + 1 < token.size() ? token[pos + 1] : '\0';
+            if (token[pos] == '>') {
+                redirection.type = Redirection::RD_OUTPUT;
+                if (next == '>') {
+                    redirection.type = Redirection::RD_APPEND;
+                    op_len           = 2;
+                } else if (next == '&') {
+                    redirection.type = Redirection::RD_DUP;
+                    op_len           = 2;
+                } else if (next == '|') {
+                    op_len = 2;
+                }
+                redirection.fd = fd == -1 ? STDOUT_FILENO : fd;
+            } else {
+                redirection.type = Redirection::RD_INPUT;
+                if (next == '>') {
+                    redirection.type = Redirection::RD_READ_WRITE;
+                    op_len           = 2;
+                } else if (next == '&') {
+                    redirection.type = Redirection::RD_DUP;
+                    op_len           = 2;
+                }
+                redirection.fd = fd == -1 ? STDIN_FILENO : fd;
+            }
+
+            std::string target = token.substr(pos + op_len);
+            if (target.empty()) {
+                if (i + 1 >= args.size()) {
+                    error = "syntax error near unexpected token `newline'";
+                    return false;
+                }
+                target = args[++i];
+            }
+
+            if (redirection.type == Redirection::RD_DUP) {
+                if (target == "-") {
+                    redirection.type = Redirection::RD_CLOSE;
+                } else if (std::all_of(target.begin(), target.end(), ::isdigit)) {
+                    redirection.target_fd = std::stoi(target);
+                } else if (fd == -1 && token[pos] == '>') {
+                    // >&file is the same as &>file
+                    both             = true;
+                    redirection.type = Redirection::RD_OUTPUT;
+                } else {
+                    error = target + ": ambiguous redirect";
+                    return false;
+                }
+            }
+            redirection.target = target;
+
+            if (both) {
+                redirection.fd = STDOUT_FILENO;
+                redirections.push_back(redirection);
+                redirections.push_back({ STDERR_FILENO, Redirection::RD_DUP, "", STDOUT_FILENO });
+                continue;
+            }
+            redirections.push_back(redirection);
+        }
+
+        args = std::move(remaining);
+        if (quoted != nullptr) {
+            *quoted = std::move(remaining_quoted);
+        }
+        return true;
+    }
+
+    // adds the open/dup2/close steps to the actions of a posix_spawn, they run in the child before the exec
+    static void add_spawn_actions(posix_spawn_file_actions_t * actions, const std::vector<Redirection> & redirections) {
+        for (const auto & r : redirections) {
+            if (r.is_file()) {
+                posix_spawn_file_actions_addopen(actions, r.fd, r.target.c_str(), r.open_flags(), 0666);
+            } else if (r.type == Redirection::RD_DUP) {
+                posix_spawn_file_actions_adddup2(actions, r.target_fd, r.fd);
+            } else {
+                posix_spawn_file_actions_addclose(actions, r.fd);
+            }
+        }
+    }
+
+    // open + dup2 in an already forked child, returns 0 or the errno of the failed step
+    static int apply(const std::vector<Redirection> & redirections) {
+        for (const auto & r : redirections) {
+            if (r.is_file()) {
+                const int fd = open(r.target.c_str(), r.open_flags(), 0666);
+                if (fd == -1) {
+                    return errno;
+                }
+                if (fd != r.fd) {
+                    if (dup2(fd, r.fd) == -1) {
+                        const int err = errno;
+                        close(fd);
+                        return err;
+                    }
+                    close(fd);
+                }
+            } else if (r.type == Redirection::RD_DUP) {
+                if (dup2(r.target_fd, r.fd) == -1) {
+                    return errno;
+                }
+            } else {
+                close(r.fd);
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * Builtins run inside the shell, so instead of dup2 the fds of the standard streams are swapped in fds.
+     * Newly opened fds are appended to opened, the caller closes them when the builtin finished.
+     */
+    static bool open_for_builtin(const std::vector<Redirection> & redirections, int (&fds)[3], std::vector<int> & opened,
+                                 std::string & error) {
+        for (const auto & r : redirections) {
+            if (r.fd < 0 || r.fd > STDERR_FILENO) {
+                continue;
+            }
+            if (r.is_file()) {
+                const int fd = open(r.target.c_str(), r.open_flags() | O_CLOEXEC, 0666);
+                if (fd == -1) {
+                    error = r.target + ": " + strerror(errno);
+                    return false;
+                }
+                opened.push_back(fd);
+                fds[r.fd] = fd;
+            } else if (r.type == Redirection::RD_DUP) {
+                if (r.target_fd >= 0 && r.target_fd <= STDERR_FILENO) {
+                    fds[r.fd] = fds[r.target_fd];
+                }
+            } else {
+                fds[r.fd] = -1;
+            }
+        }
+        return true;
+    }
+};
+
+#endif  // REDIRECTION_HPP
@@ -0,0 +1,415 @@
+#ifndef RESOURCE_LIMITS_HPP
+#define RESOURCE_LIMITS_HPP
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * The limits of a job, given to the limit builtin or to a command of the [limits] section of the configuration.
+ * The rlimits are set by the child between its fork and its exec. The memory and the CPU share of the whole job
+ * are given to a cgroup v2 leaf of its own when the shell can write a cgroup subtree (see Cgroups), without one
+ * the memory falls back to RLIMIT_AS of every process and the CPU share to a lower priority. The placement of the
+ * job (its CPUs and its I/O class) is set by the child as well, a named set of them is a policy of the [policies]
+ * section.
+ */
+struct Limits {
+    // linux/ioprio.h
+    static constexpr int IOPRIO_WHO_PROCESS = 1;
+    static constexpr int IOPRIO_CLASS_RT    = 1;
+    static constexpr int IOPRIO_CLASS_BE    = 2;
+    static constexpr int IOPRIO_CLASS_IDLE  = 3;
+    static constexpr int IOPRIO_CLASS_SHIFT = 13;
+
+    // bytes, 0: no limit
+    rlim_t             memory   = 0;
+    // percent of one CPU, 200 is two CPUs, 0: no limit
+    unsigned           cpu      = 0;
+    rlim_t             nofile   = 0;
+    rlim_t             nproc    = 0;
+    // CPU seconds of every process, RLIMIT_CPU
+    rlim_t             cpu_time = 0;
+    // the nice value of every process, the I/O priority follows it; the priority of the job in the queue
+    std::optional<int> nice;
+    // the CPUs every process may run on
+    std::optional<cpu_set_t> cpus;
+    // the I/O class and level, in place of the one which follows the nice value
+    std::optional<int> ioprio;
+
+    // the nice value of a job with a CPU share when it is not in a cgroup
+    static constexpr int FALLBACK_NICE = 10;
+
+    bool empty() const {
+        return memory == 0 && cpu == 0 && nofile == 0 && nproc == 0 && cpu_time == 0 && !nice.has_value() &&
+               !cpus.has_value() && !ioprio.has_value();
+    }
+
+    // the limits a cgroup leaf is made for
+    bool wants_cgroup() const { return memory != 0 || cpu != 0; }
+
+    // reads the options from args[index], index is left at the first word which is not one; false on a bad option
+    bool parse(const std::vector<std::string> & args, size_t & index, std::string & error) {
+        for (; index < args.size() && args[index].starts_with("--"); ++index) {
+            const std::string & option = args[index];
+            if (index + 1 == args.size()) {
+                error = option + ": missing value";
+                return false;
+            }
+            const std::string & value = args[++index];
+            bool                valid = false;
+            if (option == "--mem") {
+                valid = Limits::parse_size(value, memory);
+            } else if (option == "--cpu") {
+                rlim_t percent = 0;
+                valid          = Limits::parse_number(value.ends_with('%') ? value.substr(0, value.size() - 1) : value,
+                                                      percent) &&
+                        percent <= 100000;
+                cpu = static_cast<unsigned>(percent);
+            } else if (option == "--nofile") {
+                valid = Limits::parse_number(value, nofile);
+            } else if (option == "--nproc") {
+                valid = Limits::parse_number(value, nproc);
+            } else if (option == "--cpu-time") {
+                valid = Limits::parse_number(value, cpu_time);
+            } else if (option == "--nice") {
+                // -20 (the highest priority) .. 19
+                const bool negative = value.starts_with('-');
+                rlim_t     number   = 0;
+                valid               = value == "0" || (Limits::parse_number(value.substr(negative ? 1 : 0), number) &&
+                                         number <= (negative ? 20U : 19U));
+                nice                = negative ? -static_cast<int>(number) : static_cast<int>(number);
+            } else if (option == "--cpus") {
+                cpu_set_t set;
+                valid = Limits::parse_cpus(value, set);
+                cpus  = set;
+            } else if (option == "--io") {
+                int priority = 0;
+                valid        = Limits::parse_io(value, priority);
+                ioprio       = priority;
+            } else {
+                error = option + ": unknown option";
+                return false;
+            }
+            if (!valid) {
+                error = option + ": invalid value: " + value;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // a policy of the configuration: "cpus:4-15 io:idle nice:10", every key is an option of limit
+    bool parse_policy(const std::string & text, std::string & error) {
+        std::istringstream       words(text);
+        std::vector<std::string> args;
+        for (std::string word; words >> word;) {
+            const size_t colon = word.find(':');
+            if (colon == std::string::npos || colon == 0) {
+                error = word + ": not a key:value";
+                return false;
+            }
+            args.push_back("--" + word.substr(0, colon));
+            args.push_back(word.substr(colon + 1));
+        }
+        size_t index = 0;
+        return this->parse(args, index, error);
+    }
+
+    /**
+     * Called in the child between the fork and the exec, only syscalls: the path of cgroup.procs was built
+     * before the fork, nullptr when the job has no leaf. A leaf the child could not enter is not fatal, the
+     * fallbacks are set instead. Returns 0 or the errno of the failed rlimit, CPU set or I/O class.
+     */
+    int apply(const char * cgroup_procs) const {
+        bool in_cgroup = false;
+        if (cgroup_procs != nullptr) {
+            const int fd = open(cgroup_procs, O_WRONLY | O_CLOEXEC);
+            in_cgroup    = fd != -1 && write(fd, "0", 1) == 1;
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+        // a negative nice value needs CAP_SYS_NICE, without it the job keeps the priority of the shell
+        if (nice.has_value()) {
+            setpriority(PRIO_PROCESS, 0, *nice);
+            // the best effort class, its 8 levels follow the nice value like the kernel's default does
+            syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | (*nice + 20) / 5);
+        } else if (!in_cgroup && cpu != 0) {
+            setpriority(PRIO_PROCESS, 0, FALLBACK_NICE);
+        }
+        // asked for by name, a CPU set without an online CPU or the realtime class without the privilege fails
+        if (ioprio.has_value() && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, *ioprio) == -1) {
+            return errno;
+        }
+        if (cpus.has_value() && sched_setaffinity(0, sizeof(cpu_set_t), &*cpus) == -1) {
+            return errno;
+        }
+        const struct {
+            int    resource;
+            rlim_t value;
+        } rlimits[] = {
+            { RLIMIT_AS,     in_cgroup ? 0 : memory },
+            { RLIMIT_NOFILE, nofile                 },
+            { RLIMIT_NPROC,  nproc                  },
+            { RLIMIT_CPU,    cpu_time               },
+        };
+        for (const auto & limit : rlimits) {
+            if (limit.value == 0) {
+                continue;
+            }
+            // an unprivileged process can not raise its hard limit, it is only lowered
+            rlimit current{};
+            getrlimit(limit.resource, &current);
+            const rlim_t value = std::min(limit.value, current.rlim_max);
+            // SIGXCPU at the soft limit of the CPU time, SIGKILL a second later
+            const rlimit wanted{ value, limit.resource == RLIMIT_CPU ? std::min(value + 1, current.rlim_max) : value };
+            if (setrlimit(limit.resource, &wanted) == -1) {
+                return errno;
+            }
+        }
+        return 0;
+    }
+
+    // 512, 64K, 512M, 2G, 1T; binary units
+    static bool parse_size(const std::string & value, rlim_t & bytes) {
+        if (value.empty()) {
+            return false;
+        }
+        rlim_t      unit   = 1;
+        std::string number = value;
+        switch (value.back()) {
+            case 'K':
+            case 'k':
+                unit = rlim_t{ 1 } << 10;
+                break;
+            case 'M':
+            case 'm':
+                unit = rlim_t{ 1 } << 20;
+                break;
+            case 'G':
+            case 'g':
+                unit = rlim_t{ 1 } << 30;
+                break;
+            case 'T':
+            case 't':
+                unit = rlim_t{ 1 } << 40;
+                break;
+            default:
+                break;
+        }
+        if (unit != 1) {
+            number.pop_back();
+        }
+        if (!Limits::parse_number(number, bytes) || bytes > RLIM_INFINITY / unit) {
+            return false;
+        }
+        bytes *= unit;
+        return true;
+    }
+
+    // 0-3,8,10-11; the CPU numbers of the kernel
+    static bool parse_cpus(const std::string & value, cpu_set_t & set) {
+        CPU_ZERO(&set);
+        std::istringstream ranges(value);
+        std::string        range;
+        bool               any = false;
+        while (std::getline(ranges, range, ',')) {
+            const size_t dash  = range.find('-');
+            rlim_t       first = 0;
+            rlim_t       last  = 0;
+            if (!Limits::parse_index(range.substr(0, dash), first) ||
+                !Limits::parse_index(dash == std::string::npos ? range : range.substr(dash + 1), last) ||
+                first > last || last >= CPU_SETSIZE) {
+                return false;
+            }
+            for (rlim_t n = first; n <= last; ++n) {
+                CPU_SET(n, &set);
+            }
+            any = true;
+        }
+        return any;
+    }
+
+    // idle, best-effort[:LEVEL], realtime[:LEVEL] (be, rt); the levels are 0 (the highest) .. 7, 4 by default
+    static bool parse_io(const std::string & value, int & priority) {
+        const size_t      colon = value.find(':');
+        const std::string name  = value.substr(0, colon);
+        int               io_class;
+        if (name == "idle") {
+            io_class = IOPRIO_CLASS_IDLE;
+        } else if (name == "best-effort" || name == "be") {
+            io_class = IOPRIO_CLASS_BE;
+        } else if (name == "realtime" || name == "rt") {
+            io_class = IOPRIO_CLASS_RT;
+        } else {
+            return false;
+        }
+        rlim_t level = 4;
+        if (colon != std::string::npos) {
+            // the idle class has no levels
+            const std::string text = value.substr(colon + 1);
+            if (io_class == IOPRIO_CLASS_IDLE || !Limits::parse_index(text, level) || level > 7) {
+                return false;
+            }
+        }
+        priority = io_class << IOPRIO_CLASS_SHIFT | (io_class == IOPRIO_CLASS_IDLE ? 0 : static_cast<int>(level));
+        return true;
+    }
+
+    // a positive decimal number
+    static bool parse_number(const std::string & value, rlim_t & number) {
+        return Limits::parse_index(value, number) && number != 0;
+    }
+
+    // a decimal number, 0 too
+    static bool parse_index(const std::string & value, rlim_t & number) {
+        if (value.empty() || value.size() > 18 || value.find_first_not_of("0123456789") != std::string::npos) {
+            return false;
+        }
+        number = std::stoull(value);
+        return true;
+    }
+};
+
+/**
+ * The cgroup v2 leaves of the jobs with limits. The subtree is [shell] cgroup_root or the cgroup of the shell
+ * itself (a systemd scope or service with Delegate=yes); "off" turns the cgroups off. The memory and cpu
+ * controllers are given to the children of the subtree once, a cgroup with processes can not do that: the shell
+ * moves into a leaf of its own first. Every job gets a leaf with memory.max and cpu.max, the child enters it
+ * before its exec and the leaf is removed when the job finished. When any of it is not possible the jobs run
+ * with the fallbacks of Limits.
+ */
+class Cgroups {
+  public:
+    static Cgroups & instance() {
+        static Cgroups instance;
+        return instance;
+    }
+
+    Cgroups(const Cgroups &)             = delete;
+    Cgroups & operator=(const Cgroups &) = delete;
+
+    // checked again on the next job
+    void set_root(const std::string & root) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        root_    = root;
+        checked_ = false;
+    }
+
+    // a new leaf with the limits of the job written, "" when there is no writable subtree
+    std::string create(const Limits & limits) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!checked_) {
+            base_    = this->prepare();
+            checked_ = true;
+        }
+        if (base_.empty()) {
+            if (!warned_) {
+                warned_ = true;
+                std::cerr << "limit: no writable cgroup v2 subtree, the memory is limited per process and the CPU "
+                             "share by nice "
+                          << Limits::FALLBACK_NICE << "\n";
+            }
+            return "";
+        }
+        const std::string leaf = base_ + "/job-" + std::to_string(getpid()) + "-" + std::to_string(++count_);
+        if (mkdir(leaf.c_str(), 0755) == -1) {
+            return "";
+        }
+        const bool written =
+            (limits.memory == 0 || Cgroups::write_file(leaf + "/memory.max", std::to_string(limits.memory))) &&
+            (limits.cpu == 0 || Cgroups::write_file(leaf + "/cpu.max", std::to_string(std::uint64_t{ limits.cpu } * CPU_PERIOD / 100) +
+                                                                           " " + std::to_string(CPU_PERIOD)));
+        if (!written) {
+            rmdir(leaf.c_str());
+            return "";
+        }
+        return leaf;
+    }
+
+    // a leaf which still has processes (a daemon of the job) stays
+    static void remove(const std::string & leaf) { rmdir(leaf.c_str()); }
+
+  private:
+    // microseconds, the period of cpu.max
+    static constexpr unsigned CPU_PERIOD = 100000;
+
+    std::mutex    mutex_;
+    std::string   root_;
+    std::string   base_;
+    bool          checked_ = false;
+    bool          warned_  = false;
+    std::uint64_t count_   = 0;
+
+    Cgroups() = default;
+
+    // the subtree the leaves go to, "" when there is none
+    std::string prepare() const {
+        if (root_ == "off") {
+            return "";
+        }
+        const std::string own  = Cgroups::own_cgroup();
+        const std::string base = root_.empty() ? own : root_;
+        if (base.empty() || access((base + "/cgroup.subtree_control").c_str(), W_OK) != 0) {
+            return "";
+        }
+        if (Cgroups::write_file(base + "/cgroup.subtree_control", "+memory +cpu")) {
+            return base;
+        }
+        if (errno != EBUSY || base != own) {
+            return "";
+        }
+        const std::string shell = base + "/shell-" + std::to_string(getpid());
+        if ((mkdir(shell.c_str(), 0755) == 0 || errno == EEXIST) && Cgroups::write_file(shell + "/cgroup.procs", "0") &&
+            Cgroups::write_file(base + "/cgroup.subtree_control", "+memory +cpu")) {
+            return base;
+        }
+        return "";
+    }
+
+    // the directory of the cgroup v2 of the shell, "" on a cgroup v1 or hybrid system
+    static std::string own_cgroup() {
+        std::ifstream file("/proc/self/cgroup");
+        std::string   line;
+        while (std::getline(file, line)) {
+            if (line.starts_with("0::")) {
+                std::string path = "/sys/fs/cgroup" + line.substr(3);
+                if (path.back() == '/') {
+                    path.pop_back();
+                }
+                return access((path + "/cgroup.controllers").c_str(), F_OK) == 0 ? path : "";
+            }
+        }
+        return "";
+    }
+
+    // false with errno set
+    static bool write_file(const std::string & path, const std::string & value) {
+        const int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        const bool written = write(fd, value.data(), value.size()) == static_cast<ssize_t>(value.size());
+        const int  err     = errno;
+        close(fd);
+        errno = err;
+        return written;
+    }
+};
+
+#endif  // RESOURCE_LIMITS_HPP
@@ -0,0 +1,391 @@
+#ifndef SCRIPT_CACHE_HPP
+#define SCRIPT_CACHE_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "options.hpp"
+#include "ScriptVM.hpp"
+
+#ifndef CMAKE_PROJECT_VERSION
+#    define CMAKE_PROJECT_VERSION "unknown"
+#endif
+
+namespace vm {
+
+/**
+ * Compiled scripts in $XDG_CACHE_HOME/simpleshell (~/.cache/simpleshell), one file per script path.
+ * The header holds the path, inode, mtime and size of the script and the shell version, an entry which does not
+ * match the script any more is compiled again and overwritten. Slots are process local, the file refers to the
+ * variables by name and they are mapped to slots when the entry is loaded.
+ */
+class ScriptCache {
+  public:
+    static std::string directory() {
+        const char * xdg = getenv("XDG_CACHE_HOME");
+        if (xdg != nullptr && xdg[0] == '/') {
+            return std::string(xdg) + "/simpleshell";
+        }
+        const char * home = getenv("HOME");
+        if (home == nullptr || home[0] == '\0') {
+            return "";
+        }
+        return std::string(home) + "/.cache/simpleshell";
+    }
+
+    // the program is only filled on a hit
+    static bool load(const std::string & script, const struct stat & st, VariableTable & variables,
+                     Program & program) {
+        const std::string file = ScriptCache::entry_path(script);
+        if (file.empty()) {
+            return false;
+        }
+        const int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat entry_st {};
+
+        if (fstat(fd, &entry_st) == -1 || entry_st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void * data = mmap(nullptr, entry_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            return false;
+        }
+
+        Reader     reader{ static_cast<const char *>(data), static_cast<size_t>(entry_st.st_size) };
+        Program    loaded;
+        const bool valid = ScriptCache::read_header(reader, script, st) && ScriptCache::read_program(reader, variables, loaded);
+        munmap(data, entry_st.st_size);
+        if (valid) {
+            program = std::move(loaded);
+        }
+        return valid;
+    }
+
+    // best effort, a read-only or missing cache directory only costs the parsing on the next run
+    static void store(const std::string & script, const struct stat & st, VariableTable & variables,
+                      const Program & program) {
+        const std::string file = ScriptCache::entry_path(script);
+        if (file.empty()) {
+            return;
+        }
+        std::error_code ec;
+        std::filesystem::create_directories(std::filesystem::path(file).parent_path(), ec);
+
+        std::string buffer;
+        ScriptCache::write_header(buffer, script, st);
+        ScriptCache::write_program(buffer, variables, program);
+
+        // written to a temporary file and renamed, a shell starting at the same time never sees a partial entry
+        std::string tmp = file + ".XXXXXX";
+        const int   fd  = mkstemp(tmp.data());
+        if (fd == -1) {
+            return;
+        }
+        size_t written = 0;
+        while (written < buffer.size()) {
+            const ssize_t n = write(fd, buffer.data() + written, buffer.size() - written);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            written += n;
+        }
+        close(fd);
+        if (written != buffer.size() || rename(tmp.c_str(), file.c_str()) == -1) {
+            unlink(tmp.c_str());
+        }
+    }
+
+  private:
+    static constexpr char          MAGIC[4] = { 'S', 'S', 'B', 'C' };
+    // bumped when the layout of the file or the meaning of the opcodes changes
+    static constexpr std::uint32_t FORMAT   = 1;
+
+    struct Reader {
+        const char * data;
+        size_t       size;
+        size_t       pos = 0;
+
+        bool read(void * out, size_t n) {
+            if (size - pos < n) {
+                return false;
+            }
+            memcpy(out, data + pos, n);
+            pos += n;
+            return true;
+        }
+
+        bool read_u32(std::uint32_t & value) { return this->read(&value, sizeof(value)); }
+
+        bool read_u64(std::uint64_t & value) { return this->read(&value, sizeof(value)); }
+
+        bool read_string(std::string & value) {
+            std::uint32_t length = 0;
+            if (!this->read_u32(length) || size - pos < length) {
+                return false;
+            }
+            value.assign(data + pos, length);
+            pos += length;
+            return true;
+        }
+    };
+
+    static std::string canonical(const std::string & script) {
+        char resolved[PATH_MAX];
+        return realpath(script.c_str(), resolved) != nullptr ? std::string(resolved) : script;
+    }
+
+    // FNV-1a of the canonical path, the full path is stored in the header against collisions
+    static std::string entry_path(const std::string & script) {
+        const std::string dir = ScriptCache::directory();
+        if (dir.empty()) {
+            return "";
+        }
+        std::uint64_t hash = 14695981039346656037ULL;
+        for (const char c : ScriptCache::canonical(script)) {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 1099511628211ULL;
+        }
+        char name[17];
+        snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+        return dir + "/" + name;
+    }
+
+    static void put(std::string & buffer, const void * data, size_t n) {
+        buffer.append(static_cast<const char *>(data), n);
+    }
+
+    static void put_u32(std::string & buffer, std::uint32_t value) { ScriptCache::put(buffer, &value, sizeof(value)); }
+
+    static void put_u64(std::string & buffer, std::uint64_t value) { ScriptCache::put(buffer, &value, sizeof(value)); }
+
+    static void put_string(std::string & buffer, std::string_view value) {
+        ScriptCache::put_u32(buffer, value.size());
+        buffer.append(value);
+    }
+
+    static void write_header(std::string & buffer, const std::string & script, const struct stat & st) {
+        ScriptCache::put(buffer, MAGIC, sizeof(MAGIC));
+        ScriptCache::put_u32(buffer, FORMAT);
+        ScriptCache::put_string(buffer, CMAKE_PROJECT_VERSION);
+        ScriptCache::put_string(buffer, ScriptCache::canonical(script));
+        ScriptCache::put_u64(buffer, st.st_ino);
+        ScriptCache::put_u64(buffer, st.st_mtim.tv_sec);
+        ScriptCache::put_u64(buffer, st.st_mtim.tv_nsec);
+        ScriptCache::put_u64(buffer, st.st_size);
+    }
+
+    static bool read_header(Reader & reader, const std::string & script, const struct stat & st) {
+        char          magic[4];
+        std::uint32_t format = 0;
+        std::string   version;
+        std::string   path;
+        std::uint64_t inode = 0, mtime_sec = 0, mtime_nsec = 0, size = 0;
+        return reader.read(magic, sizeof(magic)) && memcmp(magic, MAGIC, sizeof(MAGIC)) == 0 &&
+               reader.read_u32(format) && format == FORMAT && reader.read_string(version) &&
+               version == CMAKE_PROJECT_VERSION && reader.read_string(path) &&
+               path == ScriptCache::canonical(script) && reader.read_u64(inode) && inode == st.st_ino &&
+               reader.read_u64(mtime_sec) && mtime_sec == static_cast<std::uint64_t>(st.st_mtim.tv_sec) &&
+               reader.read_u64(mtime_nsec) && mtime_nsec == static_cast<std::uint64_t>(st.st_mtim.tv_nsec) &&
+               reader.read_u64(size) && size == static_cast<std::uint64_t>(st.st_size);
+    }
+
+    static bool has_slot(const Instruction & in) { return in.op == OpCode::OP_ASSIGN || in.op == OpCode::OP_FOR_NEXT; }
+
+    static void write_program(std::string & buffer, VariableTable & variables, const Program & program) {
+        // process slot -> index in the name table of the file
+        std::unordered_map<std::uint32_t, std::uint32_t> local;
+        std::vector<std::string>                         names;
+        const auto                                       local_slot = [&](std::uint32_t slot) {
+            const auto it = local.find(slot);
+            if (it != local.end()) {
+                return it->second;
+            }
+            names.push_back(variables.name(slot));
+            return local[slot] = names.size() - 1;
+        };
+
+        std::vector<Instruction> code = program.code;
+        for (auto & in : code) {
+            if (ScriptCache::has_slot(in)) {
+                in.a = local_slot(in.a);
+            }
+        }
+        std::vector<Template> templates = program.templates;
+        for (auto & segments : templates) {
+            for (auto & segment : segments) {
+                if (segment.type == SegmentType::SEG_SLOT) {
+                    segment.index = local_slot(segment.index);
+                }
+            }
+        }
+
+        ScriptCache::put_u32(buffer, names.size());
+        for (const auto & name : names) {
+            ScriptCache::put_string(buffer, name);
+        }
+        ScriptCache::put_u32(buffer, program.strings.size());
+        for (const auto & text : program.strings) {
+            ScriptCache::put_string(buffer, text);
+        }
+        ScriptCache::put_u32(buffer, templates.size());
+        for (const auto & segments : templates) {
+            ScriptCache::put_u32(buffer, segments.size());
+            for (const auto & segment : segments) {
+                ScriptCache::put_u32(buffer, static_cast<std::uint32_t>(segment.type));
+                ScriptCache::put_u32(buffer, segment.index);
+                ScriptCache::put_string(buffer, segment.text);
+            }
+        }
+        ScriptCache::put_u32(buffer, code.size());
+        for (const auto & in : code) {
+            ScriptCache::put_u32(buffer, static_cast<std::uint32_t>(in.op));
+            ScriptCache::put_u32(buffer, in.a);
+            ScriptCache::put_u32(buffer, in.b);
+        }
+    }
+
+    static bool read_program(Reader & reader, VariableTable & variables, Program & program) {
+        std::uint32_t count = 0;
+        if (!reader.read_u32(count)) {
+            return false;
+        }
+        std::vector<std::uint32_t> slots(count);
+        for (auto & slot : slots) {
+            std::string name;
+            if (!reader.read_string(name)) {
+                return false;
+            }
+            slot = variables.slot(name);
+        }
+
+        if (!reader.read_u32(count)) {
+            return false;
+        }
+        program.strings.resize(count);
+        for (auto & text : program.strings) {
+            if (!reader.read_string(text)) {
+                return false;
+            }
+        }
+
+        if (!reader.read_u32(count)) {
+            return false;
+        }
+        program.templates.resize(count);
+        for (auto & segments : program.templates) {
+            if (!reader.read_u32(count)) {
+                return false;
+            }
+            segments.resize(count);
+            for (auto & segment : segments) {
+                std::uint32_t type = 0;
+                if (!reader.read_u32(type) || type > static_cast<std::uint32_t>(SegmentType::SEG_ARITH) ||
+                    !reader.read_u32(segment.index) || !reader.read_string(segment.text)) {
+                    return false;
+                }
+                segment.type = static_cast<SegmentType>(type);
+                if (segment.type == SegmentType::SEG_SLOT) {
+                    if (segment.index >= slots.size()) {
+                        return false;
+                    }
+                    segment.index = slots[segment.index];
+                }
+            }
+        }
+
+        if (!reader.read_u32(count)) {
+            return false;
+        }
+        program.code.resize(count);
+        for (auto & in : program.code) {
+            std::uint32_t op = 0;
+            if (!reader.read_u32(op) || op > static_cast<std::uint32_t>(OpCode::OP_HALT) || !reader.read_u32(in.a) ||
+                !reader.read_u32(in.b)) {
+                return false;
+            }
+            in.op = static_cast<OpCode>(op);
+            if (ScriptCache::has_slot(in)) {
+                if (in.a >= slots.size()) {
+                    return false;
+                }
+                in.a = slots[in.a];
+            }
+        }
+        return reader.pos == reader.size && ScriptCache::valid(program);
+    }
+
+    // a damaged entry must not send the VM out of the program
+    static bool valid(const Program & program) {
+        if (program.code.empty() || program.code.back().op != OpCode::OP_HALT) {
+            return false;
+        }
+        const auto tpl = [&](std::uint32_t index) { return index < program.templates.size(); };
+        const auto pc  = [&](std::uint32_t target) { return target < program.code.size(); };
+        for (const auto & in : program.code) {
+            bool ok = true;
+            switch (in.op) {
+                case OpCode::OP_RUN:
+                case OpCode::OP_FOR_INIT:
+                case OpCode::OP_CASE_PUSH:
+                    ok = tpl(in.a);
+                    break;
+                case OpCode::OP_BUILTIN:
+                    ok = in.a < VM::builtin_count() && tpl(in.b);
+                    break;
+                case OpCode::OP_CALL:
+                    ok = in.a < program.strings.size() && tpl(in.b);
+                    break;
+                case OpCode::OP_ASSIGN:
+                    ok = tpl(in.b);
+                    break;
+                case OpCode::OP_JUMP:
+                case OpCode::OP_JUMP_IF_FAIL:
+                case OpCode::OP_JUMP_IF_OK:
+                case OpCode::OP_FOR_NEXT:
+                    ok = pc(in.b);
+                    break;
+                case OpCode::OP_CASE_TEST:
+                    ok = tpl(in.a) && pc(in.b);
+                    break;
+                case OpCode::OP_DEFINE:
+                    ok = in.a < program.strings.size() && pc(in.b);
+                    break;
+                case OpCode::OP_RETURN:
+                case OpCode::OP_EXIT:
+                    ok = in.a == NO_TEMPLATE || tpl(in.a);
+                    break;
+                default:
+                    break;
+            }
+            if (!ok) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+}  // namespace vm
+
+#endif  // SCRIPT_CACHE_HPP
@@ -0,0 +1,1271 @@
+#ifndef SCRIPT_VM_HPP
+#define SCRIPT_VM_HPP
+
+#include <fnmatch.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "Parser.hpp"
+
+/**
+ * The parsed script is compiled into a flat bytecode, the VM runs it with a program counter and a few stacks
+ * instead of walking the AST. The words are split into literal and variable segments at compile time, so a
+ * loop iteration only concatenates strings, variables assigned by scripts live in slots which are resolved
+ * when the script is compiled.
+ */
+namespace vm {
+
+enum class OpCode : std::uint8_t {
+    // run a command line through the shell: a = template, b = RUN_* flags
+    OP_RUN,
+    // call a VM builtin: a = builtin index, b = template of the arguments
+    OP_BUILTIN,
+    // call a shell function: a = string (name), b = template of the arguments
+    OP_CALL,
+    // a = slot, b = template of the value
+    OP_ASSIGN,
+    OP_JUMP,
+    OP_JUMP_IF_FAIL,
+    OP_JUMP_IF_OK,
+    // invert the status of the last command
+    OP_NOT,
+    // set the status: a = value
+    OP_STATUS,
+    // expand the word list of a for loop (b = 0: the positional parameters) and push it: a = template
+    OP_FOR_INIT,
+    // assign the next word to slot a or pop the loop and jump to b
+    OP_FOR_NEXT,
+    OP_FOR_POP,
+    // push the expanded case word: a = template
+    OP_CASE_PUSH,
+    // jump to b when the case word matches the pattern template a
+    OP_CASE_TEST,
+    OP_CASE_POP,
+    // define function: a = string (name), b = entry
+    OP_DEFINE,
+    // return from a function: a = template of the status (or NO_TEMPLATE)
+    OP_RETURN,
+    // exit the shell: a = template of the status (or NO_TEMPLATE)
+    OP_EXIT,
+    OP_HALT,
+};
+
+static constexpr std::uint32_t NO_TEMPLATE = UINT32_MAX;
+static constexpr std::uint32_t RUN_BACKGROUND = 1;
+// a single command without pipes and redirections, it may be a function defined by another program
+static constexpr std::uint32_t RUN_PLAIN      = 2;
+
+struct Instruction {
+    OpCode        op;
+    std::uint32_t a = 0;
+    std::uint32_t b = 0;
+};
+
+enum class SegmentType : std::uint8_t {
+    SEG_LITERAL,
+    // ${NAME}, $NAME; text is the fallback of ${NAME:-fallback}
+    SEG_SLOT,
+    // $0..$9, ${10}
+    SEG_POSITIONAL,
+    // $#
+    SEG_ARGC,
+    // $@, $*
+    SEG_ALL,
+    // $?
+    SEG_STATUS,
+    // $((expression))
+    SEG_ARITH,
+};
+
+struct Segment {
+    SegmentType   type = SegmentType::SEG_LITERAL;
+    std::string   text;
+    std::uint32_t index = 0;
+};
+
+using Template = std::vector<Segment>;
+
+struct Program {
+    std::vector<Instruction> code;
+    std::vector<Template>    templates;
+    std::vector<std::string> strings;
+};
+
+/**
+ * Script variables. The slot of a name is fixed for the life of the shell, so programs compiled for
+ * different lines (interactive mode) and functions share them. An unset slot falls back to the shell
+ * variables and the environment.
+ */
+class VariableTable {
+  public:
+    std::uint32_t slot(const std::string & name) {
+        const auto it = index_.find(name);
+        if (it != index_.end()) {
+            return it->second;
+        }
+        names_.push_back(name);
+        values_.emplace_back();
+        index_[name] = names_.size() - 1;
+        return names_.size() - 1;
+    }
+
+    const std::string & name(std::uint32_t slot) const { return names_[slot]; }
+
+    std::optional<std::string> & value(std::uint32_t slot) { return values_[slot]; }
+
+    const std::optional<std::string> * find(const std::string & name) const {
+        const auto it = index_.find(name);
+        return it == index_.end() ? nullptr : &values_[it->second];
+    }
+
+  private:
+    std::vector<std::string>                       names_;
+    std::vector<std::optional<std::string>>        values_;
+    std::unordered_map<std::string, std::uint32_t> index_;
+};
+
+class VM;
+
+// builtins which only touch the state of the VM, they are dispatched by their index in the table
+using Builtin = int (*)(VM &, const std::vector<std::string> &);
+
+class Compiler {
+  public:
+    Compiler(VariableTable & variables, Program & program,
+             const std::function<int(std::string_view)> & builtin_index) :
+        variables_(variables),
+        program_(program),
+        builtin_index_(builtin_index) {}
+
+    bool compile(const parser::List & list, std::string & error) {
+        this->collect_functions(list);
+        if (!this->compile_list(list, error)) {
+            return false;
+        }
+        this->emit(OpCode::OP_HALT);
+        return true;
+    }
+
+    // splits a word or command line into literal and variable segments, quotes are kept unless strip_quotes
+    Template make_template(std::string_view text, bool strip_quotes = false) {
+        Template    result;
+        std::string literal;
+        char        quote = 0;
+
+        const auto flush = [&]() {
+            if (!literal.empty()) {
+                result.push_back({ SegmentType::SEG_LITERAL, std::move(literal), 0 });
+                literal.clear();
+            }
+        };
+
+        for (size_t i = 0; i < text.size(); ++i) {
+            const char c = text[i];
+            if (quote == '\'') {
+                if (c == '\'') {
+                    quote = 0;
+                    if (strip_quotes) {
+                        continue;
+                    }
+                }
+                literal += c;
+                continue;
+            }
+            if (c == '\\' && i + 1 < text.size()) {
+                if (!strip_quotes) {
+                    literal += c;
+                }
+                literal += text[++i];
+                continue;
+            }
+            if (c == '\'' || c == '"') {
+                if (quote == 0 && c == '\'') {
+                    quote = c;
+                } else if (quote == 0) {
+                    quote = c;
+                } else if (quote == c) {
+                    quote = 0;
+                } else {
+                    literal += c;
+                    continue;
+                }
+                if (!strip_quotes) {
+                    literal += c;
+                }
+                continue;
+            }
+            if (c != '$' || i + 1 >= text.size()) {
+                literal += c;
+                continue;
+            }
+
+            const char next = text[i + 1];
+            Segment    segment;
+            size_t     end = i + 1;
+            if (next == '(' && i + 2 < text.size() && text[i + 2] == '(') {
+                // $((expression))
+                const size_t close = text.find("))", i + 3);
+                if (close == std::string_view::npos) {
+                    literal += c;
+                    continue;
+                }
+                segment = { SegmentType::SEG_ARITH, std::string(text.substr(i + 3, close - i - 3)), 0 };
+                end     = close + 2;
+            } else if (next == '{') {
+                const size_t close = text.find('}', i + 2);
+                if (close == std::string_view::npos) {
+                    literal += c;
+                    continue;
+                }
+                std::string_view inner = text.substr(i + 2, close - i - 2);
+                std::string      fallback;
+                const size_t     sep = inner.find(":-");
+                if (sep != std::string_view::npos) {
+                    fallback = std::string(inner.substr(sep + 2));
+                    inner    = inner.substr(0, sep);
+                }
+                if (inner.size() == 1 && Compiler::is_special(inner[0])) {
+                    // ${?}, ${#}, ${@} are $?, $#, $@
+                    segment = Compiler::special_segment(inner[0], quote == '"' && !strip_quotes);
+                } else if (Compiler::is_name(inner) || Compiler::is_number(inner)) {
+                    segment = this->variable_segment(inner, fallback);
+                } else {
+                    literal += c;
+                    continue;
+                }
+                end = close + 1;
+            } else if (std::isdigit(static_cast<unsigned char>(next))) {
+                segment = { SegmentType::SEG_POSITIONAL, "", static_cast<std::uint32_t>(next - '0') };
+                end     = i + 2;
+            } else if (Compiler::is_special(next)) {
+                segment = Compiler::special_segment(next, quote == '"' && !strip_quotes);
+                end     = i + 2;
+            } else if (std::isalpha(static_cast<unsigned char>(next)) || next == '_') {
+                size_t name_end = i + 1;
+                while (name_end < text.size() &&
+                       (std::isalnum(static_cast<unsigned char>(text[name_end])) || text[name_end] == '_')) {
+                    ++name_end;
+                }
+                segment = this->variable_segment(text.substr(i + 1, name_end - i - 1), "");
+                end     = name_end;
+            } else {
+                literal += c;
+                continue;
+            }
+            flush();
+            result.push_back(std::move(segment));
+            i = end - 1;
+        }
+        flush();
+        return result;
+    }
+
+    static bool is_name(std::string_view text) {
+        if (text.empty() || std::isdigit(static_cast<unsigned char>(text[0]))) {
+            return false;
+        }
+        for (const char c : text) {
+            if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_') {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool is_number(std::string_view text) {
+        if (text.empty()) {
+            return false;
+        }
+        for (const char c : text) {
+            if (!std::isdigit(static_cast<unsigned char>(c))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+  private:
+    struct Loop {
+        bool                       is_for = false;
+        std::uint32_t              continue_target;
+        std::vector<std::uint32_t> break_jumps;
+    };
+
+    VariableTable &                              variables_;
+    Program &                                    program_;
+    const std::function<int(std::string_view)> & builtin_index_;
+    std::vector<Loop>                            loops_;
+    std::unordered_set<std::string>              functions_;
+    bool                                         in_function_ = false;
+
+    static bool is_special(char name) { return name == '#' || name == '@' || name == '*' || name == '?'; }
+
+    // $#, $?, $@ and $*; "$@" in double quotes is one word per argument
+    static Segment special_segment(char name, bool in_double_quotes) {
+        Segment segment;
+        segment.type  = name == '#' ? SegmentType::SEG_ARGC :
+                        name == '?' ? SegmentType::SEG_STATUS :
+                                      SegmentType::SEG_ALL;
+        segment.index = name == '@' && in_double_quotes ? 1 : 0;
+        return segment;
+    }
+
+    Segment variable_segment(std::string_view name, const std::string & fallback) {
+        if (Compiler::is_number(name)) {
+            return { SegmentType::SEG_POSITIONAL, fallback, static_cast<std::uint32_t>(std::stoul(std::string(name))) };
+        }
+        return { SegmentType::SEG_SLOT, fallback, variables_.slot(std::string(name)) };
+    }
+
+    std::uint32_t emit(OpCode op, std::uint32_t a = 0, std::uint32_t b = 0) {
+        program_.code.push_back({ op, a, b });
+        return program_.code.size() - 1;
+    }
+
+    std::uint32_t here() const { return program_.code.size(); }
+
+    void patch(std::uint32_t instruction, std::uint32_t target) { program_.code[instruction].b = target; }
+
+    std::uint32_t add_template(std::string_view text, bool strip_quotes = false) {
+        program_.templates.push_back(this->make_template(text, strip_quotes));
+        return program_.templates.size() - 1;
+    }
+
+    std::uint32_t add_string(const std::string & text) {
+        program_.strings.push_back(text);
+        return program_.strings.size() - 1;
+    }
+
+    // the functions of the program are known before the calls are compiled, so a call can be emitted for them,
+    // the ones defined by other programs (an earlier line, a sourced file) are looked up when the command runs
+    void collect_functions(const parser::List & list) {
+        for (const auto & and_or : list.items) {
+            for (const auto & command : and_or.commands) {
+                if (command.type == parser::CommandType::CMD_FUNCTION) {
+                    functions_.insert(command.text);
+                }
+                for (const auto & body : command.bodies) {
+                    this->collect_functions(body);
+                }
+            }
+        }
+    }
+
+    bool compile_list(const parser::List & list, std::string & error) {
+        for (const auto & and_or : list.items) {
+            if (!this->compile_and_or(and_or, error)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * a && b || c: when a fails the jump skips to the command after the next ||, when a succeeds the || jumps
+     * skip to the command after the next &&.
+     */
+    bool compile_and_or(const parser::AndOr & and_or, std::string & error) {
+        std::vector<std::pair<std::uint32_t, parser::TokenType>> pending;
+
+        for (size_t i = 0; i < and_or.commands.size(); ++i) {
+            if (i > 0) {
+                const auto op = and_or.ops[i - 1];
+                for (auto it = pending.begin(); it != pending.end();) {
+                    if (it->second != op) {
+                        this->patch(it->first, this->here());
+                        it = pending.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+            // only the last command of a background list is sent to the background
+            const bool background = and_or.background && i + 1 == and_or.commands.size();
+            if (!this->compile_command(and_or.commands[i], background, error)) {
+                return false;
+            }
+            if (i + 1 < and_or.commands.size()) {
+                const auto op = and_or.ops[i];
+                pending.emplace_back(
+                    this->emit(op == parser::TokenType::TK_AND_IF ? OpCode::OP_JUMP_IF_FAIL : OpCode::OP_JUMP_IF_OK),
+                    op);
+            }
+        }
+        for (const auto & jump : pending) {
+            this->patch(jump.first, this->here());
+        }
+        return true;
+    }
+
+    bool compile_command(const parser::Command & command, bool background, std::string & error) {
+        bool compiled = false;
+        switch (command.type) {
+            case parser::CommandType::CMD_SIMPLE:
+                compiled = this->compile_simple(command, background, error);
+                break;
+            case parser::CommandType::CMD_IF:
+                compiled = this->compile_if(command, error);
+                break;
+            case parser::CommandType::CMD_WHILE:
+            case parser::CommandType::CMD_UNTIL:
+                compiled = this->compile_while(command, error);
+                break;
+            case parser::CommandType::CMD_FOR:
+                compiled = this->compile_for(command, error);
+                break;
+            case parser::CommandType::CMD_CASE:
+                compiled = this->compile_case(command, error);
+                break;
+            case parser::CommandType::CMD_GROUP:
+                compiled = this->compile_list(command.bodies[0], error);
+                break;
+            case parser::CommandType::CMD_FUNCTION:
+                compiled = this->compile_function(command, error);
+                break;
+        }
+        if (compiled && command.negate) {
+            this->emit(OpCode::OP_NOT);
+        }
+        return compiled;
+    }
+
+    static bool is_assignment(const std::string & word) {
+        const size_t eq = word.find('=');
+        return eq != std::string::npos && eq > 0 && Compiler::is_name(std::string_view(word).substr(0, eq));
+    }
+
+    // the arguments after the first word, in source form
+    static std::string arguments_of(const std::vector<std::string> & words) {
+        std::string args;
+        for (size_t i = 1; i < words.size(); ++i) {
+            args += (i > 1 ? " " : "") + words[i];
+        }
+        return args;
+    }
+
+    bool compile_simple(const parser::Command & command, bool background, std::string & error) {
+        const auto &      words = command.words;
+        const std::string first = words.front();
+        const bool        single_stage =
+            std::find(words.begin(), words.end(), "|") == words.end() && !background &&
+            std::none_of(words.begin(), words.end(), [](const std::string & word) {
+                return word.find('>') != std::string::npos || word.find('<') != std::string::npos;
+            });
+
+        // NAME=value... without a command
+        if (single_stage && std::all_of(words.begin(), words.end(), Compiler::is_assignment)) {
+            for (const auto & word : words) {
+                const size_t eq = word.find('=');
+                this->emit(OpCode::OP_ASSIGN, variables_.slot(word.substr(0, eq)),
+                           this->add_template(std::string_view(word).substr(eq + 1), true));
+            }
+            this->emit(OpCode::OP_STATUS, 0);
+            return true;
+        }
+
+        if (single_stage && (first == "break" || first == "continue")) {
+            return this->compile_loop_jump(command, first == "break", error);
+        }
+        if (single_stage && (first == "return" || first == "exit")) {
+            const std::uint32_t status =
+                words.size() > 1 ? this->add_template(Compiler::arguments_of(words)) : NO_TEMPLATE;
+            this->emit(first == "return" && in_function_ ? OpCode::OP_RETURN : OpCode::OP_EXIT, status);
+            return true;
+        }
+        if (single_stage && functions_.contains(first)) {
+            this->emit(OpCode::OP_CALL, this->add_string(first), this->add_template(Compiler::arguments_of(words)));
+            return true;
+        }
+        const int builtin = builtin_index_(first);
+        if (single_stage && builtin >= 0) {
+            this->emit(OpCode::OP_BUILTIN, builtin, this->add_template(Compiler::arguments_of(words)));
+            return true;
+        }
+        this->emit(OpCode::OP_RUN, this->add_template(command.text),
+                   background ? RUN_BACKGROUND : (single_stage ? RUN_PLAIN : 0));
+        return true;
+    }
+
+    bool compile_loop_jump(const parser::Command & command, bool is_break, std::string & error) {
+        size_t levels = 1;
+        if (command.words.size() > 1) {
+            if (!Compiler::is_number(command.words[1]) || command.words[1] == "0") {
+                error = "line " + std::to_string(command.line) + ": " + command.words[0] + ": " + command.words[1] +
+                        ": loop count out of range";
+                return false;
+            }
+            levels = std::stoul(command.words[1]);
+        }
+        if (loops_.empty()) {
+            // like bash, outside of a loop it does nothing
+            this->emit(OpCode::OP_STATUS, 0);
+            return true;
+        }
+        levels = std::min(levels, loops_.size());
+
+        // leaving a for loop drops its word list
+        const size_t target = loops_.size() - levels;
+        for (size_t i = loops_.size() - 1; i > target; --i) {
+            if (loops_[i].is_for) {
+                this->emit(OpCode::OP_FOR_POP);
+            }
+        }
+        if (is_break) {
+            if (loops_[target].is_for) {
+                this->emit(OpCode::OP_FOR_POP);
+            }
+            loops_[target].break_jumps.push_back(this->emit(OpCode::OP_JUMP));
+        } else {
+            this->emit(OpCode::OP_JUMP, 0, loops_[target].continue_target);
+        }
+        return true;
+    }
+
+    bool compile_if(const parser::Command & command, std::string & error) {
+        std::vector<std::uint32_t> end_jumps;
+        const size_t               branches = command.bodies.size() / 2;
+
+        for (size_t i = 0; i < branches; ++i) {
+            if (!this->compile_list(command.bodies[i * 2], error)) {
+                return false;
+            }
+            const std::uint32_t next = this->emit(OpCode::OP_JUMP_IF_FAIL);
+            if (!this->compile_list(command.bodies[i * 2 + 1], error)) {
+                return false;
+            }
+            end_jumps.push_back(this->emit(OpCode::OP_JUMP));
+            this->patch(next, this->here());
+        }
+        if (command.bodies.size() % 2 == 1) {
+            if (!this->compile_list(command.bodies.back(), error)) {
+                return false;
+            }
+        } else {
+            // no branch was taken
+            this->emit(OpCode::OP_STATUS, 0);
+        }
+        for (const auto jump : end_jumps) {
+            this->patch(jump, this->here());
+        }
+        return true;
+    }
+
+    bool compile_while(const parser::Command & command, std::string & error) {
+        const std::uint32_t top = this->here();
+        if (!this->compile_list(command.bodies[0], error)) {
+            return false;
+        }
+        const std::uint32_t exit_jump = this->emit(
+            command.type == parser::CommandType::CMD_WHILE ? OpCode::OP_JUMP_IF_FAIL : OpCode::OP_JUMP_IF_OK);
+
+        loops_.push_back({ false, top, {} });
+        if (!this->compile_list(command.bodies[1], error)) {
+            return false;
+        }
+        this->emit(OpCode::OP_JUMP, 0, top);
+        this->patch(exit_jump, this->here());
+        for (const auto jump : loops_.back().break_jumps) {
+            this->patch(jump, this->here());
+        }
+        loops_.pop_back();
+        this->emit(OpCode::OP_STATUS, 0);
+        return true;
+    }
+
+    bool compile_for(const parser::Command & command, std::string & error) {
+        if (!Compiler::is_name(command.text)) {
+            error = "line " + std::to_string(command.line) + ": `" + command.text + "': not a valid identifier";
+            return false;
+        }
+        std::string words;
+        for (const auto & word : command.words) {
+            words += (words.empty() ? "" : " ") + word;
+        }
+        this->emit(OpCode::OP_FOR_INIT, this->add_template(words), command.has_in ? 1 : 0);
+
+        const std::uint32_t top  = this->here();
+        const std::uint32_t next = this->emit(OpCode::OP_FOR_NEXT, variables_.slot(command.text));
+
+        loops_.push_back({ true, top, {} });
+        if (!this->compile_list(command.bodies[0], error)) {
+            return false;
+        }
+        this->emit(OpCode::OP_JUMP, 0, top);
+        this->patch(next, this->here());
+        for (const auto jump : loops_.back().break_jumps) {
+            this->patch(jump, this->here());
+        }
+        loops_.pop_back();
+        this->emit(OpCode::OP_STATUS, 0);
+        return true;
+    }
+
+    bool compile_case(const parser::Command & command, std::string & error) {
+        this->emit(OpCode::OP_CASE_PUSH, this->add_template(command.text, true));
+
+        std::vector<std::vector<std::uint32_t>> tests(command.patterns.size());
+        for (size_t i = 0; i < command.patterns.size(); ++i) {
+            for (const auto & pattern : command.patterns[i]) {
+                tests[i].push_back(this->emit(OpCode::OP_CASE_TEST, this->add_template(pattern, true)));
+            }
+        }
+        // nothing matched
+        this->emit(OpCode::OP_CASE_POP);
+        this->emit(OpCode::OP_STATUS, 0);
+        std::vector<std::uint32_t> end_jumps = { this->emit(OpCode::OP_JUMP) };
+
+        for (size_t i = 0; i < command.bodies.size(); ++i) {
+            for (const auto test : tests[i]) {
+                this->patch(test, this->here());
+            }
+            this->emit(OpCode::OP_CASE_POP);
+            if (!this->compile_list(command.bodies[i], error)) {
+                return false;
+            }
+            end_jumps.push_back(this->emit(OpCode::OP_JUMP));
+        }
+        for (const auto jump : end_jumps) {
+            this->patch(jump, this->here());
+        }
+        return true;
+    }
+
+    bool compile_function(const parser::Command & command, std::string & error) {
+        const std::uint32_t define = this->emit(OpCode::OP_DEFINE, this->add_string(command.text));
+
+        // the body is skipped when the definition runs
+        const std::uint32_t skip          = this->emit(OpCode::OP_JUMP);
+        auto                outer_loops   = std::move(loops_);
+        const bool          outer_in_func = in_function_;
+        loops_.clear();
+        in_function_ = true;
+
+        this->patch(define, this->here());
+        const bool compiled = this->compile_list(command.bodies[0], error);
+        this->emit(OpCode::OP_RETURN, NO_TEMPLATE);
+
+        loops_       = std::move(outer_loops);
+        in_function_ = outer_in_func;
+        this->patch(skip, this->here());
+        this->emit(OpCode::OP_STATUS, 0);
+        return compiled;
+    }
+};
+
+// $((...)) evaluator: integers, + - * / % ( ), comparisons, && || ! and variable names
+class Arithmetic {
+  public:
+    Arithmetic(std::string_view text, const std::function<std::string(const std::string &)> & lookup) :
+        text_(text),
+        lookup_(lookup) {}
+
+    bool evaluate(long long & result, std::string & error) {
+        result = this->parse_or();
+        this->skip_blanks();
+        if (error_.empty() && pos_ < text_.size()) {
+            error_ = "syntax error in expression (error token is \"" + std::string(text_.substr(pos_)) + "\")";
+        }
+        error = error_;
+        return error_.empty();
+    }
+
+  private:
+    std::string_view                                        text_;
+    const std::function<std::string(const std::string &)> & lookup_;
+    size_t                                                  pos_ = 0;
+    std::string                                             error_;
+
+    void skip_blanks() {
+        while (pos_ < text_.size() && std::isspace(static_cast<unsigned char>(text_[pos_]))) {
+            ++pos_;
+        }
+    }
+
+    bool accept(std::string_view op) {
+        this->skip_blanks();
+        if (text_.substr(pos_, op.size()) == op) {
+            pos_ += op.size();
+            return true;
+        }
+        return false;
+    }
+
+    long long parse_or() {
+        long long value = this->parse_and();
+        while (this->accept("||")) {
+            const long long rhs = this->parse_and();
+            value               = (value != 0 || rhs != 0) ? 1 : 0;
+        }
+        return value;
+    }
+
+    long long parse_and() {
+        long long value = this->parse_compare();
+        while (this->accept("&&")) {
+            const long long rhs = this->parse_compare();
+            value               = (value != 0 && rhs != 0) ? 1 : 0;
+        }
+        return value;
+    }
+
+    long long parse_compare() {
+        long long value = this->parse_sum();
+        while (true) {
+            if (this->accept("==")) {
+                value = value == this->parse_sum();
+            } else if (this->accept("!=")) {
+                value = value != this->parse_sum();
+            } else if (this->accept("<=")) {
+                value = value <= this->parse_sum();
+            } else if (this->accept(">=")) {
+                value = value >= this->parse_sum();
+            } else if (this->accept("<")) {
+                value = value < this->parse_sum();
+            } else if (this->accept(">")) {
+                value = value > this->parse_sum();
+            } else {
+                return value;
+            }
+        }
+    }
+
+    long long parse_sum() {
+        long long value = this->parse_product();
+        while (true) {
+            if (this->accept("+")) {
+                value += this->parse_product();
+            } else if (this->accept("-")) {
+                value -= this->parse_product();
+            } else {
+                return value;
+            }
+        }
+    }
+
+    long long parse_product() {
+        long long value = this->parse_unary();
+        while (true) {
+            const bool multiply = this->accept("*");
+            const bool divide   = !multiply && this->accept("/");
+            const bool modulo   = !multiply && !divide && this->accept("%");
+            if (!multiply && !divide && !modulo) {
+                return value;
+            }
+            const long long rhs = this->parse_unary();
+            if (multiply) {
+                value *= rhs;
+            } else if (rhs == 0) {
+                error_ = "division by 0";
+                return 0;
+            } else {
+                value = divide ? value / rhs : value % rhs;
+            }
+        }
+    }
+
+    long long parse_unary() {
+        if (this->accept("-")) {
+            return -this->parse_unary();
+        }
+        if (this->accept("+")) {
+            return this->parse_unary();
+        }
+        if (this->accept("!")) {
+            return this->parse_unary() == 0 ? 1 : 0;
+        }
+        return this->parse_primary();
+    }
+
+    long long parse_primary() {
+        if (this->accept("(")) {
+            const long long value = this->parse_or();
+            if (!this->accept(")")) {
+                error_ = "missing `)'";
+            }
+            return value;
+        }
+        this->skip_blanks();
+        this->accept("$");
+        const size_t start = pos_;
+        if (pos_ < text_.size() && std::isdigit(static_cast<unsigned char>(text_[pos_]))) {
+            while (pos_ < text_.size() && std::isdigit(static_cast<unsigned char>(text_[pos_]))) {
+                ++pos_;
+            }
+            return std::stoll(std::string(text_.substr(start, pos_ - start)));
+        }
+        while (pos_ < text_.size() && (std::isalnum(static_cast<unsigned char>(text_[pos_])) || text_[pos_] == '_')) {
+            ++pos_;
+        }
+        if (pos_ == start) {
+            if (error_.empty()) {
+                error_ = "syntax error: operand expected";
+            }
+            return 0;
+        }
+        // an unset or non numeric variable is 0
+        const std::string value = lookup_(std::string(text_.substr(start, pos_ - start)));
+        try {
+            return value.empty() ? 0 : std::stoll(value);
+        } catch (const std::exception &) {
+            return 0;
+        }
+    }
+};
+
+class VM {
+  public:
+    // runs a command line through the shell, replace_shell is set for the very last command of a batch
+    std::function<int(const std::string &, bool background, bool replace_shell)> run_command = nullptr;
+    // shell variables and the environment, used for the names not assigned by a script
+    std::function<std::optional<std::string>(const std::string &)> lookup_variable = nullptr;
+    // called after a script assigned a variable
+    std::function<void(const std::string &, const std::string &)> on_assign = nullptr;
+    // splits an expanded word list into arguments (quotes, globs)
+    std::function<std::vector<std::string>(const std::string &)> split_words = nullptr;
+
+    bool exit_requested = false;
+    int  status         = 0;
+    // the last command of a batch may replace the shell process
+    bool exec_last      = false;
+
+    static size_t builtin_count() { return VM::builtins().size(); }
+
+    static int builtin_index(std::string_view name) {
+        for (size_t i = 0; i < VM::builtins().size(); ++i) {
+            if (VM::builtins()[i].first == name) {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+    bool compile(const parser::List & list, Program & program, std::string & error) {
+        static const std::function<int(std::string_view)> index = VM::builtin_index;
+        Compiler                                           compiler(variables_, program, index);
+        return compiler.compile(list, error);
+    }
+
+    // positional parameters of the top level: $0 and $1...
+    void set_arguments(const std::string & name, const std::vector<std::string> & params) {
+        name_      = name;
+        arguments_ = params;
+    }
+
+    // a nested run (source) sees the positional parameters of the caller
+    int run(const std::shared_ptr<const Program> & program) {
+        return this->run(program, frames_.empty() ? arguments_ : frames_.back().arguments);
+    }
+
+    int run(const std::shared_ptr<const Program> & program, std::vector<std::string> arguments) {
+        frames_.push_back({ program, 0, std::move(arguments), for_stack_.size(), case_stack_.size(), true });
+        this->execute();
+        return status;
+    }
+
+    VariableTable & variables() { return variables_; }
+
+  private:
+    struct Frame {
+        std::shared_ptr<const Program> program;
+        std::uint32_t                  return_pc;
+        std::vector<std::string>       arguments;
+        size_t                         for_depth;
+        size_t                         case_depth;
+        // the frame of a whole program, not of a function call
+        bool                           top_level;
+    };
+
+    struct ForLoop {
+        std::vector<std::string> words;
+        size_t                   next = 0;
+    };
+
+    struct Function {
+        std::shared_ptr<const Program> program;
+        std::uint32_t                  entry;
+    };
+
+    VariableTable                             variables_;
+    std::vector<Frame>                        frames_;
+    std::vector<ForLoop>                      for_stack_;
+    std::vector<std::string>                  case_stack_;
+    std::unordered_map<std::string, Function> functions_;
+    std::string                               name_;
+    std::vector<std::string>                  arguments_;
+
+    static const std::vector<std::pair<std::string_view, Builtin>> & builtins() {
+        static const std::vector<std::pair<std::string_view, Builtin>> table = {
+            { ":",     [](VM &, const std::vector<std::string> &) { return 0; } },
+            { "true",  [](VM &, const std::vector<std::string> &) { return 0; } },
+            { "false", [](VM &, const std::vector<std::string> &) { return 1; } },
+            { "test",  VM::test                                                 },
+            { "[",     VM::test                                                 },
+            { "shift", VM::shift                                                },
+        };
+        return table;
+    }
+
+    std::string variable(std::uint32_t slot) {
+        const auto & value = variables_.value(slot);
+        if (value.has_value()) {
+            return *value;
+        }
+        return lookup_variable(variables_.name(slot)).value_or("");
+    }
+
+    std::string variable(const std::string & name) {
+        const auto * value = variables_.find(name);
+        if (value != nullptr && value->has_value()) {
+            return **value;
+        }
+        return lookup_variable(name).value_or("");
+    }
+
+    std::string expand(const Template & segments) {
+        const auto & arguments = frames_.back().arguments;
+        std::string  result;
+        for (const auto & segment : segments) {
+            switch (segment.type) {
+                case SegmentType::SEG_LITERAL:
+                    result += segment.text;
+                    break;
+                case SegmentType::SEG_SLOT:
+                    {
+                        const std::string value = this->variable(segment.index);
+                        result += value.empty() ? segment.text : value;
+                    }
+                    break;
+                case SegmentType::SEG_POSITIONAL:
+                    if (segment.index == 0) {
+                        result += name_;
+                    } else if (segment.index <= arguments.size()) {
+                        result += arguments[segment.index - 1];
+                    } else {
+                        result += segment.text;
+                    }
+                    break;
+                case SegmentType::SEG_ARGC:
+                    result += std::to_string(arguments.size());
+                    break;
+                case SegmentType::SEG_ALL:
+                    // inside "$@" the quote is closed and opened again between the arguments
+                    for (size_t i = 0; i < arguments.size(); ++i) {
+                        result += (i > 0 ? (segment.index == 1 ? "\" \"" : " ") : "") + arguments[i];
+                    }
+                    break;
+                case SegmentType::SEG_STATUS:
+                    result += std::to_string(status);
+                    break;
+                case SegmentType::SEG_ARITH:
+                    {
+                        long long                                              value = 0;
+                        std::string                                            error;
+                        const std::function<std::string(const std::string &)> lookup =
+                            [this](const std::string & name) { return this->variable(name); };
+                        // variables inside the expression may be written as $NAME too
+                        Arithmetic arithmetic(segment.text, lookup);
+                        if (!arithmetic.evaluate(value, error)) {
+                            std::cerr << segment.text << ": " << error << "\n";
+                        }
+                        result += std::to_string(value);
+                    }
+                    break;
+            }
+        }
+        return result;
+    }
+
+    std::vector<std::string> expand_words(const Template & segments) { return split_words(this->expand(segments)); }
+
+    int exit_status(std::uint32_t template_index) {
+        if (template_index == NO_TEMPLATE) {
+            return status;
+        }
+        const std::string value = this->expand(frames_.back().program->templates[template_index]);
+        try {
+            return std::stoi(value) & 0xff;
+        } catch (const std::exception &) {
+            std::cerr << value << ": numeric argument required\n";
+            return 2;
+        }
+    }
+
+    bool call_function(const std::string & name, const std::string & command, std::uint32_t & pc) {
+        const auto function = functions_.find(name);
+        if (function == functions_.end()) {
+            return false;
+        }
+        auto args = split_words(command);
+        args.erase(args.begin());
+        frames_.push_back(
+            { function->second.program, pc, std::move(args), for_stack_.size(), case_stack_.size(), false });
+        pc = function->second.entry;
+        return true;
+    }
+
+    // leave the current frame, returns false when it was the frame of the program
+    bool pop_frame(std::uint32_t & pc) {
+        const Frame frame = std::move(frames_.back());
+        frames_.pop_back();
+        for_stack_.resize(frame.for_depth);
+        case_stack_.resize(frame.case_depth);
+        pc = frame.return_pc;
+        return !frame.top_level;
+    }
+
+    void execute() {
+        std::uint32_t pc = 0;
+        while (!frames_.empty()) {
+            const Program &     program = *frames_.back().program;
+            const Instruction & in      = program.code[pc++];
+
+            switch (in.op) {
+                case OpCode::OP_RUN:
+                    {
+                        std::string command = this->expand(program.templates[in.a]);
+                        if ((in.b & RUN_PLAIN) != 0 && !functions_.empty() &&
+                            this->call_function(command.substr(0, command.find_first_of(" \t")), command, pc)) {
+                            break;
+                        }
+                        // nothing runs after the very last command of a batch, the shell is replaced with it
+                        const bool replace = exec_last && frames_.size() == 1 && (in.b & RUN_BACKGROUND) == 0 &&
+                                             program.code[pc].op == OpCode::OP_HALT;
+                        status = run_command(command, (in.b & RUN_BACKGROUND) != 0, replace);
+                    }
+                    break;
+                case OpCode::OP_BUILTIN:
+                    status = VM::builtins()[in.a].second(*this, this->expand_words(program.templates[in.b]));
+                    break;
+                case OpCode::OP_CALL:
+                    {
+                        const auto & name     = program.strings[in.a];
+                        const auto   function = functions_.find(name);
+                        auto         args     = this->expand_words(program.templates[in.b]);
+                        if (function == functions_.end()) {
+                            // called before it was defined, it is looked up as a command
+                            std::string command = name;
+                            for (const auto & arg : args) {
+                                command += " " + arg;
+                            }
+                            status = run_command(command, false, false);
+                            break;
+                        }
+                        frames_.push_back({ function->second.program, pc, std::move(args), for_stack_.size(),
+                                            case_stack_.size(), false });
+                        pc = function->second.entry;
+                    }
+                    break;
+                case OpCode::OP_ASSIGN:
+                    {
+                        std::string value      = this->expand(program.templates[in.b]);
+                        variables_.value(in.a) = value;
+                        if (on_assign) {
+                            on_assign(variables_.name(in.a), value);
+                        }
+                    }
+                    break;
+                case OpCode::OP_JUMP:
+                    pc = in.b;
+                    break;
+                case OpCode::OP_JUMP_IF_FAIL:
+                    if (status != 0) {
+                        pc = in.b;
+                    }
+                    break;
+                case OpCode::OP_JUMP_IF_OK:
+                    if (status == 0) {
+                        pc = in.b;
+                    }
+                    break;
+                case OpCode::OP_NOT:
+                    status = status == 0 ? 1 : 0;
+                    break;
+                case OpCode::OP_STATUS:
+                    status = static_cast<int>(in.a);
+                    break;
+                case OpCode::OP_FOR_INIT:
+                    if (in.b == 0) {
+                        for_stack_.push_back({ frames_.back().arguments, 0 });
+                    } else {
+                        for_stack_.push_back({ this->expand_words(program.templates[in.a]), 0 });
+                    }
+                    break;
+                case OpCode::OP_FOR_NEXT:
+                    {
+                        auto & loop = for_stack_.back();
+                        if (loop.next >= loop.words.size()) {
+                            for_stack_.pop_back();
+                            pc = in.b;
+                            break;
+                        }
+                        variables_.value(in.a) = loop.words[loop.next++];
+                    }
+                    break;
+                case OpCode::OP_FOR_POP:
+                    for_stack_.pop_back();
+                    break;
+                case OpCode::OP_CASE_PUSH:
+                    case_stack_.push_back(this->expand(program.templates[in.a]));
+                    break;
+                case OpCode::OP_CASE_TEST:
+                    if (fnmatch(this->expand(program.templates[in.a]).c_str(), case_stack_.back().c_str(), 0) == 0) {
+                        pc = in.b;
+                    }
+                    break;
+                case OpCode::OP_CASE_POP:
+                    case_stack_.pop_back();
+                    break;
+                case OpCode::OP_DEFINE:
+                    functions_[program.strings[in.a]] = { frames_.back().program, in.b };
+                    status                             = 0;
+                    break;
+                case OpCode::OP_RETURN:
+                    status = this->exit_status(in.a);
+                    if (!this->pop_frame(pc)) {
+                        return;
+                    }
+                    break;
+                case OpCode::OP_EXIT:
+                    status         = this->exit_status(in.a);
+                    exit_requested = true;
+                    frames_.clear();
+                    for_stack_.clear();
+                    case_stack_.clear();
+                    return;
+                case OpCode::OP_HALT:
+                    this->pop_frame(pc);
+                    return;
+            }
+        }
+    }
+
+    static int shift(VM & vm, const std::vector<std::string> & args) {
+        auto & arguments = vm.frames_.back().arguments;
+        size_t count     = 1;
+        if (!args.empty()) {
+            try {
+                count = std::stoul(args[0]);
+            } catch (const std::exception &) {
+                std::cerr << "shift: " << args[0] << ": numeric argument required\n";
+                return 1;
+            }
+        }
+        if (count > arguments.size()) {
+            return 1;
+        }
+        arguments.erase(arguments.begin(), arguments.begin() + count);
+        return 0;
+    }
+
+    // test / [ with the usual string, integer and file operators
+    static int test(VM & /*vm*/, const std::vector<std::string> & input) {
+        std::vector<std::string> args = input;
+        if (!args.empty() && args.back() == "]") {
+            args.pop_back();
+        }
+        bool negate = false;
+        if (args.size() > 1 && args[0] == "!") {
+            negate = true;
+            args.erase(args.begin());
+        }
+        const auto result = [negate](bool value) { return (value != negate) ? 0 : 1; };
+
+        if (args.empty()) {
+            return result(false);
+        }
+        if (args.size() == 1) {
+            return result(!args[0].empty());
+        }
+        if (args.size() == 2) {
+            const std::string & op   = args[0];
+            const std::string & path = args[1];
+            struct stat         st {};
+
+            if (op == "-z") {
+                return result(path.empty());
+            }
+            if (op == "-n") {
+                return result(!path.empty());
+            }
+            const bool exists = stat(path.c_str(), &st) == 0;
+            if (op == "-e") {
+                return result(exists);
+            }
+            if (op == "-f") {
+                return result(exists && S_ISREG(st.st_mode));
+            }
+            if (op == "-d") {
+                return result(exists && S_ISDIR(st.st_mode));
+            }
+            if (op == "-s") {
+                return result(exists && st.st_size > 0);
+            }
+            if (op == "-r" || op == "-w" || op == "-x") {
+                const int mode = op == "-r" ? R_OK : op == "-w" ? W_OK : X_OK;
+                return result(access(path.c_str(), mode) == 0);
+            }
+            std::cerr << "test: " << op << ": unary operator expected\n";
+            return 2;
+        }
+        if (args.size() == 3) {
+            const std::string & lhs = args[0];
+            const std::string & op  = args[1];
+            const std::string & rhs = args[2];
+            if (op == "=" || op == "==") {
+                return result(lhs == rhs);
+            }
+            if (op == "!=") {
+                return result(lhs != rhs);
+            }
+            long long a = 0;
+            long long b = 0;
+            try {
+                a = std::stoll(lhs);
+                b = std::stoll(rhs);
+            } catch (const std::exception &) {
+                std::cerr << "test: integer expression expected\n";
+                return 2;
+            }
+            if (op == "-eq") {
+                return result(a == b);
+            }
+            if (op == "-ne") {
+                return result(a != b);
+            }
+            if (op == "-lt") {
+                return result(a < b);
+            }
+            if (op == "-le") {
+                return result(a <= b);
+            }
+            if (op == "-gt") {
+                return result(a > b);
+            }
+            if (op == "-ge") {
+                return result(a >= b);
+            }
+            std::cerr << "test: " << op << ": binary operator expected\n";
+            return 2;
+        }
+        std::cerr << "test: too many arguments\n";
+        return 2;
+    }
+};
+
+}  // namespace vm
+
+#endif  // SCRIPT_VM_HPP
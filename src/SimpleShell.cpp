@@ -1,5 +1,9 @@
 #include "SimpleShell.hpp"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <filesystem>
 #include <iostream>
 
@@ -7,6 +11,7 @@ SimpleShell * SimpleShell::instance = nullptr;
 
 SimpleShell::SimpleShell() : prompt_("$ ") {
     SimpleShell::instance = this;
+    SimpleShell::sync_pwd();
     const char * homeDir  = getenv("HOME");
 
     if (homeDir == nullptr) {
@@ -16,10 +21,143 @@ SimpleShell::SimpleShell() : prompt_("$ ") {
 
     this->home_directory_ = std::string(homeDir);
 
-    this->plugin_manager = std::make_shared<PluginManager>(PLUGINS_DIR);
-
     this->readConfig();
     this->loadEnvironmentVariables();
+    this->plugins_configured_ = this->config_has_enabled_plugins();
+
+    try {
+        this->command_cache_.set_capacity(std::stoul(this->config_get_value("shell", "command_cache_size", "128")));
+    } catch (const std::exception & e) {
+        std::cerr << "Invalid command_cache_size: " << e.what() << utils::ENDLINE;
+    }
+    this->script_cache_ = this->config_get_value("shell", "script_cache", "true") != "false";
+    this->auto_batch_   = this->config_get_value("shell", "auto_batch", "false") == "true";
+    arena::Scope::report = this->config_get_value("shell", "alloc_stats", "false") == "true";
+    try {
+        ProcessManager::report_time = std::stod(this->config_get_value("shell", "report_time", "0"));
+    } catch (const std::exception & e) {
+        std::cerr << "Invalid report_time: " << e.what() << utils::ENDLINE;
+    }
+    try {
+        ProcessManager::max_jobs = std::stoul(this->config_get_value("shell", "max_jobs", "0"));
+    } catch (const std::exception & e) {
+        std::cerr << "Invalid max_jobs: " << e.what() << utils::ENDLINE;
+    }
+    ProcessManager::priority_order = this->config_get_value("shell", "job_order", "priority") != "fifo";
+
+    this->glob_options_.nullglob = this->config_get_value("shell", "nullglob", "false") == "true";
+    this->glob_options_.failglob = this->config_get_value("shell", "failglob", "false") == "true";
+    this->glob_options_.dotglob  = this->config_get_value("shell", "dotglob", "false") == "true";
+
+    try {
+        DirCache::instance().set_capacity(std::stoul(this->config_get_value("shell", "dir_cache_size", "256")));
+    } catch (const std::exception & e) {
+        std::cerr << "Invalid dir_cache_size: " << e.what() << utils::ENDLINE;
+    }
+    DirCache::instance().set_inotify(this->config_get_value("shell", "dir_cache_inotify", "true") != "false");
+    Cgroups::instance().set_root(this->config_get_value("shell", "cgroup_root", ""));
+
+    if (this->config_get_value("shell", "capture_output", "false") == "true") {
+        rlim_t job_size   = 0;
+        rlim_t total_size = 0;
+        if (Limits::parse_size(this->config_get_value("shell", "capture_size", "64K"), job_size) &&
+            Limits::parse_size(this->config_get_value("shell", "capture_total", "1M"), total_size)) {
+            JobOutput::instance().configure(job_size, total_size,
+                                            this->config_get_value("shell", "capture_spill", ""));
+        } else {
+            std::cerr << "Invalid capture_size or capture_total" << utils::ENDLINE;
+        }
+    }
+}
+
+void SimpleShell::sync_pwd() {
+    // like bash: an inherited $PWD is kept when it names the current directory (it may go through symlinks)
+    const char * pwd = getenv("PWD");
+    struct stat  pwd_st {};
+    struct stat  cwd_st {};
+
+    if (pwd != nullptr && pwd[0] == '/' && stat(pwd, &pwd_st) == 0 && stat(".", &cwd_st) == 0 &&
+        pwd_st.st_dev == cwd_st.st_dev && pwd_st.st_ino == cwd_st.st_ino) {
+        return;
+    }
+    char * cwd = getcwd(nullptr, 0);
+    if (cwd != nullptr) {
+        setenv("PWD", cwd, 1);
+        free(cwd);
+    }
+}
+
+std::string SimpleShell::logical_path(const std::string & path) {
+    const char *             pwd = getenv("PWD");
+    const std::string        full = path[0] == '/' || pwd == nullptr ? path : std::string(pwd) + "/" + path;
+    std::vector<std::string> parts;
+    size_t                   start = 0;
+    while (start <= full.size()) {
+        size_t end = full.find('/', start);
+        if (end == std::string::npos) {
+            end = full.size();
+        }
+        const std::string part = full.substr(start, end - start);
+        if (part == "..") {
+            if (!parts.empty()) {
+                parts.pop_back();
+            }
+        } else if (!part.empty() && part != ".") {
+            parts.push_back(part);
+        }
+        start = end + 1;
+    }
+    std::string result;
+    for (const auto & part : parts) {
+        result += "/" + part;
+    }
+    return result.empty() ? "/" : result;
+}
+
+std::vector<std::string> SimpleShell::complete_path(const std::string & text, bool directories_only) {
+    const size_t      slash  = text.rfind('/');
+    const std::string prefix = slash == std::string::npos ? "" : text.substr(0, slash + 1);
+    const std::string base   = slash == std::string::npos ? text : text.substr(slash + 1);
+    std::string       directory = prefix;
+    if (directory.size() > 1 && directory[0] == '~' && directory[1] == '/') {
+        directory.replace(0, 1, instance->home_directory_);
+    }
+
+    std::vector<std::string> matches;
+    const auto               listing = DirCache::instance().list(directory);
+    if (listing == nullptr) {
+        return matches;
+    }
+    for (const auto & entry : listing->entries) {
+        if ((directories_only && !entry.directory) || (entry.name[0] == '.' && (base.empty() || base[0] != '.')) ||
+            entry.name.compare(0, base.size(), base) != 0) {
+            continue;
+        }
+        matches.push_back(prefix + entry.name);
+    }
+    return matches;
+}
+
+char * SimpleShell::filename_generator(const char * text, int state) {
+    static std::vector<std::string> matches;
+    static size_t                   match_index = 0;
+    if (state == 0) {
+        DirCache::instance().next_generation();
+        rl_filename_completion_desired = 1;
+        matches                        = SimpleShell::complete_path(text, false);
+        match_index                    = 0;
+    }
+    if (match_index >= matches.size()) {
+        return nullptr;
+    }
+    return strdup(matches[match_index++].c_str());
+}
+
+PluginManager * SimpleShell::plugins_get() {
+    if (this->plugin_manager != nullptr) {
+        return this->plugin_manager.get();
+    }
+    this->plugin_manager = std::make_shared<PluginManager>(PLUGINS_DIR);
 
     this->plugin_manager->setConfigCallback = [this](const std::string & section, const std::string & key,
                                                      const std::string & value) {
@@ -38,7 +176,11 @@ SimpleShell::SimpleShell() : prompt_("$ ") {
     };
 
     this->plugin_manager->loadPlugins(instance->config_get_plugins_enabled());
+    return this->plugin_manager.get();
+}
 
+void SimpleShell::init_interactive() {
+    this->plugins_get();
     this->parse_variables();
     this->format_prompt();
     read_history((std::string(this->home_directory_) + "/.pshell_history").c_str());
@@ -46,9 +188,11 @@ SimpleShell::SimpleShell() : prompt_("$ ") {
     this->LoadSystemBinaries();
 
     rl_attempted_completion_function = SimpleShell::rl_completion;
+    // the fallback when rl_completion has nothing: file names from the listings of DirCache
+    rl_completion_entry_function     = SimpleShell::filename_generator;
 }
 
-void SimpleShell::parse_variables() {
+void SimpleShell::parse_variables(bool defer_commands) {
     /// load variables from config file
     const auto env_vars   = config_get_section_variables("environment");
     const auto local_vars = config_get_section_variables("variables");
@@ -56,7 +200,7 @@ void SimpleShell::parse_variables() {
     for (const auto & entry : env_vars) {
         const auto & key   = entry.key;
         const auto & value = entry.value;
-        if (key.empty() || value.empty()) {
+        if (key.empty() || value.empty() || this->env_unchanged(key, value)) {
             continue;
         }
         try {
@@ -69,7 +213,7 @@ void SimpleShell::parse_variables() {
     for (const auto & entry : local_vars) {
         const auto & key   = entry.key;
         const auto & value = entry.value;
-        if (key.empty() || value.empty()) {
+        if (key.empty() || value.empty() || this->env_unchanged(key, value)) {
             continue;
         }
         try {
@@ -92,67 +236,116 @@ void SimpleShell::parse_variables() {
         //entry.original_value = utils::ConfigUtils::trim_string(entry.original_value);
 
         if (entry.original_value.find('`') != std::string::npos) {
-            std::string command = entry.original_value;
-            // remove quotes
-            command.erase(0, 1);
-            command.erase(command.length() - 1);
-            auto result = exec_shell_command(command);
-            if (!result.empty()) {
-                entry.value = utils::ConfigUtils::trim_string(result);
+            if (defer_commands) {
+                entry.pending = true;
+                continue;
             }
+            SimpleShell::evaluate_variable(entry);
         }
     }
 }
 
-void SimpleShell::run(const std::string & maybefile, const std::vector<std::string> & params) {
-    std::string command;
-
-    bool one_shot = false;
-    if ((!maybefile.empty()) && (maybefile != "-")) {
-        if (std::filesystem::exists(maybefile)) {
-            command = maybefile;
-            for (const auto & param : params) {
-                command.append(" ");
-                command.append(param);
+void SimpleShell::evaluate_variable(env_variable & entry) {
+    entry.pending       = false;
+    std::string command = entry.original_value;
+    // remove quotes
+    command.erase(0, 1);
+    command.erase(command.length() - 1);
+    auto result = exec_shell_command(command);
+    if (!result.empty()) {
+        result = utils::ConfigUtils::trim_string(result);
+        if (result != entry.value) {
+            entry.value = result;
+            if (entry.type == SimpleShell::variable_type::SL_VAR_GLOBAL) {
+                setenv(entry.key.c_str(), entry.value.c_str(), 1);
             }
-            one_shot = true;
+            CommandCache::variable_changed(entry.key);
         }
     }
+}
 
-    while (true) {
-        this->parse_variables();
-        this->format_prompt();
-        if (instance->sigwinch_received) {
-            rl_resize_terminal();
-            instance->sigwinch_received = false;
-        }
-
-        if (command.empty()) {
-            char * input = readline(prompt_.c_str());
-            if (input == nullptr) {
-                std::cout << utils::ENDLINE;
-                break;
-            }
-            command = std::string(input);
-            free(input);
+void SimpleShell::evaluate_pending_exports() {
+    for (auto & entry : this->shell_variables_) {
+        if (entry.pending && entry.type == SimpleShell::variable_type::SL_VAR_GLOBAL) {
+            SimpleShell::evaluate_variable(entry);
         }
+    }
+}
 
-        if (command == "exit") {
-            std::cout << "Exiting..." << utils::ENDLINE;
-            break;
+void SimpleShell::init_batch() {
+    // the `command` values are only run when a command refers to them or an external command inherits them
+    this->parse_variables(true);
+    this->exec_last_command_ = true;
+}
+
+void SimpleShell::run() {
+    this->init_interactive();
+
+    // readline is driven by the loop: the terminal, the signals and the watchers are waited for together
+    auto & loop = EventLoop::instance();
+    ProcessManager::instance().set_notifications(true);
+    rl_catch_signals  = 0;
+    rl_catch_sigwinch = 0;
+    // the exits come from the pidfds of the jobs, the signal still tells about the stops and the continues
+    loop.on_signal(SIGCHLD, [](const signalfd_siginfo & info) {
+        if (ProcessManager::pidfd_supported()) {
+            ProcessManager::instance().reap_child(static_cast<pid_t>(info.ssi_pid));
+        } else {
+            ProcessManager::instance().reap_children();
         }
+    });
+    loop.on_signal(SIGWINCH, [](const signalfd_siginfo &) { rl_resize_terminal(); });
+    // ^C and ^Z at the prompt drop the line, the jobs in the foreground get them from the terminal
+    const auto drop_line = [](const signalfd_siginfo &) {
+        rl_free_line_state();
+        rl_callback_sigcleanup();
+        rl_replace_line("", 0);
+        rl_crlf();
+        rl_on_new_line();
+        rl_redisplay();
+    };
+    loop.on_signal(SIGINT, drop_line);
+    loop.on_signal(SIGTSTP, drop_line);
+    loop.add(STDIN_FILENO, EPOLLIN, [](std::uint32_t) { rl_callback_read_char(); });
+    if (DirCache::instance().inotify_fd() != -1) {
+        loop.add(DirCache::instance().inotify_fd(), EPOLLIN,
+                 [](std::uint32_t) { DirCache::instance().read_pending_events(); });
+    }
 
-        const std::string original_command = SimpleShell::replace_variables(command);
+    this->prompt_next_line();
+    while (!this->exit_requested_ && !this->input_eof_) {
+        if (!loop.run_once(-1)) {
+            perror("epoll_wait");
+            break;
+        }
+        if (!this->line_ready_) {
+            continue;
+        }
+        this->line_ready_         = false;
+        const std::string command = std::move(this->pending_line_);
 
         if (!command.empty()) {
-            this->execute_command(command);
-            add_history(original_command.c_str());
+            add_history(command.c_str());
+
+            parser::Script script;
+            std::string    error;
+            if (parser::Parser::parse(command, script, error)) {
+                this->execute_script(script);
+            } else {
+                std::cerr << error << utils::ENDLINE;
+            }
         }
-        command.clear();
-        if (one_shot) {
-            break;
+        if (!this->exit_requested_) {
+            this->prompt_next_line();
         }
     }
+    rl_callback_handler_remove();
+    if (this->input_eof_) {
+        std::cout << utils::ENDLINE;
+    }
+    if (this->exit_requested_) {
+        std::cout << "Exiting..." << utils::ENDLINE;
+    }
 
     const char * homeDir = getenv("HOME");
     if (homeDir != nullptr) {
@@ -160,66 +353,396 @@ void SimpleShell::run(const std::string & maybefile, const std::vector<std::stri
     }
 }
 
+void SimpleShell::prompt_next_line() {
+    // the children which finished while the command ran, their SIGCHLD may not have been read yet
+    ProcessManager::instance().reap_children();
+    for (const auto & notification : ProcessManager::instance().take_notifications()) {
+        std::cout << notification << utils::ENDLINE;
+    }
+    this->parse_variables();
+    this->format_prompt();
+    rl_callback_handler_install(prompt_.c_str(), SimpleShell::line_handler);
+}
+
+int SimpleShell::run_source(std::string_view source, const std::string & name, const std::vector<std::string> & params) {
+    this->init_batch();
+    parser::Script script;
+    std::string    error;
+    if (!parser::Parser::parse(source, script, error)) {
+        std::cerr << name << ": " << error << utils::ENDLINE;
+        return 2;
+    }
+
+    // positional parameters: ${0} is the script, ${1}... the arguments
+    this->vm_.set_arguments(name, params);
+
+    return this->execute_script(script);
+}
+
+int SimpleShell::run_stream(int fd, const std::string & name, const std::vector<std::string> & params) {
+    std::string source;
+    char        buffer[65536];
+    while (true) {
+        const ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        source.append(buffer, n);
+    }
+    return this->run_source(source, name, params);
+}
+
+int SimpleShell::run_script(const std::string & path, const std::vector<std::string> & params) {
+    this->init_batch();
+    struct stat st {};
+
+    if (stat(path.c_str(), &st) == -1) {
+        std::cerr << path << ": " << strerror(errno) << utils::ENDLINE;
+        return 127;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        // a pipe or a character device, it can be neither mapped nor cached
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            std::cerr << path << ": " << strerror(errno) << utils::ENDLINE;
+            return 127;
+        }
+        const int status = this->run_stream(fd, path, params);
+        close(fd);
+        return status;
+    }
+
+    int        status  = 0;
+    const auto program = this->load_script(path, st, status);
+    if (program == nullptr) {
+        return status;
+    }
+    // positional parameters: ${0} is the script, ${1}... the arguments
+    this->vm_.set_arguments(path, params);
+    return this->execute_program(program);
+}
+
+std::shared_ptr<const vm::Program> SimpleShell::load_script(const std::string & path, const struct stat & st,
+                                                            int & status) {
+    auto program = std::make_shared<vm::Program>();
+    if (this->script_cache_ && vm::ScriptCache::load(path, st, this->vm_.variables(), *program)) {
+        return program;
+    }
+
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        std::cerr << path << ": " << strerror(errno) << utils::ENDLINE;
+        status = 127;
+        return nullptr;
+    }
+    // the whole file is parsed up front, the AST owns its text so the mapping is released right after
+    void * data = st.st_size > 0 ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+    if (data == MAP_FAILED) {
+        std::cerr << path << ": " << strerror(errno) << utils::ENDLINE;
+        status = 1;
+        return nullptr;
+    }
+
+    parser::Script script;
+    std::string    error;
+    const bool     parsed =
+        parser::Parser::parse(std::string_view(static_cast<const char *>(data), st.st_size), script, error);
+    if (data != nullptr) {
+        munmap(data, st.st_size);
+    }
+    if (!parsed || !this->vm_.compile(script, *program, error)) {
+        std::cerr << path << ": " << error << utils::ENDLINE;
+        status = 2;
+        return nullptr;
+    }
+
+    if (this->script_cache_) {
+        vm::ScriptCache::store(path, st, this->vm_.variables(), *program);
+    }
+    return program;
+}
+
+void SimpleShell::init_vm() {
+    this->vm_.run_command = [this](const std::string & command, bool background, bool replace_shell) {
+        return this->execute_command(background ? command + " &" : command, replace_shell);
+    };
+    this->vm_.lookup_variable = [this](const std::string & name) -> std::optional<std::string> {
+        auto it = std::find_if(this->shell_variables_.begin(), this->shell_variables_.end(),
+                               [&name](const env_variable & var) { return var.key == name; });
+        if (it != this->shell_variables_.end()) {
+            if (it->pending) {
+                SimpleShell::evaluate_variable(*it);
+            }
+            return it->value;
+        }
+        const char * value = getenv(name.c_str());
+        return value != nullptr ? std::optional<std::string>(value) : std::nullopt;
+    };
+    this->vm_.on_assign = [](const std::string & name, const std::string & value) {
+        // assigning an inherited variable updates the environment of the commands started later
+        if (getenv(name.c_str()) != nullptr) {
+            setenv(name.c_str(), value.c_str(), 1);
+            CommandCache::variable_changed(name);
+        }
+    };
+    this->vm_.split_words = [](const std::string & words) {
+        std::vector<std::string> args;
+        std::vector<bool>        quoted;
+        utils::parse_arguments(words, args, &quoted);
+        std::vector<std::string> result;
+        SimpleShell::expand_globs(args, result, &quoted);
+        return result;
+    };
+}
+
+int SimpleShell::execute_script(const parser::Script & script) {
+    auto        program = std::make_shared<vm::Program>();
+    std::string error;
+    if (!this->vm_.compile(script, *program, error)) {
+        std::cerr << error << utils::ENDLINE;
+        this->last_exit_status_ = 2;
+        return this->last_exit_status_;
+    }
+    return this->execute_program(program);
+}
+
+int SimpleShell::execute_program(const std::shared_ptr<const vm::Program> & program,
+                                 const std::vector<std::string> &       params) {
+    if (!this->vm_.run_command) {
+        this->init_vm();
+    }
+    this->vm_.exec_last     = this->exec_last_command_;
+    // a sourced file without arguments sees the positional parameters of its caller
+    this->last_exit_status_ = params.empty() ? this->vm_.run(program) : this->vm_.run(program, params);
+    this->exit_requested_   = this->vm_.exit_requested;
+    return this->last_exit_status_;
+}
+
 SimpleShell::~SimpleShell() {
-    this->writeConfig();
+    // -c and scripts run thousands of times, the file is only rewritten when something was changed
+    if (this->config_dirty_) {
+        this->writeConfig();
+    }
 }
 
-void SimpleShell::execute_command(const std::string & command) {
+std::vector<std::string> SimpleShell::expand_arguments(const std::string & command, std::vector<bool> & quoted) {
     std::vector<std::string> args = {};
-    utils::parse_arguments(command, args);
+    utils::parse_arguments(command, args, &quoted);
     if (args.empty()) {
-        return;
+        return args;
     }
 
-    // get the aliases
-    for (const auto & alias : this->config_get_section_variables("aliases")) {
-        if (alias.key.empty()) {
-            continue;
+    const size_t size = args.size();
+    if (this->aliases_.expand(args)) {
+        // the words of the alias replaced the first one, they are not quoted
+        quoted.erase(quoted.begin());
+        quoted.insert(quoted.begin(), args.size() - (size - 1), false);
+    }
+    return args;
+}
+
+bool SimpleShell::parse_command(const std::string & command, CommandCache::Entry & entry) {
+    std::string expanded = command;
+    SimpleShell::replace_variables(expanded);
+
+    const auto stage_commands = utils::split_pipeline(expanded);
+    for (size_t i = 0; i < stage_commands.size(); ++i) {
+        CommandCache::Stage stage;
+        stage.args = this->expand_arguments(stage_commands[i], stage.quoted);
+        if (i + 1 == stage_commands.size() && !stage.args.empty() && stage.args.back() == "&" &&
+            !stage.quoted.back()) {
+            entry.run_in_background = true;
+            stage.args.pop_back();
+            stage.quoted.pop_back();
         }
-        if (args[0] == alias.key) {
-            // replace the command with the alias
-            std::vector<std::string> alias_args = {};
-            std::stringstream        ss(alias.value);
-            std::string              segment;
-            while (ss >> segment) {
-                alias_args.push_back(segment);
+        std::string error;
+        if (!Redirections::extract(stage.args, stage.redirections, error, &stage.quoted)) {
+            std::cerr << error << utils::ENDLINE;
+            return false;
+        }
+        if (stage.args.empty()) {
+            if (stage_commands.size() > 1) {
+                std::cerr << "syntax error near unexpected token `|'" << utils::ENDLINE;
             }
-            alias_args.insert(alias_args.end(), args.begin() + 1, args.end());
-            args = alias_args;
-            break;
+            return false;
         }
+        for (size_t arg = 0; arg < stage.args.size() && !stage.has_glob; ++arg) {
+            stage.has_glob = !stage.quoted[arg] && Glob::needs_expansion(stage.args[arg]);
+        }
+        entry.stages.push_back(std::move(stage));
     }
+    return !entry.stages.empty();
+}
 
-    args = SimpleShell::replace_stars(args);
+int SimpleShell::execute_command(const std::string & command, bool replace_shell) {
+    const arena::Scope scope(command);
+    // the background jobs of the scripts are reaped between their commands, they have no event loop
+    ProcessManager::instance().reap_children_signaled();
+    auto entry = this->command_cache_.find(command);
+    if (entry == nullptr) {
+        CommandCache::Entry parsed;
+        if (!this->parse_command(command, parsed)) {
+            return 2;
+        }
+        entry = this->command_cache_.store(command, std::move(parsed));
+    }
 
-    if (instance->plugin_manager->OnCommand(args) == false) {
-        return;
+    // the stages point into the cache entry, only the expanded globs are new vectors
+    struct StageView {
+        const std::vector<std::string> * args;
+        const std::vector<Redirection> * redirections;
+        const builtins::Spec *           builtin;
+    };
+
+    std::pmr::memory_resource *                 memory = &arena::CommandArena::instance();
+    std::pmr::vector<StageView>                 stages(memory);
+    // reserved, the views keep pointers to the elements
+    std::pmr::vector<std::vector<std::string>> expanded(memory);
+    stages.reserve(entry->stages.size());
+    expanded.reserve(entry->stages.size());
+
+    for (const auto & cached_stage : entry->stages) {
+        const std::vector<std::string> * args = &cached_stage.args;
+        if (cached_stage.has_glob) {
+            if (!SimpleShell::expand_globs(cached_stage.args, expanded.emplace_back(), &cached_stage.quoted)) {
+                return 1;
+            }
+            args = &expanded.back();
+        }
+        if (args->empty()) {
+            return 0;
+        }
+        if (this->plugins_wanted() && this->plugins_get()->OnCommand(*args) == false) {
+            return 0;
+        }
+
+        const builtins::Spec * builtin = Builtins::registry.find((*args)[0]);
+        if (builtin != nullptr) {
+            std::string error;
+            const bool  wants_help = args->size() == 2 && (*args)[1] == "help";
+            if (!wants_help && !builtin->validate(*args, error)) {
+                std::cerr << (*args)[0] << ": " << error << utils::ENDLINE;
+                return 2;
+            }
+        }
+        stages.push_back({ args, &cached_stage.redirections, builtin });
     }
 
-    for (const auto & buildInCmd : instance->custom_commands_) {
-        if (buildInCmd.first == args[0] &&
-            buildInCmd.second.type == SimpleShell::custom_command_type::SL_CUSTOM_COMMAND_TYPE_BUILTIN) {
-            if (args.size() > 1 && args[1] == "help") {
-                std::cout << buildInCmd.second.GetFormattedHelp();
-                return;
+    if (stages.size() == 1 && stages[0].builtin != nullptr) {
+        return this->run_builtin(*stages[0].builtin, *stages[0].args, *stages[0].redirections,
+                                 entry->run_in_background);
+    }
+    this->evaluate_pending_exports();
+    const Limits * limits = this->limits_for(command);
+
+    if (stages.size() == 1) {
+        const auto & args         = *stages[0].args;
+        const auto & redirections = *stages[0].redirections;
+
+        // a glob may expand to more than an exec takes (E2BIG), with auto_batch the command runs in batches
+        if (this->auto_batch_ && !entry->run_in_background) {
+            const size_t limit = ArgBatcher::limit();
+            if (!ArgBatcher::fits(args, limit)) {
+                return this->run_batches(args, redirections, limit);
             }
-            buildInCmd.second.builtin_command(args);
-            return;
         }
+        if (replace_shell && !entry->run_in_background && !this->config_dirty_ && limits == nullptr) {
+            return ProcessManager::exec_process(args, redirections);
+        }
+        if (entry->run_in_background) {
+            std::cout << "Running in background: " << command << utils::ENDLINE;
+        }
+        return ProcessManager::start_process(args, entry->run_in_background, redirections, limits);
     }
 
-    bool run_in_background = false;
-    if (!args.empty() && args.back() == "&") {
-        run_in_background = true;
-        args.pop_back();
+    if (entry->run_in_background) {
         std::cout << "Running in background: " << command << utils::ENDLINE;
     }
+    // the builtins of a pipeline run on threads, every stage gets its own copy
+    std::vector<ProcessManager::PipelineStage> pipeline;
+    pipeline.reserve(stages.size());
+    for (const auto & stage : stages) {
+        pipeline.push_back({ *stage.args, *stage.redirections,
+                             stage.builtin != nullptr ? stage.builtin->handler : nullptr });
+    }
+    return ProcessManager::start_pipeline(pipeline, entry->run_in_background, limits);
+}
+
+int SimpleShell::run_batches(const std::vector<std::string> & args, std::vector<Redirection> redirections,
+                             size_t limit) {
+    const size_t                   fixed_count = ArgBatcher::fixed_count(args);
+    const std::vector<std::string> fixed(args.begin(), args.begin() + fixed_count);
+    const std::vector<std::string> rest(args.begin() + fixed_count, args.end());
+
+    int  status       = 0;
+    for (const auto & batch : ArgBatcher::split(fixed, rest, limit)) {
+        const int batch_status = ProcessManager::start_process(batch, false, redirections);
+        if (batch_status != 0) {
+            status = batch_status;
+        }
+        // ^C or ^Z stops the remaining batches too
+        if (batch_status > 128) {
+            break;
+        }
+        // the output of the later batches goes after the first one
+        for (auto & redirection : redirections) {
+            if (redirection.type == Redirection::RD_OUTPUT) {
+                redirection.type = Redirection::RD_APPEND;
+            }
+        }
+    }
+    return status;
+}
 
-    ProcessManager::start_process(args, run_in_background);
+const Limits * SimpleShell::limits_for(const std::string & command) const {
+    if (this->job_limits_.empty()) {
+        return nullptr;
+    }
+    const size_t start = command.find_first_not_of(" \t");
+    if (start == std::string::npos) {
+        return nullptr;
+    }
+    const size_t end = command.find_first_of(" \t|&", start);
+    const auto   it  = this->job_limits_.find(command.substr(start, end == std::string::npos ? end : end - start));
+    return it != this->job_limits_.end() ? &it->second : nullptr;
+}
+
+int SimpleShell::run_builtin(const builtins::Spec & command, const std::vector<std::string> & args,
+                             const std::vector<Redirection> & redirections, bool background) {
+    int              fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    std::vector<int> opened;
+    std::string      error;
+    if (!Redirections::open_for_builtin(redirections, fds, opened, error)) {
+        std::cerr << error << utils::ENDLINE;
+        for (const int fd : opened) {
+            close(fd);
+        }
+        return 1;
+    }
+
+    BuiltinIO io(fds[0], fds[1], fds[2], std::move(opened));
+    io.background = background;
+    if (args.size() > 1 && args[1] == "help") {
+        io.out << command.help();
+        return 0;
+    }
+    command.handler(args, io);
+    return io.status;
 }
 
 void SimpleShell::format_prompt() {
     this->prompt_ = this->prompt_format_ = this->config_get_value("shell", "prompt_format", this->prompt_format_);
+    // the number of jobs, read from the snapshot of the job table
+    for (size_t pos = 0; (pos = this->prompt_.find("${JOBS}", pos)) != std::string::npos;) {
+        const auto        snapshot = ProcessManager::instance().snapshot();
+        const std::string jobs     = std::to_string(snapshot->jobs.size() + snapshot->queued.size());
+        this->prompt_.replace(pos, 7, jobs);
+        pos += jobs.size();
+    }
     SimpleShell::replace_colors(this->prompt_);
     SimpleShell::replace_variables(this->prompt_);
 }
@@ -244,12 +767,11 @@ int SimpleShell::config_handler(void * user, const char * section, const char *
 
 std::string SimpleShell::config_get_value(const std::string & section_name, const std::string & key_name,
                                           const std::string & default_value) {
-    if (this->config_map_.find(section_name) != this->config_map_.end()) {
-        const auto section = this->config_map_[section_name];
-        for (const auto & entry : section) {
-            if (entry.first == key_name) {
-                return entry.second.value;
-            }
+    const auto section = this->config_map_.find(section_name);
+    if (section != this->config_map_.end()) {
+        const auto entry = section->second.find(key_name);
+        if (entry != section->second.end()) {
+            return entry->second.value;
         }
     }
     return default_value;
@@ -284,8 +806,13 @@ void SimpleShell::config_set_section_variable(const std::string & section, const
     if (this->config_map_.find(section) == this->config_map_.end()) {
         this->config_map_[section] = std::map<std::string, conf_variable>();
     }
-    auto & cfg_section = this->config_map_[section];
-    cfg_section[key]   = conf_variable(key, value);
+    auto & cfg_section  = this->config_map_[section];
+    cfg_section[key]    = conf_variable(key, value);
+    this->config_dirty_ = true;
+    if (section == "aliases") {
+        this->aliases_.set(key, cfg_section.at(key).value);
+        CommandCache::bump_epoch();
+    }
     if (flush) {
         this->writeConfig();
     }
@@ -306,9 +833,14 @@ void SimpleShell::env_set(const std::string & key, const std::string & value, Si
     auto it = std::find_if(shell_variables_.begin(), shell_variables_.end(),
                            [&key](const SimpleShell::env_variable & var) { return var.key == key; });
     if (it != shell_variables_.end()) {
-        it->value = value;
+        if (it->value != value) {
+            CommandCache::variable_changed(key);
+        }
+        it->value          = value;
+        it->original_value = value;
     } else {
         shell_variables_.push_back(SimpleShell::env_variable(key, value, type));
+        CommandCache::variable_changed(key);
     }
 
     if (type == SimpleShell::variable_type::SL_VAR_GLOBAL) {
@@ -372,7 +904,7 @@ bool SimpleShell::custom_command_add(const std::string & command, const std::vec
     if (command.empty()) {
         return false;
     }
-    if (instance->custom_commands_.contains(command)) {
+    if (instance->custom_commands_.contains(command) || Builtins::registry.find(command) != nullptr) {
         return false;
     }
 
@@ -389,9 +921,271 @@ bool SimpleShell::custom_command_add(const SimpleShell::custom_command & command
     if (command.command.empty()) {
         return false;
     }
-    if (instance->custom_commands_.contains(command.command)) {
+    if (instance->custom_commands_.contains(command.command) || Builtins::registry.find(command.command) != nullptr) {
         return false;
     }
     instance->custom_commands_[command.command] = command;
     return true;
 }
+
+std::vector<std::string> SimpleShell::builtin_names() {
+    std::vector<std::string> names;
+    for (const auto & spec : Builtins::registry.all()) {
+        names.emplace_back(spec.name);
+    }
+    if (instance != nullptr) {
+        for (const auto & command : instance->custom_commands_) {
+            names.push_back(command.first);
+        }
+    }
+    return names;
+}
+
+bool SimpleShell::complete_builtin_argument(const std::string & line, const std::string & text,
+                                            std::vector<std::string> & matches) {
+    std::vector<std::string> words;
+    utils::parse_arguments(line.substr(0, line.size() - std::min(line.size(), text.size())), words);
+    if (words.empty()) {
+        return false;
+    }
+    const builtins::Spec * spec = Builtins::registry.find(words[0]);
+    if (spec == nullptr || spec->free_form || spec->args.empty()) {
+        return false;
+    }
+    const size_t index = words.size() - 1;
+    if (index >= spec->args.size() && !spec->args.back().variadic) {
+        return false;
+    }
+    const builtins::ArgSpec & arg = spec->args[std::min(index, spec->args.size() - 1)];
+
+    std::vector<std::string> candidates;
+    switch (arg.kind) {
+        case builtins::ArgKind::AK_KEYWORD:
+            for (std::string_view keywords = arg.name; !keywords.empty();) {
+                const size_t end = keywords.find('|');
+                candidates.emplace_back(keywords.substr(0, end));
+                keywords.remove_prefix(end == std::string_view::npos ? keywords.size() : end + 1);
+            }
+            break;
+        case builtins::ArgKind::AK_ALIAS:
+            candidates = instance->aliases_.names();
+            break;
+        case builtins::ArgKind::AK_PLUGIN:
+            // completion does not load the plugins
+            if (instance->plugin_manager != nullptr) {
+                for (const auto & plugin : instance->plugin_manager->getPlugins()) {
+                    candidates.push_back(plugin.first);
+                }
+            }
+            break;
+        case builtins::ArgKind::AK_JOB:
+            for (const auto & process : ProcessManager::instance().snapshot()->jobs) {
+                candidates.push_back("%" + std::to_string(process.job_id));
+                candidates.push_back(std::to_string(process.pid));
+            }
+            break;
+        case builtins::ArgKind::AK_COMMAND:
+            candidates = SimpleShell::builtin_names();
+            break;
+        case builtins::ArgKind::AK_DIRECTORY:
+            // readline quotes them and appends the / like for the file names
+            rl_filename_completion_desired = 1;
+            candidates                     = SimpleShell::complete_path(text, true);
+            break;
+        default:
+            // words, numbers and files are left to the default completion
+            return false;
+    }
+    for (auto & candidate : candidates) {
+        if (candidate.compare(0, text.size(), text) == 0) {
+            matches.push_back(std::move(candidate));
+        }
+    }
+    return true;
+}
+
+void SimpleShell::help(const std::vector<std::string> & args, BuiltinIO & io) {
+    if (args.size() == 2) {
+        const builtins::Spec * spec = Builtins::registry.find(args[1]);
+        if (spec != nullptr) {
+            io.out << spec->help();
+            return;
+        }
+        const auto command = instance->custom_commands_.find(args[1]);
+        if (command == instance->custom_commands_.end()) {
+            io.err << "help: no help topics match '" << args[1] << "'" << utils::ENDLINE;
+            io.status = 1;
+            return;
+        }
+        io.out << command->second.GetFormattedHelp();
+        return;
+    }
+    for (const auto & spec : Builtins::registry.all()) {
+        io.out << spec.usage() << utils::ENDLINE;
+    }
+    for (const auto & command : instance->custom_commands_) {
+        io.out << command.first << utils::ENDLINE;
+    }
+}
+
+void SimpleShell::time(const std::vector<std::string> & args, BuiltinIO & io) {
+    if (args.size() < 2) {
+        io.err << "time: missing command" << utils::ENDLINE;
+        io.status = 2;
+        return;
+    }
+    const std::vector<std::string> command(args.begin() + 1, args.end());
+    const auto                     started = ProcessManager::Clock::now();
+    ProcessManager::Usage          usage;
+
+    if (const auto * builtin = Builtins::registry.find(command[0])) {
+        // the builtin runs in the shell, its usage is the one of the shell meanwhile
+        const auto seconds = [](const timeval & from, const timeval & to) {
+            return static_cast<double>(to.tv_sec - from.tv_sec) + (to.tv_usec - from.tv_usec) / 1e6;
+        };
+        rusage before{};
+        rusage after{};
+        getrusage(RUSAGE_SELF, &before);
+        builtin->handler(command, io);
+        getrusage(RUSAGE_SELF, &after);
+        usage.user    = seconds(before.ru_utime, after.ru_utime);
+        usage.sys     = seconds(before.ru_stime, after.ru_stime);
+        usage.max_rss = after.ru_maxrss;
+    } else {
+        io.out.flush();
+        // a job which was stopped or did not start leaves it empty
+        ProcessManager::instance().take_foreground_usage();
+        io.status = ProcessManager::start_process(command, false, SimpleShell::redirections_of(io));
+        usage     = ProcessManager::instance().take_foreground_usage();
+    }
+    usage.wall = std::chrono::duration<double>(ProcessManager::Clock::now() - started).count();
+    io.out.flush();
+    io.err << "\n" << usage.report();
+}
+
+void SimpleShell::limit(const std::vector<std::string> & args, BuiltinIO & io) {
+    SimpleShell::run_limited(args, 1, Limits(), io);
+}
+
+void SimpleShell::policy(const std::vector<std::string> & args, BuiltinIO & io) {
+    if (args.size() == 1) {
+        std::vector<std::string> names;
+        for (const auto & entry : instance->policies_) {
+            names.push_back(entry.first);
+        }
+        std::sort(names.begin(), names.end());
+        for (const auto & name : names) {
+            io.out << name << " = " << instance->config_get_value("policies", name, "") << utils::ENDLINE;
+        }
+        io.status = 0;
+        return;
+    }
+    const auto it = instance->policies_.find(args[1]);
+    if (it == instance->policies_.end()) {
+        io.err << "policy: " << args[1] << ": no such policy" << utils::ENDLINE;
+        io.status = 2;
+        return;
+    }
+    // the options of limit after the name change the policy for this command
+    SimpleShell::run_limited(args, 2, it->second, io);
+}
+
+void SimpleShell::run_limited(const std::vector<std::string> & args, size_t index, Limits limits, BuiltinIO & io) {
+    std::string error;
+    if (!limits.parse(args, index, error)) {
+        io.err << args[0] << ": " << error << utils::ENDLINE;
+        io.status = 2;
+        return;
+    }
+    if (index == args.size()) {
+        io.err << args[0] << ": missing command" << utils::ENDLINE;
+        io.status = 2;
+        return;
+    }
+    const std::vector<std::string> command(args.begin() + static_cast<std::ptrdiff_t>(index), args.end());
+    // a builtin runs in the shell, the limits would stay on the shell
+    if (Builtins::registry.find(command[0]) != nullptr) {
+        io.err << args[0] << ": " << command[0] << ": a builtin can not be limited" << utils::ENDLINE;
+        io.status = 1;
+        return;
+    }
+    io.out.flush();
+    io.status = ProcessManager::start_process(command, io.background, SimpleShell::redirections_of(io), &limits);
+}
+
+std::vector<Redirection> SimpleShell::redirections_of(const BuiltinIO & io) {
+    std::vector<Redirection> redirections;
+    const int                fds[3] = { io.in, io.out_fd, io.err_fd };
+    for (int fd = 0; fd < 3; ++fd) {
+        if (fds[fd] != fd) {
+            redirections.push_back({ fd, Redirection::RD_DUP, "", fds[fd] });
+        }
+    }
+    return redirections;
+}
+
+void SimpleShell::job_output(const std::vector<std::string> & args, BuiltinIO & io) {
+    const bool   tail   = args[1] == "tail";
+    const bool   follow = tail && args.size() > 2 && args[2] == "-f";
+    const size_t used   = 2 + (follow ? 1 : 0);
+    if ((!tail && args[1] != "output") || args.size() > used + 1) {
+        io.err << "jobs: usage: jobs [output|tail [-f]] [%N|pid]" << utils::ENDLINE;
+        io.status = 2;
+        return;
+    }
+    const std::string job     = args.size() > used ? args[used] : "";
+    const auto        capture = JobOutput::instance().find(job);
+    if (capture == nullptr) {
+        io.err << "jobs: no captured output" << (job.empty() ? "" : " of " + job) << utils::ENDLINE;
+        io.status = 1;
+        return;
+    }
+    JobOutput::instance().drain(*capture);
+    std::uint64_t from = 0;
+    io.out << JobOutput::instance().read_from(*capture, from);
+    if (capture->oldest() > 0) {
+        io.err << "jobs: the first " << capture->oldest() << " bytes are gone"
+               << (capture->spill_path.empty() ? "" : ", all of it is in " + capture->spill_path) << utils::ENDLINE;
+    }
+    if (!follow) {
+        return;
+    }
+    io.out.flush();
+
+    // the pipe and ^C, like wait: the interactive shell gets SIGINT from a signalfd
+    const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    sigset_t  interrupt;
+    sigemptyset(&interrupt);
+    sigaddset(&interrupt, SIGINT);
+    const int signal_fd = signalfd(-1, &interrupt, SFD_NONBLOCK | SFD_CLOEXEC);
+    for (const int fd : { signal_fd, capture->fd }) {
+        epoll_event event{};
+        event.events  = EPOLLIN;
+        event.data.fd = fd;
+        if (fd != -1) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        }
+    }
+    while (capture->fd != -1) {
+        epoll_event events[2];
+        const int   count = epoll_wait(epoll_fd, events, 2, 1000);
+        if (count == -1 && errno != EINTR) {
+            break;
+        }
+        if (std::any_of(events, events + std::max(count, 0),
+                        [signal_fd](const epoll_event & event) { return event.data.fd == signal_fd; })) {
+            signalfd_siginfo info{};
+            while (read(signal_fd, &info, sizeof(info)) == static_cast<ssize_t>(sizeof(info))) {
+            }
+            io.status = 128 + SIGINT;
+            break;
+        }
+        JobOutput::instance().drain(*capture);
+        io.out << JobOutput::instance().read_from(*capture, from);
+        io.out.flush();
+    }
+    if (signal_fd != -1) {
+        close(signal_fd);
+    }
+    close(epoll_fd);
+}
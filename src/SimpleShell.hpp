@@ -16,7 +16,6 @@
 #include <vector>
 
 // System (POSIX)
-#include <glob.h>
 #include <readline/history.h>
 #include <readline/readline.h>
 #include <sys/wait.h>
@@ -28,48 +27,45 @@
 // Third-party
 #include "ini.h"
 #include "PluginManager.hpp"
+#include "AliasTable.hpp"
+#include "Arena.hpp"
+#include "ArgBatcher.hpp"
+#include "BuiltinRegistry.hpp"
+#include "CommandCache.hpp"
+#include "DirCache.hpp"
+#include "EventLoop.hpp"
+#include "Glob.hpp"
+#include "ParallelRunner.hpp"
+#include "Parser.hpp"
 #include "ProcessManager.hpp"
+#include "Redirection.hpp"
+#include "ScriptCache.hpp"
+#include "ScriptVM.hpp"
 
 class SimpleShell {
   public:
     SimpleShell();
     ~SimpleShell();
 
-    using BuiltInCommand = void (*)(const std::vector<std::string> &);
+    using BuiltInCommand = void (*)(const std::vector<std::string> &, BuiltinIO &);
 
-    void run(const std::string & maybefile = "", const std::vector<std::string> & params = {});
+    // interactive mode: readline, prompt, history and completion
+    void run();
 
-    static void signal_handler_wrapper(int sig) {
-        if (instance) {
-            if (sig == SIGINT) {
-                SimpleShell::handle_sigint(sig);
-                return;
-            }
-            if (sig == SIGTSTP) {
-                SimpleShell::handle_sigtstp(sig);
-                return;
-            }
-            if (sig == SIGCONT) {
-                SimpleShell::handle_sigcont(sig);
-                return;
-            }
-            if (sig == SIGCHLD) {
-                SimpleShell::handle_sigchld(sig);
-                return;
-            }
-            if (sig == SIGWINCH) {
-                SimpleShell::handle_sigwinch(sig);
-                return;
-            }
-            std::cerr << "Unknown signal received: " << sig << utils::ENDLINE;
-            return;
-        }
-        std::cerr << "Instance not initialized." << utils::ENDLINE;
-    }
+    // non-interactive mode, the script is parsed at once and executed without any of the interactive setup
+    int run_script(const std::string & path, const std::vector<std::string> & params = {});
+
+    // -c: the source comes from the command line, name is ${0}
+    int run_source(std::string_view source, const std::string & name, const std::vector<std::string> & params = {});
+
+    // piped input, read till EOF then executed like a script
+    int run_stream(int fd, const std::string & name, const std::vector<std::string> & params = {});
+
+    // SIGINT, SIGTSTP and SIGCHLD of the scripts, the interactive shell reads the signals from the event loop
+    static void signal_handler_wrapper(int sig) { ProcessManager::handle_signal(sig); }
 
   private:
-    std::shared_ptr<PluginManager> plugin_manager    = nullptr;
-    std::atomic<bool>              sigwinch_received = false;
+    std::shared_ptr<PluginManager> plugin_manager = nullptr;
 
     enum variable_type : std::uint8_t {
         // internal variable
@@ -86,7 +82,9 @@ class SimpleShell {
         std::string   key;
         std::string   value;
         std::string   original_value;
-        variable_type type = SL_VAR_LOCAL;
+        variable_type type    = SL_VAR_LOCAL;
+        // the `command` of the value is not yet executed
+        bool          pending = false;
 
         env_variable(const std::string & key, const std::string & value, variable_type type = SL_VAR_LOCAL) :
             key(key),
@@ -216,52 +214,11 @@ class SimpleShell {
         }
     };
 
-    std::unordered_map<std::string, custom_command> custom_commands_{
-        { "cd",
-         custom_command{ "cd", {}, "Change current directory", SL_CUSTOM_COMMAND_TYPE_BUILTIN, SimpleShell::cd }        },
-        { "echo",
-         custom_command{ "echo", {}, "Print out a string", SL_CUSTOM_COMMAND_TYPE_BUILTIN, SimpleShell::echo }          },
-        { "env",           custom_command{ "env",
-                                 {},
-                                 "Print out the environment variables",
-                                 SL_CUSTOM_COMMAND_TYPE_BUILTIN,
-                                 SimpleShell::echo }                                                    },
-        { "jobs",          custom_command{ "jobs", {}, "Show jobs", SL_CUSTOM_COMMAND_TYPE_BUILTIN, SimpleShell::jobs } },
-        { "plugins",       custom_command{ "plugins",
-                                     { custom_command_params{ "list", "List available plugins" },
-                                       custom_command_params{ "disable <plugin id>", "Disable plugin with id" },
-                                       custom_command_params{ "list", "List available plugins" },
-                                       custom_command_params{ "reload", "Reload plugins" } },
-                                     "Manage the plugins",
-                                     SL_CUSTOM_COMMAND_TYPE_BUILTIN,
-                                     SimpleShell::plugins }                                         },
-        { "aliases",
-         custom_command{ "aliases",
-                          { custom_command_params{ "add <alias_name> <command>", "Add a new alias" },
-                            custom_command_params{ "delete <alias_name>", "Delete alias with name <alias_name>" },
-                            custom_command_params{ "list", "List all configured alias" } },
-                          "Show jobs",
-                          SL_CUSTOM_COMMAND_TYPE_BUILTIN,
-                          SimpleShell::alias }                                                                          },
-
-        { "bg",
-         custom_command{ "bg", {}, "Send to the background a job", SL_CUSTOM_COMMAND_TYPE_BUILTIN, SimpleShell::bg }    },
-        { "fg",
-         custom_command{
-              "fg",
-              { { "job_id",
-                  "The job id to bring into the foreground. If ommitted, the last available job will be used" } },
-              "Bring back to the foreground a job",
-              SL_CUSTOM_COMMAND_TYPE_BUILTIN,
-              SimpleShell::bg }                                                                                         },
-        { "reload_config",
-         custom_command{
-              "reload_config",
-              {},
-              "Re-read the configuration file and reload it's contents. WARN: all not saved changes will be lost",
-              SL_CUSTOM_COMMAND_TYPE_BUILTIN,
-              SimpleShell::reload_config }                                                                              },
-    };
+    // the constexpr table of the builtins, defined after the class
+    struct Builtins;
+
+    // the commands registered by the plugins, the builtins are in SimpleShell::Builtins
+    std::unordered_map<std::string, custom_command> custom_commands_;
     static SimpleShell *                             instance;
     ProcessManager                                   process_manager_;
     std::string                                      prompt_;
@@ -273,6 +230,25 @@ class SimpleShell {
     std::map<pid_t, std::string>                     running_processes_;
     std::vector<std::string>                         vocabulary{ "cat", "dog", "canary", "cow", "hamster" };
     std::unordered_map<std::string, system_binaries> system_binaries_;
+    CommandCache                                     command_cache_;
+    AliasTable                                       aliases_;
+    vm::VM                                           vm_;
+    int                                              last_exit_status_   = 0;
+    bool                                             config_dirty_       = false;
+    bool                                             plugins_configured_ = false;
+    bool                                             exit_requested_     = false;
+    // the line read by line_handler, run by the loop of run()
+    std::string                                      pending_line_;
+    bool                                             line_ready_         = false;
+    bool                                             input_eof_          = false;
+    bool                                             exec_last_command_  = false;
+    bool                                             script_cache_       = true;
+    bool                                             auto_batch_         = false;
+    Glob::Options                                    glob_options_;
+    // the [limits] section: command or alias name -> the options of limit
+    std::unordered_map<std::string, Limits>          job_limits_;
+    // the [policies] section: name -> "cpus:4-15 io:idle"
+    std::unordered_map<std::string, Limits>          policies_;
 
     system_binaries parse_params_from_help(SimpleShell::system_binaries & bin_info) {
         if (bin_info.full_path.empty()) {
@@ -331,17 +307,19 @@ class SimpleShell {
             matches.clear();
             match_index         = 0;
             std::string textstr = std::string(text);
+            DirCache::instance().next_generation();
 
-            if (current_text.size() > 0 && current_text.back() == ' ') {
+            if (SimpleShell::complete_builtin_argument(current_text.substr(0, rl_point), textstr, matches)) {
+                // the spec of the builtin knows the argument
+            } else if (current_text.size() > 0 && current_text.back() == ' ') {
                 auto result = find_by_bin_or_path(instance->system_binaries_, current_text, textstr);
 
                 if (result.has_value()) {
                     matches.push_back(result.value().bin);
                 }
-                for (const auto & builtIn : instance->custom_commands_) {
-                    if (builtIn.first.size() >= textstr.size() &&
-                        builtIn.first.compare(0, textstr.size(), textstr) == 0) {
-                        matches.push_back(builtIn.first);
+                for (const auto & builtin : SimpleShell::builtin_names()) {
+                    if (builtin.size() >= textstr.size() && builtin.compare(0, textstr.size(), textstr) == 0) {
+                        matches.push_back(builtin);
                     }
                 }
             } else {
@@ -368,6 +346,17 @@ class SimpleShell {
         return strdup(matches[match_index++].c_str());
     }
 
+    static std::vector<std::string> builtin_names();
+
+    // the entries of the directory part of text which start with the rest, the hidden ones only for a leading .
+    static std::vector<std::string> complete_path(const std::string & text, bool directories_only);
+
+    static char * filename_generator(const char * text, int state);
+
+    // completes the argument of a builtin from its spec, false when it is not a builtin argument
+    static bool complete_builtin_argument(const std::string & line, const std::string & text,
+                                          std::vector<std::string> & matches);
+
     static char ** rl_completion(const char * text, int start, int end) {
         // Don't do filename completion even if our generator finds no matches.
         //rl_attempted_completion_over = 1;
@@ -394,10 +383,11 @@ class SimpleShell {
     static std::string replace_variables(std::string & input) {
         const auto  original_input = input;
         std::smatch match;
-        std::regex  var_pattern(R"(\$\{([A-Z0-9_]+)(:-([^}]*))?\})");
+        // compiled once, building the regex costs more than most of the commands it is used on
+        static const std::regex var_pattern(R"(\$\{([A-Z0-9_]+)(:-([^}]*))?\})");
 
         auto search_start = input.cbegin();
-        while (std::regex_search(search_start, input.cend(), match, var_pattern)) {
+        while (input.find("${") != std::string::npos && std::regex_search(search_start, input.cend(), match, var_pattern)) {
             std::string full_match = match[0];
             std::string var_name   = match[1];
             std::string fallback   = match[3];
@@ -409,6 +399,9 @@ class SimpleShell {
                                    [&](const env_variable & var) { return var.key == var_name; });
 
             if (it != SimpleShell::instance->shell_variables_.end()) {
+                if (it->pending) {
+                    SimpleShell::evaluate_variable(*it);
+                }
                 value = it->value;
             } else {
                 const char * env_val = getenv(var_name.c_str());
@@ -437,55 +430,30 @@ class SimpleShell {
         return original_input;
     }
 
-    static std::vector<std::string> replace_stars(const std::vector<std::string> & args) {
-        std::vector<std::string> result;
-        const std::string        current_dir = getenv("PWD");
-
-        for (const auto & s : args) {
-            const auto _pos = s.find('*');
-            if (_pos != std::string::npos) {
-                if (_pos > 0 && s.substr(_pos - 1, 1) == "\\") {
-                    result.push_back(s);
-                    continue;
-                }
-                if (_pos > 0 && s.substr(_pos - 1, 1) == "\"") {
-                    result.push_back(s);
-                    continue;
-                }
-                std::string base_path = current_dir;
-                std::string pattern   = s;
-
-                if (s.find('/') != std::string::npos) {
-                    std::filesystem::path p(s);
-                    pattern   = p.filename().string();
-                    base_path = p.parent_path().string();
-                    if (base_path.empty()) {
-                        base_path = current_dir;
-                    } else {
-                        base_path.insert(0, current_dir + "/");
-                    }
-                }
-                std::string pattern_with_wildcard = base_path;
-                pattern_with_wildcard += "/";
-                pattern_with_wildcard += pattern;
-                std::string matched_files = glob_files(pattern_with_wildcard, base_path + "/");
-
-                std::istringstream iss(matched_files);
-                std::string        token;
-                while (iss >> std::quoted(token)) {
-                    result.push_back(token);
-                }
-            } else {
-                result.push_back(s);
+    /**
+     * Brace and pathname expansion of the arguments, false (after the error message) when failglob found no
+     * match. The arguments flagged in quoted (one flag per argument, nullptr: none) are kept as they are.
+     */
+    static bool expand_globs(const std::vector<std::string> & args, std::vector<std::string> & result,
+                             const std::vector<bool> * quoted = nullptr) {
+        // the directories may have changed since the previous command
+        DirCache::instance().next_generation();
+        result.clear();
+        result.reserve(args.size());
+        for (size_t i = 0; i < args.size(); ++i) {
+            if (quoted != nullptr && i < quoted->size() && (*quoted)[i]) {
+                result.push_back(args[i]);
+            } else if (!Glob::expand(args[i], result, instance->glob_options_)) {
+                std::cerr << "no match: " << args[i] << utils::ENDLINE;
+                return false;
             }
         }
-
-        return result;
+        return true;
     }
 
     static void replace_colors(std::string & input) {
-        std::smatch match;
-        std::regex  var_pattern(R"(\$\{([A-Z0-9_]+)\})");
+        std::smatch             match;
+        static const std::regex var_pattern(R"(\$\{([A-Z0-9_]+)\})");
 
         auto search_start = input.cbegin();
         while (std::regex_search(search_start, input.cend(), match, var_pattern)) {
@@ -534,6 +502,11 @@ class SimpleShell {
         return plugins;
     }
 
+    bool config_has_enabled_plugins() {
+        const auto enabled = this->config_get_plugins_enabled();
+        return std::any_of(enabled.begin(), enabled.end(), [](const auto & plugin) { return plugin.second; });
+    }
+
     void config_set_section_variable(const std::string & section, const std::string & key, const std::string & value,
                                      bool flush = false);
 
@@ -542,6 +515,11 @@ class SimpleShell {
             auto & section_map = this->config_map_.at(section);
             if (section_map.contains(key)) {
                 section_map.erase(key);
+                this->config_dirty_ = true;
+                if (section == "aliases") {
+                    this->aliases_.erase(key);
+                    CommandCache::bump_epoch();
+                }
 
                 if (flush) {
                     this->writeConfig();
@@ -576,6 +554,42 @@ class SimpleShell {
         if (ini_parse(configFilePath.c_str(), config_handler, this) < 0) {
             std::cerr << "Failed to read configuration file: " << configFilePath << utils::ENDLINE;
         }
+        this->aliases_.clear();
+        const auto aliases = this->config_map_.find("aliases");
+        if (aliases != this->config_map_.end()) {
+            for (const auto & alias : aliases->second) {
+                this->aliases_.set(alias.first, alias.second.value);
+            }
+        }
+        this->job_limits_.clear();
+        const auto limits = this->config_map_.find("limits");
+        if (limits != this->config_map_.end()) {
+            for (const auto & entry : limits->second) {
+                const auto  args  = ProcessManager::Process::commandToArgs(entry.second.value);
+                Limits      job_limits;
+                size_t      index = 0;
+                std::string error = "unexpected " + (args.empty() ? std::string("end") : args[0]);
+                if (!job_limits.parse(args, index, error) || index != args.size() || job_limits.empty()) {
+                    std::cerr << "Invalid limits of " << entry.first << ": " << error << utils::ENDLINE;
+                    continue;
+                }
+                this->job_limits_[entry.first] = job_limits;
+            }
+        }
+        this->policies_.clear();
+        const auto policies = this->config_map_.find("policies");
+        if (policies != this->config_map_.end()) {
+            for (const auto & entry : policies->second) {
+                Limits      policy;
+                std::string error = "empty policy";
+                if (!policy.parse_policy(entry.second.value, error) || policy.empty()) {
+                    std::cerr << "Invalid policy " << entry.first << ": " << error << utils::ENDLINE;
+                    continue;
+                }
+                this->policies_[entry.first] = policy;
+            }
+        }
+        CommandCache::bump_epoch();
     }
 
     void writeConfig() {
@@ -599,234 +613,514 @@ class SimpleShell {
         }
 
         configFile.close();
+        this->config_dirty_ = false;
     }
 
-    static void handle_sigchld(const int & /*signal*/) { ProcessManager::handle_completed_processes(); }
-
-    static void handle_sigwinch(const int & /*signal*/) { SimpleShell::instance->sigwinch_received = true; };
-
-    static void handle_sigint(const int & signal) {
+    void format_prompt();
 
-        ProcessManager::instance().send_signal_to_foregound(signal);
-        SimpleShell::instance->parse_variables();
-        SimpleShell::instance->format_prompt();
-        rl_replace_line("", 0);
-        rl_crlf();
-        rl_on_new_line();
-        rl_redisplay();
-    }
+    void                      parse_variables(bool defer_commands = false);
+    static void               evaluate_variable(env_variable & entry);
+    void                      evaluate_pending_exports();
+    void                      init_batch();
+    void                      set_environment_variables();
+    void                      env_set(const std::string & key, const std::string & value, variable_type type);
 
-    static void handle_sigtstp(const int & signal) {
-        ProcessManager::instance().send_signal_to_foregound(signal);
-        SimpleShell::instance->parse_variables();
-        SimpleShell::instance->format_prompt();
-        rl_replace_line("", 0);
-        rl_crlf();
-        rl_on_new_line();
-        rl_redisplay();
+    // true when the variable already holds the value read from the configuration
+    bool env_unchanged(const std::string & key, const std::string & value) const {
+        return std::any_of(shell_variables_.begin(), shell_variables_.end(), [&](const env_variable & var) {
+            return var.key == key && var.original_value == value;
+        });
     }
 
-    static void handle_sigcont(const int & signal) { ProcessManager::instance().send_signal_to_foregound(signal); }
+    std::vector<env_variable> get_env_variables(variable_type type = SL_VAR_ANY);
 
-    void format_prompt();
+    std::vector<std::string> expand_arguments(const std::string & command, std::vector<bool> & quoted);
+    bool                     parse_command(const std::string & command, CommandCache::Entry & entry);
+    int                      execute_command(const std::string & command, bool replace_shell = false);
+    int                      execute_script(const parser::Script & script);
+    int                      execute_program(const std::shared_ptr<const vm::Program> & program,
+                                             const std::vector<std::string> &       params = {});
+    void                     init_vm();
+    int                      run_batches(const std::vector<std::string> & args, std::vector<Redirection> redirections,
+                                         size_t limit);
+    // parse and compile a script file, or take the compiled program from the script cache when the file did not
+    // change; on failure the message is printed and nullptr is returned with the exit status in status
+    std::shared_ptr<const vm::Program> load_script(const std::string & path, const struct stat & st, int & status);
+    int run_builtin(const builtins::Spec & command, const std::vector<std::string> & args,
+                    const std::vector<Redirection> & redirections, bool background = false);
+    // the limits of the [limits] entry of the first word of the command line (an alias or a command), or nullptr
+    const Limits * limits_for(const std::string & command) const;
+    void init_interactive();
+    // prints the queued job notifications and installs the prompt of the next line
+    void prompt_next_line();
+
+    // called by rl_callback_read_char with a finished line, nullptr on EOF
+    static void line_handler(char * line) {
+        if (line == nullptr) {
+            instance->input_eof_ = true;
+        } else {
+            instance->pending_line_ = line;
+            instance->line_ready_   = true;
+            free(line);
+        }
+        // the terminal settings of readline are restored before the command runs
+        rl_callback_handler_remove();
+    }
 
-    void                      parse_variables();
-    void                      set_environment_variables();
-    void                      env_set(const std::string & key, const std::string & value, variable_type type);
-    std::vector<env_variable> get_env_variables(variable_type type = SL_VAR_ANY);
+    // the Lua state is created on the first use, -c and scripts without an enabled plugin never pay for it
+    PluginManager * plugins_get();
 
-    void execute_command(const std::string & command);
+    bool plugins_wanted() const { return this->plugin_manager != nullptr || this->plugins_configured_; }
 
-    static void reload_config(const std::vector<std::string> & /*args*/) {
+    static void reload_config(const std::vector<std::string> & /*args*/, BuiltinIO & io) {
         instance->readConfig();
         instance->loadEnvironmentVariables();
+        instance->plugins_configured_ = instance->config_has_enabled_plugins();
         instance->parse_variables();
         instance->format_prompt();
-        std::cout << "Configuration reloaded." << utils::ENDLINE;
+        io.out << "Configuration reloaded." << utils::ENDLINE;
     }
 
-    static void cd(const std::vector<std::string> & args) {
+    // $PWD from the environment when it is right, getcwd() otherwise
+    static void sync_pwd();
+
+    // path resolved against $PWD with . and .. removed, without following the symlinks
+    static std::string logical_path(const std::string & path);
+
+    static void cd(const std::vector<std::string> & args, BuiltinIO & io) {
         if (args.empty()) {
-            std::cerr << "cd: missing argument" << utils::ENDLINE;
+            io.err << "cd: missing argument" << utils::ENDLINE;
             return;
         }
-        std::string path = args[1];
+        const std::string & path = args[1];
         if (path.empty()) {
-            std::cerr << "cd: missing argument" << utils::ENDLINE;
+            io.err << "cd: missing argument" << utils::ENDLINE;
             return;
         }
 
-        if (chdir(path.c_str()) != 0) {
-            perror("cd");
+        // like cd -L of bash: .. drops the last component of $PWD, no getcwd() is needed for the prompt
+        const std::string target = SimpleShell::logical_path(path);
+        if (chdir(target.c_str()) != 0) {
+            io.err << "cd: " << path << ": " << strerror(errno) << utils::ENDLINE;
+            io.status = 1;
         } else {
-            path = std::string(getcwd(nullptr, 0));
-            instance->env_set("PWD", path, SimpleShell::variable_type::SL_VAR_GLOBAL);
+            instance->env_set("PWD", target, SimpleShell::variable_type::SL_VAR_GLOBAL);
+        }
+    }
+
+    static void batch(const std::vector<std::string> & args, BuiltinIO & io) {
+        ParallelRunner::Options options;
+        options.jobs     = 1;
+        size_t max_args  = 0;
+        size_t limit     = ArgBatcher::limit();
+        size_t i         = 1;
+        for (; i < args.size() && args[i].size() > 1 && args[i][0] == '-'; ++i) {
+            const std::string & arg = args[i];
+            if ((arg != "-j" && arg != "-n" && arg != "-s") || i + 1 == args.size()) {
+                io.err << "batch: invalid option: " << arg << utils::ENDLINE;
+                io.status = 1;
+                return;
+            }
+            size_t value = 0;
+            try {
+                value = std::stoul(args[++i]);
+            } catch (const std::exception &) {
+                io.err << "batch: " << arg << ": invalid number: " << args[i] << utils::ENDLINE;
+                io.status = 1;
+                return;
+            }
+            if (arg == "-j") {
+                const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                options.jobs    = value > 0 ? value : (cpus > 0 ? cpus : 1);
+            } else if (arg == "-n") {
+                max_args = value;
+            } else {
+                limit = std::min(limit, value);
+            }
+        }
+
+        std::vector<std::string> fixed;
+        std::vector<std::string> items;
+        bool                     has_items = false;
+        for (; i < args.size(); ++i) {
+            if (args[i] == ":::") {
+                items.assign(args.begin() + i + 1, args.end());
+                has_items = true;
+                break;
+            }
+            fixed.push_back(args[i]);
+        }
+        if (fixed.empty()) {
+            io.err << "batch: missing command" << utils::ENDLINE;
+            io.status = 1;
+            return;
+        }
+        if (!has_items) {
+            items = ParallelRunner::read_lines(io.in);
+        }
+
+        options.command_lines = ArgBatcher::split(fixed, items, limit, max_args);
+        instance->evaluate_pending_exports();
+        ParallelRunner runner(std::move(options), io);
+        // like xargs: 123 when any of the invocations failed
+        io.status = runner.run() == 0 ? 0 : 123;
+    }
+
+    static void parallel(const std::vector<std::string> & args, BuiltinIO & io) {
+        ParallelRunner::Options options;
+        std::string             error;
+        if (!ParallelRunner::parse(args, options, error)) {
+            io.err << "parallel: " << error << utils::ENDLINE;
+            io.status = 255;
+            return;
+        }
+        instance->evaluate_pending_exports();
+        ParallelRunner runner(std::move(options), io);
+        io.status = runner.run();
+    }
+
+    static void help(const std::vector<std::string> & args, BuiltinIO & io);
+    // like /usr/bin/time: one command, a builtin or an external one, the report goes to stderr
+    static void time(const std::vector<std::string> & args, BuiltinIO & io);
+    // an external command in a job with resource limits, in the background with &
+    static void limit(const std::vector<std::string> & args, BuiltinIO & io);
+    // limit with the limits and the placement of a policy of the [policies] section, no name lists them
+    static void policy(const std::vector<std::string> & args, BuiltinIO & io);
+    // the options of limit from args[index] on over the given limits, then the command
+    static void run_limited(const std::vector<std::string> & args, size_t index, Limits limits, BuiltinIO & io);
+    // jobs output [%N], jobs tail [-f] [%N]: the captured output of a background job
+    static void job_output(const std::vector<std::string> & args, BuiltinIO & io);
+    // the fds of a builtin (its redirections, its pipe) as redirections of a command it starts
+    static std::vector<Redirection> redirections_of(const BuiltinIO & io);
+
+    static void source(const std::vector<std::string> & args, BuiltinIO & io) {
+        if (args.size() < 2) {
+            io.err << args[0] << ": filename argument required" << utils::ENDLINE;
+            io.status = 2;
+            return;
+        }
+        struct stat st {};
+
+        if (stat(args[1].c_str(), &st) == -1) {
+            io.err << args[0] << ": " << args[1] << ": " << strerror(errno) << utils::ENDLINE;
+            io.status = 1;
+            return;
+        }
+        const auto program = instance->load_script(args[1], st, io.status);
+        if (program != nullptr) {
+            io.status = instance->execute_program(program, std::vector<std::string>(args.begin() + 2, args.end()));
         }
     }
 
-    static void echo(const std::vector<std::string> & args) {
+    static void echo(const std::vector<std::string> & args, BuiltinIO & io) {
         for (size_t i = 1; i < args.size(); ++i) {
-            std::cout << args[i] << (i == args.size() - 1 ? "" : " ");
+            io.out << args[i] << (i == args.size() - 1 ? "" : " ");
         }
-        std::cout << utils::ENDLINE;
+        io.out << utils::ENDLINE;
     }
 
-    static void alias(const std::vector<std::string> & args) {
+    static void alias(const std::vector<std::string> & args, BuiltinIO & io) {
         if (args.size() < 2 || args[1] == "list") {
             for (const auto & cfg : instance->config_get_section_variables("aliases")) {
-                std::cout << cfg.key << " = " << cfg.value << utils::ENDLINE;
+                io.out << cfg.key << " = " << cfg.value << utils::ENDLINE;
             }
             return;
         }
-        if (args.size() > 2 && args[1] == "add") {
-            instance->config_set_section_variable("aliases", args[2], args[3], true);
-            std::cout << "alias " << args[2] << " added" << utils::ENDLINE;
+        if (args.size() > 3 && args[1] == "add") {
+            // aliases add ll ls -la
+            std::string value = args[3];
+            for (size_t i = 4; i < args.size(); ++i) {
+                value += " " + args[i];
+            }
+            instance->config_set_section_variable("aliases", args[2], value, true);
+            io.out << "alias " << args[2] << " added" << utils::ENDLINE;
             return;
         }
         if (args.size() > 2 && args[1] == "delete") {
             if (instance->config_delete_section_variable("aliases", args[2])) {
-                std::cout << "alias " << args[2] << " deleted" << utils::ENDLINE;
+                io.out << "alias " << args[2] << " deleted" << utils::ENDLINE;
             } else {
-                std::cerr << "alias " << args[2] << " not found" << utils::ENDLINE;
+                io.err << "alias " << args[2] << " not found" << utils::ENDLINE;
             }
         }
     }
 
-    static void unalias(const std::vector<std::string> & args) {
+    static void unalias(const std::vector<std::string> & args, BuiltinIO & io) {
         if (args.size() < 2) {
-            std::cerr << "unalias: missing argument" << utils::ENDLINE;
+            io.err << "unalias: missing argument" << utils::ENDLINE;
             return;
         }
         if (instance->config_delete_section_variable("aliases", args[1])) {
-            std::cout << "alias " << args[1] << " deleted" << utils::ENDLINE;
+            io.out << "alias " << args[1] << " deleted" << utils::ENDLINE;
         } else {
-            std::cerr << "alias " << args[1] << " not found" << utils::ENDLINE;
+            io.err << "alias " << args[1] << " not found" << utils::ENDLINE;
         }
     }
 
-    static void bg(const std::vector<std::string> & args) {
+    static void bg(const std::vector<std::string> & args, BuiltinIO & io) {
         pid_t pid = ProcessManager::instance().process_get_latest_stopped_pid();
         if (args.size() == 2) {
-            {
-                pid = std::stoi(args[1]);
+            pid = ProcessManager::instance().process_get_job_pid(args[1]);
+            if (pid < 0) {
+                io.err << "bg: no such job: " << args[1] << utils::ENDLINE;
+                io.status = 1;
+                return;
             }
         }
         if (pid < 0) {
-            std::cout << "No stopped jobs.\n";
+            io.out << "No stopped jobs.\n";
             return;
         }
         ProcessManager::send_signal_to_process(pid, SIGCONT);
     }
 
-    static void fg(const std::vector<std::string> & args) {
+    static void fg(const std::vector<std::string> & args, BuiltinIO & io) {
         pid_t pid = ProcessManager::instance().process_get_latest_stopped_pid();
         if (args.size() == 2) {
-            {
-                pid = std::stoi(args[1]);
+            pid = ProcessManager::instance().process_get_job_pid(args[1]);
+            if (pid < 0) {
+                io.err << "fg: no such job: " << args[1] << utils::ENDLINE;
+                io.status = 1;
+                return;
             }
         }
         if (pid < 0) {
-            std::cout << "No stopped jobs.\n";
+            io.out << "No stopped jobs.\n";
             return;
         }
         ProcessManager::process_handle_foreground(pid, getpgrp());
     }
 
-    static void plugins(const std::vector<std::string> & args) {
+    static void wait(const std::vector<std::string> & args, BuiltinIO & io) {
+        bool               any        = false;
+        int                timeout_ms = -1;
+        std::vector<pid_t> jobs;
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (args[i] == "-n") {
+                any = true;
+            } else if (args[i] == "--timeout" && i + 1 < args.size()) {
+                try {
+                    timeout_ms = static_cast<int>(std::stod(args[++i]) * 1000);
+                } catch (const std::exception &) {
+                    io.err << "wait: --timeout: invalid number: " << args[i] << utils::ENDLINE;
+                    io.status = 2;
+                    return;
+                }
+            } else {
+                const pid_t pid = ProcessManager::instance().process_get_job_pid(args[i]);
+                if (pid < 0) {
+                    io.err << "wait: no such job: " << args[i] << utils::ENDLINE;
+                    io.status = 127;
+                    return;
+                }
+                jobs.push_back(pid);
+            }
+        }
+        // like bash: waiting for every job is 0, unless it was interrupted
+        const bool every_job = jobs.empty() && !any;
+        const auto deadline  = ProcessManager::Clock::now() + std::chrono::milliseconds(timeout_ms);
+        int        status    = 0;
+        // the queued jobs start while the running ones finish, every job waits for them too
+        for (bool first = true; first || every_job; first = false) {
+            if (jobs.empty()) {
+                for (const auto & process : ProcessManager::instance().snapshot()->jobs) {
+                    jobs.push_back(process.pid);
+                }
+            }
+            if (jobs.empty()) {
+                break;
+            }
+            const auto left =
+                std::chrono::duration_cast<std::chrono::milliseconds>(deadline - ProcessManager::Clock::now());
+            status = ProcessManager::instance().wait_jobs(jobs, any,
+                                                          timeout_ms < 0 ? -1 : std::max<int>(0, left.count()));
+            if (status == 124 || status == 128 + SIGINT) {
+                break;
+            }
+            jobs.clear();
+        }
+        io.status = every_job && status != 124 && status != 128 + SIGINT ? 0 : status;
+    }
+
+    static void plugins(const std::vector<std::string> & args, BuiltinIO & io) {
         if (args.size() < 2) {
-            std::cout << "Usage: plugins [list|enable|disable|reload]\n";
+            io.out << "Usage: plugins [list|enable|disable|reload]\n";
             return;
         }
-        auto * isntance = SimpleShell::instance;
+        auto * plugin_manager = SimpleShell::instance->plugins_get();
         if (args[1] == "list") {
-            for (const auto & plugin : instance->plugin_manager->getPlugins()) {
-                std::cout << "ID: " << plugin.first << "\t\t";
-                std::cout << "Name: " << plugin.second.displayName << '\t';
-                std::cout << "Status: " << (plugin.second.enabled ? "active" : "disabled") << utils::ENDLINE;
+            for (const auto & plugin : plugin_manager->getPlugins()) {
+                io.out << "ID: " << plugin.first << "\t\t";
+                io.out << "Name: " << plugin.second.displayName << '\t';
+                io.out << "Status: " << (plugin.second.enabled ? "active" : "disabled") << utils::ENDLINE;
                 if (plugin.second.description.empty()) {
-                    std::cout << "No description available.\n";
+                    io.out << "No description available.\n";
                 } else {
-                    std::cout << plugin.second.description << utils::ENDLINE;
+                    io.out << plugin.second.description << utils::ENDLINE;
                 }
-                std::cout << "-------------------------------------\n";
+                io.out << "-------------------------------------\n";
             }
             return;
         }
         if (args[1] == "enable" && args.size() == 3) {
-            instance->plugin_manager->enablePlugin(args[2]);
+            plugin_manager->enablePlugin(args[2]);
             instance->config_set_section_variable("plugins", args[2], "true");
             return;
         }
         if (args[1] == "disable" && args.size() == 3) {
-            instance->plugin_manager->disablePlugin(args[2]);
+            plugin_manager->disablePlugin(args[2]);
             instance->config_set_section_variable("plugins", args[2], "false");
             return;
         }
         if (args[1] == "reload" && args.size() == 2) {
-            instance->plugin_manager->loadPlugins(instance->config_get_plugins_enabled());
+            plugin_manager->loadPlugins(instance->config_get_plugins_enabled());
             return;
         }
     }
 
-    static void jobs(const std::vector<std::string> & args) {
-        const auto n_stopped = ProcessManager::instance().get_stopped_processes_count();
-        const auto n_running = ProcessManager::instance().get_running_processes_count();
-
-        std::cout << "Running processes: " << n_running << "\n";
-
-        if (n_running > 0) {
-            for (const auto & process : ProcessManager::instance().get_running_processes()) {
-                const std::string status = ProcessManager::statusToString(process.state);
-                std::cout << "PID: " << process.pid << " status: " << status << ", Command: " << process.command
-                          << "\n";
-            }
-        }
-
-        std::cout << "Stopped jobs: " << n_stopped << "\n";
-
-        if (n_stopped > 0) {
-            for (const auto & process : ProcessManager::instance().get_stopped_processes()) {
-                const std::string status = ProcessManager::statusToString(process.state);
-                std::cout << "PID: " << process.pid << " status: " << status << ", Command: " << process.command
-                          << "\n";
-            }
+    static void jobs(const std::vector<std::string> & args, BuiltinIO & io) {
+        if (args.size() > 1) {
+            SimpleShell::job_output(args, io);
+            return;
         }
-        std::cout << utils::ENDLINE;
-    }
-
-    [[nodiscard]] static std::string glob_files(const std::string & pattern, const std::string & base_path = "") {
-        std::cout << "Globbing: " << pattern << " Base path: " << base_path << utils::ENDLINE;
-        // glob struct resides on the stack
-        glob_t glob_result;
-        memset(&glob_result, 0, sizeof(glob_result));
-
-        // do the glob operation
-        int return_value = glob(pattern.c_str(), GLOB_TILDE, NULL, &glob_result);
-        if (return_value != 0) {
-            globfree(&glob_result);
-            return "";
-        }
-
-        // collect all the filenames into a std::list<std::string>
-        std::string filenames;
-        for (size_t i = 0; i < glob_result.gl_pathc; ++i) {
-            std::string p = glob_result.gl_pathv[i];
-            if (base_path.empty() == false) {
-                // remove the base_path from the p
-                if (p.find(base_path) == 0) {
-                    p = p.substr(base_path.size());
+        // one consistent view of the table, a job finishing meanwhile does not block or change it
+        const auto snapshot = ProcessManager::instance().snapshot();
+
+        for (const auto state : { ProcessManager::PM_PROC_STATE_RUNNING, ProcessManager::PM_PROC_STATE_STOPPED }) {
+            const bool running = state == ProcessManager::PM_PROC_STATE_RUNNING;
+            io.out << (running ? "Running processes: " : "Stopped jobs: ")
+                   << (running ? snapshot->running : snapshot->stopped) << "\n";
+            for (const auto & process : snapshot->jobs) {
+                if (process.state != state) {
+                    continue;
                 }
+                const auto usage = ProcessManager::live_usage(process);
+                char       columns[128];
+                snprintf(columns, sizeof(columns), "elapsed: %.1fs, cpu: %.2fs, rss: %ld KiB", usage.wall,
+                         usage.user + usage.sys, usage.max_rss);
+                io.out << "[" << process.job_id << "] PID: " << process.pid
+                       << " status: " << ProcessManager::statusToString(process.state) << ", " << columns
+                       << ", Command: " << process.command << "\n";
             }
-            filenames.append(utils::ConfigUtils::escape(p));
-            filenames.append(" ");
         }
-        filenames = filenames.substr(0, filenames.size() - 1);
-        // cleanup
-        globfree(&glob_result);
-        std::cout << "Filenames: " << filenames << utils::ENDLINE;
-        // done
-        return filenames;
+        io.out << "Queued jobs: " << snapshot->queued.size() << "\n";
+        for (const auto & job : snapshot->queued) {
+            const double waiting = std::chrono::duration<double>(ProcessManager::Clock::now() - job.queued).count();
+            char         columns[64];
+            snprintf(columns, sizeof(columns), "priority: %d, waiting: %.1fs", job.priority, waiting);
+            io.out << "[" << job.job_id << "] status: queued, " << columns << ", Command: " << job.command << "\n";
+        }
+        io.out << utils::ENDLINE;
     }
 };
 
+struct SimpleShell::Builtins {
+    using ArgSpec = builtins::ArgSpec;
+    using ArgKind = builtins::ArgKind;
+
+    static constexpr ArgSpec cd_args[]       = {
+        { "directory", ArgKind::AK_DIRECTORY, false, false, "The new working directory" },
+    };
+    static constexpr ArgSpec echo_args[]     = {
+        { "text", ArgKind::AK_WORD, true, true, "The words to print" },
+    };
+    static constexpr ArgSpec job_args[]      = {
+        { "job_id", ArgKind::AK_JOB, true, false, "The job, a pid or %N, the last stopped job when omitted" },
+    };
+    static constexpr ArgSpec jobs_args[]     = {
+        { "output|tail", ArgKind::AK_KEYWORD, true, false, "Print the captured output of a background job"  },
+        { "-f",          ArgKind::AK_WORD,    true, false, "tail: follow the output till the job closes it" },
+        { "job_id",      ArgKind::AK_JOB,     true, false, "The job, %N or a pid, the newest one by default" },
+    };
+    static constexpr ArgSpec wait_args[]     = {
+        { "-n",          ArgKind::AK_WORD,   true, false, "Return when the first of the jobs finished"      },
+        { "--timeout S", ArgKind::AK_NUMBER, true, false, "Give up after S seconds, the status is then 124" },
+        { "job_id",      ArgKind::AK_JOB,    true, true,  "The jobs, pids or %N, every job when omitted"    },
+    };
+    static constexpr ArgSpec time_args[]     = {
+        { "command",   ArgKind::AK_COMMAND, false, false, "The command to time"     },
+        { "arguments", ArgKind::AK_WORD,    true,  true,  "The arguments of it"     },
+    };
+    static constexpr ArgSpec limit_args[]    = {
+        { "--mem SIZE",   ArgKind::AK_WORD,    true,  false, "Memory of the job, like 512M or 2G"             },
+        { "--cpu N%",     ArgKind::AK_WORD,    true,  false, "CPU share of the job, 200% is two CPUs"         },
+        { "--nofile N",   ArgKind::AK_NUMBER,  true,  false, "Open files of every process"                    },
+        { "--nproc N",    ArgKind::AK_NUMBER,  true,  false, "Processes of the user, counted by the kernel"    },
+        { "--cpu-time S", ArgKind::AK_NUMBER,  true,  false, "CPU seconds of every process"                   },
+        { "--nice N",     ArgKind::AK_NUMBER,  true,  false, "Nice and I/O priority, the order in the queue"  },
+        { "--cpus LIST",  ArgKind::AK_WORD,    true,  false, "CPUs of every process, like 4-15 or 0,2"        },
+        { "--io CLASS",   ArgKind::AK_WORD,    true,  false, "I/O class: idle, be[:0-7] or rt[:0-7]"          },
+        { "command",      ArgKind::AK_COMMAND, false, false, "The command to run"                             },
+        { "arguments",    ArgKind::AK_WORD,    true,  true,  "The arguments of it"                            },
+    };
+    static constexpr ArgSpec policy_args[]   = {
+        { "name",         ArgKind::AK_WORD,    true,  false, "A policy of the [policies] section, none lists them" },
+        { "--option V",   ArgKind::AK_WORD,    true,  true,  "The options of limit, over the policy"                },
+        { "command",      ArgKind::AK_COMMAND, true,  false, "The command to run"                                  },
+        { "arguments",    ArgKind::AK_WORD,    true,  true,  "The arguments of it"                                 },
+    };
+    static constexpr ArgSpec source_args[]   = {
+        { "file",      ArgKind::AK_FILE, false, false, "The script to run in the current shell" },
+        { "arguments", ArgKind::AK_WORD, true,  true,  "The positional parameters of the script" },
+    };
+    static constexpr ArgSpec plugins_args[]  = {
+        { "list|enable|disable|reload", ArgKind::AK_KEYWORD, false, false, "The action"                 },
+        { "plugin_id",                  ArgKind::AK_PLUGIN,  true,  false, "The plugin of enable/disable" },
+    };
+    static constexpr ArgSpec aliases_args[]  = {
+        { "list|add|delete", ArgKind::AK_KEYWORD, true, false, "The action, list when omitted" },
+        { "alias_name",      ArgKind::AK_ALIAS,   true, false, "The alias of add/delete"       },
+        { "command",         ArgKind::AK_COMMAND, true, true,  "The value of add"              },
+    };
+    static constexpr ArgSpec unalias_args[]  = {
+        { "alias_name", ArgKind::AK_ALIAS, false, false, "The alias to delete" },
+    };
+    static constexpr ArgSpec help_args[]     = {
+        { "builtin", ArgKind::AK_COMMAND, true, false, "Show the usage of this builtin" },
+    };
+    static constexpr ArgSpec parallel_args[] = {
+        { "-j N",                      ArgKind::AK_NUMBER,  true,  false, "Number of jobs in flight, the number of CPUs by default" },
+        { "-k",                        ArgKind::AK_WORD,    true,  false, "Print the output of the jobs in the order of the inputs"  },
+        { "-g",                        ArgKind::AK_WORD,    true,  false, "Print the output of a job at once when it finished"       },
+        { "command",                   ArgKind::AK_COMMAND, false, false, "The command, {} is replaced with the input"               },
+        { "::: inputs",                ArgKind::AK_WORD,    true,  true,  "The inputs, the lines of the standard input without it"   },
+    };
+    static constexpr ArgSpec batch_args[]    = {
+        { "-j N",         ArgKind::AK_NUMBER,  true,  false, "Number of batches in flight, 1 by default, 0 for the CPUs" },
+        { "-n N",         ArgKind::AK_NUMBER,  true,  false, "At most N arguments per batch"                             },
+        { "-s bytes",     ArgKind::AK_NUMBER,  true,  false, "At most this size per command line"                        },
+        { "command",      ArgKind::AK_COMMAND, false, false, "The command and its fixed arguments"                       },
+        { "::: arguments", ArgKind::AK_WORD,   true,  true,  "The arguments, the lines of the standard input without it" },
+    };
+
+    // clang-format off
+    static constexpr builtins::Registry<19> registry{ std::array<builtins::Spec, 19>{ {
+        { "cd",            "Change current directory",                         cd_args,       SimpleShell::cd            },
+        { "echo",          "Print out a string",                               echo_args,     SimpleShell::echo          },
+        { "env",           "Print out the environment variables",              echo_args,     SimpleShell::echo          },
+        { "jobs",          "Show jobs or the captured output of one",          jobs_args,     SimpleShell::jobs,     true },
+        { "bg",            "Send to the background a job",                     job_args,      SimpleShell::bg            },
+        { "fg",            "Bring back to the foreground a job",               job_args,      SimpleShell::fg            },
+        { "wait",          "Wait for jobs to finish, the status is the one of the last job",
+                                                                               wait_args,     SimpleShell::wait,     true },
+        { "batch",         "Run a command with the arguments packed into the fewest command lines",
+                                                                               batch_args,    SimpleShell::batch,    true },
+        { "parallel",      "Run a command for every input in parallel",        parallel_args, SimpleShell::parallel, true },
+        { "time",          "Run a command and report its time and resources",  time_args,     SimpleShell::time,     true },
+        { "limit",         "Run a command with limits, in a cgroup of its own when possible",
+                                                                               limit_args,    SimpleShell::limit,    true },
+        { "policy",        "Run a command with a placement policy of the configuration",
+                                                                               policy_args,   SimpleShell::policy,   true },
+        { "source",        "Run the commands of a file in the current shell",  source_args,   SimpleShell::source        },
+        { ".",             "Same as source",                                   source_args,   SimpleShell::source        },
+        { "plugins",       "Manage the plugins",                               plugins_args,  SimpleShell::plugins       },
+        { "aliases",       "Manage the aliases",                               aliases_args,  SimpleShell::alias         },
+        { "unalias",       "Delete an alias",                                  unalias_args,  SimpleShell::unalias       },
+        { "reload_config", "Re-read the configuration file and reload it's contents. WARN: all not saved changes will be lost",
+                                                                               {},            SimpleShell::reload_config },
+        { "help",          "List the builtins or show the usage of one",       help_args,     SimpleShell::help          },
+    } } };
+    // clang-format on
+};
+
 #endif  // SIMPLE_SHELL_HPP
@@ -0,0 +1,246 @@
+#ifndef TREE_WALKER_HPP
+#define TREE_WALKER_HPP
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+/**
+ * The directory walk of **, spread over a small work-stealing pool: every worker has its own deque, takes the
+ * newest directory from its back (depth first, few open directories) and steals the oldest one from the others
+ * when it runs dry. The calling thread walks alone first, the pool is started only when more than
+ * PARALLEL_THRESHOLD directories are waiting; a small tree does not pay for the threads. A subdirectory is opened with openat() relative to the fd of its parent, which stays open
+ * until its last child was opened; the kernel never resolves a full path. Symlinks to directories are not
+ * followed, like the globstar of bash. The results come unsorted, in the order the workers found them.
+ */
+class TreeWalker {
+  public:
+    enum Mode : std::uint8_t {
+        // every directory under the roots, the roots included, with a trailing /
+        WALK_DIRECTORIES,
+        // every file and directory under the roots
+        WALK_ALL,
+        // the entries of the roots and of every directory under them whose name matches the filter
+        WALK_FILTER,
+    };
+
+    // the filter is the last component of a pattern like **/*.cpp, it is called from the workers
+    using Filter = bool (*)(std::string_view pattern, std::string_view name, bool dotglob);
+
+    TreeWalker(Mode mode, bool dotglob, Filter filter = nullptr, std::string_view pattern = {}) :
+        mode_(mode),
+        dotglob_(dotglob),
+        filter_(filter),
+        pattern_(pattern) {}
+
+    // the roots are "" (the current directory) or paths ending with /, the results start with their root
+    std::vector<std::string> walk(const std::vector<std::string> & roots) {
+        const unsigned cpus    = std::thread::hardware_concurrency();
+        const size_t   threads = cpus == 0 ? 1 : std::min<size_t>(cpus, MAX_THREADS);
+        workers_.clear();
+        pool_.clear();
+        for (size_t i = 0; i < threads; ++i) {
+            workers_.push_back(std::make_unique<Worker>());
+        }
+        for (const auto & root : roots) {
+            if (mode_ == WALK_DIRECTORIES || (mode_ == WALK_ALL && !root.empty())) {
+                workers_[0]->results.push_back(root);
+            }
+            this->push(*workers_[0], Task{ nullptr, root.empty() ? "." : root, root });
+        }
+
+        // the other workers are started by run(0) when the walk turns out to be large
+        this->run(0);
+        for (auto & thread : pool_) {
+            thread.join();
+        }
+
+        std::vector<std::string> results;
+        for (auto & worker : workers_) {
+            results.insert(results.end(), std::make_move_iterator(worker->results.begin()),
+                           std::make_move_iterator(worker->results.end()));
+        }
+        return results;
+    }
+
+  private:
+    static constexpr size_t MAX_THREADS        = 8;
+    // directories waiting in the deque of the calling thread before the pool is started
+    static constexpr size_t PARALLEL_THRESHOLD = 64;
+
+    struct Directory {
+        int fd = -1;
+
+        explicit Directory(int fd) : fd(fd) {}
+
+        ~Directory() { close(fd); }
+    };
+
+    struct Task {
+        // the open parent, nullptr for a root
+        std::shared_ptr<Directory> parent;
+        std::string                name;
+        // the output path of the directory, with a trailing /
+        std::string                path;
+    };
+
+    struct Worker {
+        std::mutex               mutex;
+        std::deque<Task>         tasks;
+        std::vector<std::string> results;
+    };
+
+    struct linux_dirent64 {
+        std::uint64_t  d_ino;
+        std::int64_t   d_off;
+        unsigned short d_reclen;
+        unsigned char  d_type;
+        char           d_name[];
+    };
+
+    Mode                                 mode_;
+    bool                                 dotglob_;
+    Filter                               filter_;
+    std::string_view                     pattern_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    // the threads of the workers 1.., started once by the calling thread
+    std::vector<std::thread>             pool_;
+    // tasks queued or running, the walk is over when it drops to 0
+    std::atomic<size_t>                  pending_{ 0 };
+    std::atomic<size_t>                  queued_{ 0 };
+    std::atomic<size_t>                  idle_{ 0 };
+    std::mutex                           idle_mutex_;
+    std::condition_variable              idle_cv_;
+
+    void push(Worker & worker, Task task) {
+        ++pending_;
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.tasks.push_back(std::move(task));
+        }
+        ++queued_;
+        if (idle_ > 0) {
+            std::lock_guard<std::mutex> lock(idle_mutex_);
+            idle_cv_.notify_one();
+        }
+    }
+
+    bool pop(size_t self, Task & task) {
+        {
+            Worker &                    own = *workers_[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                --queued_;
+                return true;
+            }
+        }
+        for (size_t i = 1; i < workers_.size(); ++i) {
+            Worker &                    victim = *workers_[(self + i) % workers_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                --queued_;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(size_t self) {
+        while (true) {
+            Task task;
+            if (this->pop(self, task)) {
+                this->visit(self, task);
+                task.parent.reset();
+                if (self == 0 && pool_.empty() && workers_.size() > 1 && queued_ > PARALLEL_THRESHOLD) {
+                    for (size_t i = 1; i < workers_.size(); ++i) {
+                        pool_.emplace_back(&TreeWalker::run, this, i);
+                    }
+                }
+                if (--pending_ == 0) {
+                    std::lock_guard<std::mutex> lock(idle_mutex_);
+                    idle_cv_.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(idle_mutex_);
+            ++idle_;
+            idle_cv_.wait(lock, [this] { return pending_ == 0 || queued_ > 0; });
+            --idle_;
+            if (pending_ == 0) {
+                return;
+            }
+        }
+    }
+
+    void visit(size_t self, const Task & task) {
+        Worker &  worker = *workers_[self];
+        const int fd     = openat(task.parent != nullptr ? task.parent->fd : AT_FDCWD, task.name.c_str(),
+                                  O_RDONLY | O_DIRECTORY | O_CLOEXEC | (task.parent != nullptr ? O_NOFOLLOW : 0));
+        if (fd == -1) {
+            return;
+        }
+        const auto directory = std::make_shared<Directory>(fd);
+
+        alignas(linux_dirent64) char buffer[32768];
+        while (true) {
+            const long size = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+            if (size <= 0) {
+                break;
+            }
+            for (long offset = 0; offset < size;) {
+                const auto *           entry = reinterpret_cast<const linux_dirent64 *>(buffer + offset);
+                const std::string_view name(entry->d_name);
+                offset += entry->d_reclen;
+
+                if (name == "." || name == "..") {
+                    continue;
+                }
+                // the filter decides about hidden names itself (**/.gitignore), the walk does not enter them
+                if (mode_ == WALK_FILTER && filter_(pattern_, name, dotglob_)) {
+                    worker.results.push_back(task.path + std::string(name));
+                }
+                if (!dotglob_ && name[0] == '.') {
+                    continue;
+                }
+                bool is_directory = entry->d_type == DT_DIR;
+                if (entry->d_type == DT_UNKNOWN) {
+                    struct stat st {};
+
+                    is_directory = fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+                }
+
+                if (mode_ == WALK_ALL) {
+                    worker.results.push_back(task.path + std::string(name));
+                }
+                if (!is_directory) {
+                    continue;
+                }
+                std::string path = task.path + std::string(name) + "/";
+                if (mode_ == WALK_DIRECTORIES) {
+                    worker.results.push_back(path);
+                }
+                this->push(worker, Task{ directory, std::string(name), std::move(path) });
+            }
+        }
+    }
+};
+
+#endif  // TREE_WALKER_HPP
@@ -7,32 +7,19 @@
 #include "SimpleShell.hpp"
 
 int main(int argc, char * argv[]) {
-    setpgid(0, 0);
-    tcsetpgrp(STDIN_FILENO, getpgrp());
-    tcsetpgrp(STDOUT_FILENO, getpgrp());
-    tcsetpgrp(STDERR_FILENO, getpgrp());
-
-    signal(SIGINT, SIG_IGN);
-    signal(SIGTSTP, SIG_IGN);
-    signal(SIGQUIT, SIG_IGN);
-    signal(SIGTTOU, SIG_IGN);
-    signal(SIGTTIN, SIG_IGN);
-
-    SimpleShell shell;
-    signal(SIGINT, SimpleShell::signal_handler_wrapper);
-    signal(SIGTSTP, SimpleShell::signal_handler_wrapper);
-    signal(SIGCHLD, SimpleShell::signal_handler_wrapper);
-    signal(SIGWINCH, SimpleShell::signal_handler_wrapper);
-
     std::vector<std::string> params = {};
     std::string              runnable;
+    std::string              command_string;
+    bool                     has_command_string = false;
     if (argc > 1) {
         std::string arg = argv[1];
         if (arg == "--help") {
-            std::cout << "Usage: " << argv[0] << " [OPTION]...\n"
+            std::cout << "Usage: " << argv[0] << " [OPTION]... [SCRIPT [ARG]...]\n"
                       << "Simple shell\n\n"
+                      << "  -c COMMAND     run COMMAND and exit, the following arguments are ${0}, ${1}...\n"
                       << "  -h, --help     display this help and exit\n"
                       << "  -v, --version  output version information and exit\n"
+                      << "\nWithout a script and with a redirected standard input the commands are read from it.\n"
                       << utils::ENDLINE;
             return 0;
         }
@@ -45,12 +32,70 @@ int main(int argc, char * argv[]) {
                       << utils::ENDLINE;
             return 0;
         }
-        runnable = arg[1];
-        for (int i = 2; i < argc; ++i) {
-            params.push_back(argv[i]);
+        if (arg == "-c") {
+            if (argc < 3) {
+                std::cerr << argv[0] << ": -c: option requires an argument" << utils::ENDLINE;
+                return 2;
+            }
+            has_command_string = true;
+            command_string     = argv[2];
+            runnable           = argc > 3 ? argv[3] : argv[0];
+            for (int i = 4; i < argc; ++i) {
+                params.push_back(argv[i]);
+            }
+        } else {
+            runnable = arg;
+            for (int i = 2; i < argc; ++i) {
+                params.push_back(argv[i]);
+            }
         }
     }
 
-    shell.run(runnable, params);
+    // -c, scripts and piped input skip every interactive setup: terminal, fork server, history, completion
+    const bool interactive = !has_command_string && (runnable.empty() || runnable == "-") && isatty(STDIN_FILENO);
+
+    if (interactive) {
+        setpgid(0, 0);
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+        tcsetpgrp(STDOUT_FILENO, getpgrp());
+        tcsetpgrp(STDERR_FILENO, getpgrp());
+    }
+
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    // builtins write into pipes from the shell process, a closed reader must not kill the shell
+    signal(SIGPIPE, SIG_IGN);
+
+    // the helper has to be forked while the shell is still small, before the Lua state and the indexes exist
+    const char * home = getenv("HOME");
+    if (interactive && home != nullptr && ForkServer::enabled_in_config(std::string(home) + "/.pshell")) {
+        ForkServer::instance().start();
+    }
+
+    // the interactive shell reads its signals from a signalfd, they are blocked before any thread is started
+    if (interactive && !EventLoop::instance().open({ SIGINT, SIGTSTP, SIGCHLD, SIGWINCH })) {
+        return 1;
+    }
+    if (!interactive) {
+        signal(SIGINT, SimpleShell::signal_handler_wrapper);
+        signal(SIGTSTP, SimpleShell::signal_handler_wrapper);
+        signal(SIGCHLD, SimpleShell::signal_handler_wrapper);
+    }
+
+    SimpleShell shell;
+
+    if (has_command_string) {
+        return shell.run_source(command_string, runnable, params);
+    }
+    if (!runnable.empty() && runnable != "-") {
+        return shell.run_script(runnable, params);
+    }
+    if (!interactive) {
+        return shell.run_stream(STDIN_FILENO, argv[0], params);
+    }
+    shell.run();
     return 0;
 }
@@ -2,7 +2,9 @@
 #define SIMPLESHELL_UTILS_H
 #include <unistd.h>
 
+#include <cerrno>
 #include <filesystem>
+#include <streambuf>
 #include <string>
 #include <vector>
 
@@ -175,10 +177,66 @@ class ConfigUtils {
     }
 };
 
-static void parse_arguments(const std::string & command, std::vector<std::string> & args) {
+// buffered std::streambuf writing to a raw file descriptor, the fd is not owned
+class FdStreamBuf : public std::streambuf {
+  public:
+    explicit FdStreamBuf(int fd) : fd_(fd) { setp(buffer_, buffer_ + sizeof(buffer_)); }
+
+    ~FdStreamBuf() override { this->flush_buffer(); }
+
+    FdStreamBuf(const FdStreamBuf &)             = delete;
+    FdStreamBuf & operator=(const FdStreamBuf &) = delete;
+
+  protected:
+    int_type overflow(int_type ch) override {
+        if (this->flush_buffer() == -1) {
+            return traits_type::eof();
+        }
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    int sync() override { return this->flush_buffer(); }
+
+  private:
+    int  fd_;
+    char buffer_[4096];
+
+    int flush_buffer() {
+        const char * p    = pbase();
+        size_t       size = pptr() - pbase();
+        while (size > 0) {
+            const ssize_t n = write(fd_, p, size);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                // the reader is gone (EPIPE) or the fd is closed, drop the rest
+                setp(buffer_, buffer_ + sizeof(buffer_));
+                return -1;
+            }
+            p += n;
+            size -= n;
+        }
+        setp(buffer_, buffer_ + sizeof(buffer_));
+        return 0;
+    }
+};
+
+// quoted_args gets one flag per argument, set when a part of it was quoted: "> file" and ">" are words, not operators
+inline void parse_arguments(const std::string & command, std::vector<std::string> & args,
+                            std::vector<bool> * quoted_args = nullptr) {
     args.clear();
+    if (quoted_args != nullptr) {
+        quoted_args->clear();
+    }
     std::string current_arg;
     bool        in_quotes  = false;
+    // "" is an empty argument, test "$EMPTY" = x needs it
+    bool        quoted     = false;
     char        quote_char = 0;
 
     for (size_t i = 0; i < command.length(); ++i) {
@@ -186,23 +244,63 @@ static void parse_arguments(const std::string & command, std::vector<std::string
 
         if ((c == '"' || c == '\'') && !in_quotes) {
             in_quotes  = true;
+            quoted     = true;
             quote_char = c;
         } else if (c == quote_char && in_quotes) {
             in_quotes = false;
         } else if (std::isspace(c) && !in_quotes) {
-            if (!current_arg.empty()) {
+            if (!current_arg.empty() || quoted) {
                 args.push_back(current_arg);
                 current_arg.clear();
+                if (quoted_args != nullptr) {
+                    quoted_args->push_back(quoted);
+                }
             }
+            quoted = false;
         } else {
             current_arg += c;
         }
     }
 
-    if (!current_arg.empty()) {
+    if (!current_arg.empty() || quoted) {
         args.push_back(current_arg);
+        if (quoted_args != nullptr) {
+            quoted_args->push_back(quoted);
+        }
     }
 }
 
+// split a command line into pipeline stages at unquoted '|' characters, "||" is left untouched
+inline std::vector<std::string> split_pipeline(const std::string & command) {
+    std::vector<std::string> stages;
+    std::string              current_stage;
+    bool                     in_quotes  = false;
+    char                     quote_char = 0;
+
+    for (size_t i = 0; i < command.length(); ++i) {
+        char c = command[i];
+
+        if ((c == '"' || c == '\'') && !in_quotes) {
+            in_quotes  = true;
+            quote_char = c;
+        } else if (c == quote_char && in_quotes) {
+            in_quotes = false;
+        } else if (c == '|' && !in_quotes) {
+            if (i + 1 < command.length() && command[i + 1] == '|') {
+                current_stage += "||";
+                ++i;
+                continue;
+            }
+            stages.push_back(current_stage);
+            current_stage.clear();
+            continue;
+        }
+        current_stage += c;
+    }
+    stages.push_back(current_stage);
+
+    return stages;
+}
+
 };  // namespace utils
 #endif
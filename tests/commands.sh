@@ -0,0 +1,153 @@
+#!/bin/bash
+# Runs command lines with simpleshell -c and compares their output (stdout, stderr and the exit status) with the
+# expected one: the redirections, the aliases, the invalidation of the cached command lines and the globs.
+# usage: tests/commands.sh <path to simpleshell>
+
+SHELL_BIN=$(realpath "${1:?usage: $0 <path to simpleshell>}")
+WORK=$(mktemp -d /tmp/simpleshell-test.XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+
+export HOME=$WORK XDG_CACHE_HOME=$WORK/cache
+cat >"$WORK/.pshell" <<'EOF'
+[aliases]
+say = echo said
+ll = say long
+q = echo "a  b"
+expr = expr 1 +
+loop1 = loop2 one
+loop2 = loop1 two
+EOF
+mkdir "$WORK/run"
+# the same command in two directories of PATH
+for n in 1 2; do
+    mkdir "$WORK/tools$n"
+    printf '#!/bin/sh\necho tool %s\n' "$n" >"$WORK/tools$n/tool"
+    chmod +x "$WORK/tools$n/tool"
+done
+export TOOLS1=$WORK/tools1 TOOLS2=$WORK/tools2 CACHED=1
+failed=0
+
+# check NAME EXPECTED COMMAND, the command runs in an empty directory of its own
+check() {
+    local name=$1 expected=$2 command=$3 actual
+    mkdir "$WORK/run/$name"
+    actual=$(cd "$WORK/run/$name" && "$SHELL_BIN" -c "$command" 2>&1; echo "status $?")
+    if [ "$actual" = "$expected" ]; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name"
+        diff <(echo "$expected") <(echo "$actual") | sed 's/^/     /'
+        failed=$((failed + 1))
+    fi
+}
+
+check redirect_output 'a
+b
+status 0' 'echo a > f; echo b >> f; cat < f'
+
+check redirect_stderr 'out
+err
+status 0' 'sh -c "echo out; echo err >&2" > o 2> e; cat o e'
+
+check redirect_both 'out
+err
+status 0' 'sh -c "echo out; echo err >&2" &> both; cat both'
+
+check redirect_dup 'ERR
+status 0' 'sh -c "echo err >&2" 2>&1 | tr a-z A-Z'
+
+check quoted_operators '> q1 2>&1 &> q2 >q3 a>b
+done
+status 0' 'echo ">" q1 "2>&1" "&>" q2 ">q3" a">"b; for f in q1 q2 q3 b; do test -e $f && echo created $f; done; echo done'
+
+check quoted_background 'a &
+status 0' 'echo a "&"'
+
+check missing_target "syntax error near unexpected token \`newline'
+status 2" 'echo >'
+
+check alias 'said hi
+status 0' 'say hi'
+
+check alias_of_alias 'said long x
+status 0' 'll x'
+
+check alias_quoted_value 'a  b c
+status 0' 'q c'
+
+# the alias of a command of the same name expands once
+check alias_self '3
+status 0' 'expr 2'
+
+# loop1 -> loop2 one -> loop1 two one, loop1 is not expanded again
+check alias_cycle 'loop1: No such file or directory
+status 127' 'loop1 x'
+
+# the loops run the same line twice, the second run must see the change
+check cache_variable '1
+2
+status 0' 'for i in 1 2; do echo ${CACHED}; CACHED=2; done'
+
+check cache_path 'tool 1
+tool 2
+status 0' 'PATH=${TOOLS1}:${PATH}; for i in 1 2; do tool; PATH=${TOOLS2}:${PATH}; done'
+
+check cache_pwd "$WORK/run/cache_pwd/a
+$WORK/run/cache_pwd/b
+status 0" 'mkdir a b; for d in a b; do cd $d; echo ${PWD}; cd ..; done'
+
+check cache_home "$WORK
+/tmp
+status 0" 'for i in 1 2; do echo ${HOME}; HOME=/tmp; done'
+
+check cache_alias 'one
+two
+status 0' 'aliases add greet echo one > /dev/null; for i in 1 2; do greet; aliases add greet echo two > /dev/null; done'
+
+# the files the glob cases match
+TREE='mkdir -p src/a/b src/.hidden; touch src/x.cpp src/y.hpp "src/sp ace.cpp" src/a/y.cpp src/a/b/z.cpp src/.hidden/h.cpp'
+
+check glob_star 'src/sp ace.cpp src/x.cpp
+status 0' "$TREE; echo src/*.cpp"
+
+check glob_one_argument '[src/sp ace.cpp]
+[src/x.cpp]
+status 0' "$TREE; for f in src/*.cpp; do echo \"[\$f]\"; done"
+
+check glob_class 'src/x.cpp src/y.hpp src/x.cpp
+status 0' "$TREE; echo src/[x-y].?pp src/[!a-w].cpp"
+
+check glob_no_match 'src/*.c nomatch*
+status 0' "$TREE; echo src/*.c nomatch*"
+
+# the quoted glob characters are literal even when files match
+check glob_quoted 'src/*.cpp src/?.cpp src/[x-y].?pp src/x.cpp
+status 0' "$TREE; echo \"src/*.cpp\" 'src/?.cpp' \"src/[x-y].?pp\" src/[x].cpp"
+
+check glob_quoted_for '[src/*.cpp]
+status 0' "$TREE; for f in \"src/*.cpp\"; do echo \"[\$f]\"; done"
+
+check glob_recursive 'src/a/b/z.cpp src/a/y.cpp src/sp ace.cpp src/x.cpp
+status 0' "$TREE; echo src/**/*.cpp"
+
+check glob_recursive_dirs 'src/a/b/z.cpp
+status 0' "$TREE; echo **/b/*.cpp"
+
+check brace_product 'a1 a2 a3 b1 b2 b3
+status 0' 'echo {a,b}{1..3}'
+
+check brace_sequence '01 04 07 10 a b c d e 3 2 1
+status 0' 'echo {01..10..3} {a..e} {3..1}'
+
+# a brace makes words whether the files exist or not, a glob in it matches
+check brace_glob 'src/a/y.cpp src/x.cpp src/y.cpp src/y.hpp
+status 0' "$TREE; echo src/{a/*,x}.cpp src/y.{c,h}pp"
+
+# a quoted word is not expanded, the programs of awk, find and sed have braces with commas
+check brace_quoted "{a,b} {1..3} a b
+status 0" "echo '{a,b}' \"{1..3}\" {a,b}"
+
+check brace_awk_program 'y x
+status 0' "echo 'x y' | awk '{print \$2,\$1}'"
+
+[ "$failed" = 0 ] || { echo "$failed failed"; exit 1; }
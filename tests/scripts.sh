@@ -0,0 +1,164 @@
+#!/bin/bash
+# Runs small scripts with simpleshell and compares their output (stdout, stderr and the exit status) with the
+# expected one: the parser, the bytecode compiler and the VM of the control flow, $((...)) and the syntax errors.
+# usage: tests/scripts.sh <path to simpleshell>
+
+SHELL_BIN=$(realpath "${1:?usage: $0 <path to simpleshell>}")
+WORK=$(mktemp -d /tmp/simpleshell-test.XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+
+# a configuration and a script cache of their own
+export HOME=$WORK XDG_CACHE_HOME=$WORK/cache
+: >"$WORK/.pshell"
+failed=0
+
+# check NAME EXPECTED [arguments of the script], the script comes on stdin
+check() {
+    local name=$1 expected=$2 actual
+    shift 2
+    cat >"$WORK/$name.sh"
+    actual=$(cd "$WORK" && "$SHELL_BIN" "$name.sh" "$@" 2>&1; echo "status $?")
+    if [ "$actual" = "$expected" ]; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name"
+        diff <(echo "$expected") <(echo "$actual") | sed 's/^/     /'
+        failed=$((failed + 1))
+    fi
+}
+
+check if_elif_else 'one
+two
+other
+status 0' <<'EOF'
+for n in 1 2 3; do
+    if [ $n = 1 ]; then
+        echo one
+    elif [ $n = 2 ]; then
+        echo two
+    else
+        echo other
+    fi
+done
+EOF
+
+check while_until 'while 1
+while 3
+while 4
+until 4
+until 2
+until 1
+until 0
+status 0' <<'EOF'
+i=0
+while true; do
+    i=$((i + 1))
+    if [ $i = 2 ]; then continue; fi
+    if [ $i = 5 ]; then break; fi
+    echo while $i
+done
+until [ $i = 0 ]; do
+    i=$((i - 1))
+    if [ $i = 3 ]; then continue; fi
+    echo until $i
+done
+EOF
+
+check for_arguments '[p]
+[q r]
+[]
+count 3
+status 0' p 'q r' '' <<'EOF'
+for arg in "$@"; do
+    echo "[$arg]"
+done
+echo count $#
+EOF
+
+check case_globs 'c file
+header
+header
+other x
+status 0' <<'EOF'
+for w in foo.c bar.h baz.hpp x; do
+    case $w in
+        *.c) echo c file;;
+        *.h|*.hpp) echo header;;
+        *) echo other $w;;
+    esac
+done
+EOF
+
+check function_return 'in f x
+status 3
+yes
+no
+status 1' <<'EOF'
+f() {
+    echo in f $1
+    return 3
+}
+f x
+echo status $?
+g() { if [ "$1" = y ]; then return 0; fi; return 1; }
+g y && echo yes
+g n || echo no
+g n
+EOF
+
+check special_parameters 'status 1 1 2
+a b
+status 0' a b <<'EOF'
+false
+echo status $? ${?} ${#}
+echo ${@}
+EOF
+
+check arithmetic '14 3 2 -9
+1 0
+7
+status 0' <<'EOF'
+i=2
+echo $((2 + 3 * 4)) $((17 / 5)) $((17 % 5)) $(((1 + 2) * -3))
+echo $((i < 3)) $((i > 3))
+i=$((i * 3 + 1))
+echo $i
+EOF
+
+check division_by_zero '1 / 0: division by 0
+0
+5 % 0: division by 0
+0
+status 0' <<'EOF'
+echo $((1 / 0))
+echo $((5 % 0))
+EOF
+
+check missing_fi "missing_fi.sh: line 3: syntax error near unexpected token \`end of file'
+status 2" <<'EOF'
+if true; then
+    echo never
+EOF
+
+check unexpected_done "unexpected_done.sh: line 2: syntax error near unexpected token \`done'
+status 2" <<'EOF'
+echo never
+done
+EOF
+
+check missing_esac "missing_esac.sh: line 2: syntax error near unexpected token \`end of file'
+status 2" <<'EOF'
+case x in a) echo never;;
+EOF
+
+check unclosed_function "unclosed_function.sh: line 2: syntax error near unexpected token \`end of file'
+status 2" <<'EOF'
+f() { echo never
+EOF
+
+check for_without_name "for_without_name.sh: line 1: syntax error near unexpected token \`;'
+status 2" <<'EOF'
+for; do echo never; done
+EOF
+
+[ "$failed" = 0 ] || { echo "$failed failed"; exit 1; }